@@ -28,18 +28,7 @@
 
 #define DEFAULT_MOUNTPOINT "isomount"
 
-/* for using in errors */
-typedef enum {
-  IM_ERROR_UNKNOWN,
-  IM_ERROR_MOUNTPOINT_EXISTS,
-  IM_ERROR_MOUNTPOINT_ACCESS,
-  IM_ERROR_IMAGE,
-} im_error;
-
-GQuark im_error_quark();
-
-#define IM_ERROR_DOMAIN (im_error_quark())
-
-
+/* the error domain is shared with libisomounter */
+#include "im_image.h"
 
 #endif /*__COMMON_H__*/
@@ -0,0 +1,466 @@
+/* if_export.c - directories read as tar archives
+ *
+ * Copyright (C) 2016 Leo Cacciari <leo.cacciari@gmail.com>
+ *
+ * This file belongs to the isomounter project.
+ * isomounter is free software and is distributed under the terms of the
+ * GNU GPL. See the file COPYING for details.
+ */
+#include "common.h"
+#include "if_export.h"
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+/* ustar (POSIX.1-2001) */
+#define TAR_BLOCK 512
+#define TAR_NAME_LEN 100
+#define TAR_MAX_OCTAL_SIZE G_GUINT64_CONSTANT(077777777777)
+#define TAR_DIR_MODE 0755
+#define TAR_FILE_MODE 0644
+#define TAR_TRAILER (2 * TAR_BLOCK)
+#define TAR_SECTOR 2048 // of the image, for telling directories apart
+#define TAR_ROUND(n) (((n) + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK)
+
+typedef struct member_s {
+  const gchar * name; // in the archive, directories ending with '/'
+  im_entry entry;
+  guint32 pax_size;   // of the pax records, 0 for none
+} member;
+
+/* a directory of the subtree, with its members not yet written */
+typedef struct level_s {
+  gchar * path;       // in the image
+  const gchar * name; // in the archive, ending with '/' but at the top
+  guint64 extent;
+  GStringChunk * names;
+  GArray * members;   // its files by offset, then its directories; NULL until listed
+  guint next;
+} level;
+
+/*
+ * A reader of the archive: where it is, and the directories from the
+ * top down to that of the member it is in.
+ */
+struct if_export_s {
+  gchar * target;     // the directory in the image
+  im_entry top;
+  GMutex lock;        // for the fields below
+  GPtrArray * levels; // NULL before the first read
+  gboolean in_member; // FALSE: past the members, in the trailer
+  member current;
+  guint64 start;      // of current in the archive, or of the trailer
+};
+
+static void level_free(gpointer data) {
+  level * l = (level *) data;
+  if (l->members != NULL) {
+    g_array_free(l->members,TRUE);
+  }
+  g_string_chunk_free(l->names);
+  g_free(l->path);
+  g_free(l);
+}
+
+void if_export_free(if_export * export) {
+  if (export != NULL) {
+    if (export->levels != NULL) {
+      g_ptr_array_free(export->levels,TRUE);
+    }
+    g_mutex_clear(&export->lock);
+    g_free(export->target);
+    g_free(export);
+  }
+}
+
+/* a pax record, "length key=value\n", counts its own length */
+static gsize pax_record_size(const gchar * key, gsize value_len) {
+  gsize n = strlen(key) + value_len + 3;
+  gsize digits = 1;
+  for (gsize limit = 10; n + digits >= limit; limit *= 10) digits++;
+  return n + digits;
+}
+
+static void pax_record(GString * out, const gchar * key, const gchar * value) {
+  gsize size = pax_record_size(key,strlen(value));
+  g_string_append_printf(out,"%" G_GSIZE_FORMAT " %s=%s\n",size,key,value);
+}
+
+static void set_pax_size(member * m) {
+  gsize len = strlen(m->name);
+  m->pax_size = 0;
+  if (len > TAR_NAME_LEN) {
+    m->pax_size += pax_record_size("path",len);
+  }
+  if (!m->entry.is_dir && m->entry.size > TAR_MAX_OCTAL_SIZE) {
+    gchar digits[24];
+    m->pax_size += pax_record_size("size",g_snprintf(digits,sizeof(digits),"%" G_GUINT64_FORMAT,
+						     m->entry.size));
+  }
+}
+
+static guint64 header_size(const member * m) {
+  return (m->pax_size > 0 ? TAR_BLOCK + TAR_ROUND(m->pax_size) : 0) + TAR_BLOCK;
+}
+
+static guint64 data_size(const member * m) {
+  return m->entry.is_dir ? 0 : TAR_ROUND(m->entry.size);
+}
+
+static void octal(guint8 * field, gsize len, guint64 value) {
+  // len - 1 digits and a NUL
+  for (gsize idx = len - 1; idx > 0; idx--) {
+    field[idx - 1] = '0' + (value & 7);
+    value >>= 3;
+  }
+  field[len - 1] = '\0';
+}
+
+static void ustar_header(guint8 * h, const gchar * name, gsize name_len,
+			 guint64 size, time_t mtime, guint mode, gchar type) {
+  memset(h,0,TAR_BLOCK);
+  memcpy(h,name,MIN(name_len,TAR_NAME_LEN));
+  octal(h + 100,8,mode);
+  octal(h + 108,8,0);
+  octal(h + 116,8,0);
+  octal(h + 124,12,MIN(size,TAR_MAX_OCTAL_SIZE));
+  octal(h + 136,12,MAX(mtime,0));
+  h[156] = type;
+  memcpy(h + 257,"ustar",6);
+  memcpy(h + 263,"00",2);
+  // the checksum counts itself as spaces
+  memset(h + 148,' ',8);
+  guint sum = 0;
+  for (guint idx = 0; idx < TAR_BLOCK; idx++) sum += h[idx];
+  octal(h + 148,7,sum);
+}
+
+/* the headers of m, header_size(m) bytes */
+static guint8 * make_headers(const member * m) {
+  gsize size = header_size(m);
+  guint8 * out = g_malloc0(size);
+  guint8 * h = out;
+  gsize len = strlen(m->name);
+  if (m->pax_size > 0) {
+    GString * pax = g_string_sized_new(m->pax_size);
+    if (len > TAR_NAME_LEN) {
+      pax_record(pax,"path",m->name);
+    }
+    if (!m->entry.is_dir && m->entry.size > TAR_MAX_OCTAL_SIZE) {
+      gchar digits[24];
+      g_snprintf(digits,sizeof(digits),"%" G_GUINT64_FORMAT,m->entry.size);
+      pax_record(pax,"size",digits);
+    }
+    g_assert(pax->len == m->pax_size);
+    ustar_header(h,"PaxHeader",9,pax->len,m->entry.mtime,TAR_FILE_MODE,'x');
+    memcpy(h + TAR_BLOCK,pax->str,pax->len);
+    h += TAR_BLOCK + TAR_ROUND(pax->len);
+    g_string_free(pax,TRUE);
+  }
+  ustar_header(h,m->name,len,m->entry.is_dir ? 0 : m->entry.size,m->entry.mtime,
+	       m->entry.is_dir ? TAR_DIR_MODE : TAR_FILE_MODE,m->entry.is_dir ? '5' : '0');
+  return out;
+}
+
+/*
+ * Walking the subtree
+ */
+/* a directory to write next, not listed yet; takes path */
+static void level_push(if_export * export, gchar * path, const gchar * name,
+		       guint64 extent) {
+  level * l = g_new0(level,1);
+  l->path = path;
+  l->names = g_string_chunk_new(1024);
+  l->name = g_string_chunk_insert(l->names,name);
+  l->extent = extent;
+  g_ptr_array_add(export->levels,l);
+}
+
+typedef struct lister_s {
+  const if_export * export;
+  level * level;
+  GArray * dirs;
+} lister;
+
+static int list_one(gpointer data, const gchar * name, const im_entry * entry) {
+  lister * li = (lister *) data;
+  level * l = li->level;
+  if (entry->is_dir) {
+    // a directory containing itself, in a broken image, is left out
+    for (guint idx = 0; idx < li->export->levels->len; idx++) {
+      const level * up = g_ptr_array_index(li->export->levels,idx);
+      if (up->extent / TAR_SECTOR == entry->offset / TAR_SECTOR) {
+	return 0;
+      }
+    }
+  }
+  gchar * archive_name = entry->is_dir ?
+    g_strconcat(l->name,name,"/",NULL) : g_strconcat(l->name,name,NULL);
+  member m = { g_string_chunk_insert(l->names,archive_name), *entry, 0 };
+  g_free(archive_name);
+  set_pax_size(&m);
+  g_array_append_val(entry->is_dir ? li->dirs : l->members,m);
+  return 0;
+}
+
+static gint by_offset(gconstpointer a, gconstpointer b) {
+  const member * ma = a, * mb = b;
+  if (ma->entry.offset != mb->entry.offset) {
+    return ma->entry.offset < mb->entry.offset ? -1 : 1;
+  }
+  return strcmp(ma->name,mb->name);
+}
+
+/* the members of l: its files in the order they are in the image, then its directories */
+static int level_list(im_image * image, if_export * export, level * l) {
+  l->members = g_array_new(FALSE,FALSE,sizeof(member));
+  lister li = { export, l, g_array_new(FALSE,FALSE,sizeof(member)) };
+  int result = im_image_readdir(image,l->path,list_one,&li);
+  g_array_sort(l->members,by_offset);
+  g_array_append_vals(l->members,li.dirs->data,li.dirs->len);
+  g_array_free(li.dirs,TRUE);
+  return result;
+}
+
+/* go on to the member after current, listing directories as needed */
+static int advance(im_image * image, if_export * export) {
+  if (export->in_member) {
+    export->start += header_size(&export->current) + data_size(&export->current);
+    export->in_member = FALSE;
+  }
+  while (export->levels->len > 0) {
+    level * l = g_ptr_array_index(export->levels,export->levels->len - 1);
+    if (l->members == NULL) {
+      int result = level_list(image,export,l);
+      if (result != 0) {
+	return result;
+      }
+    }
+    if (l->next == l->members->len) {
+      g_ptr_array_remove_index(export->levels,export->levels->len - 1);
+      continue;
+    }
+    const member * m = &g_array_index(l->members,member,l->next++);
+    if (l->next == 1) {
+      g_debug("export of %s: %u members in %s",export->target,l->members->len,l->path);
+    }
+    export->current = *m;
+    export->in_member = TRUE;
+    if (m->entry.is_dir) {
+      // written next, after its header
+      const gchar * base = m->name + strlen(l->name);
+      gchar * name = g_strndup(base,strlen(base) - 1);
+      level_push(export,g_build_path("/",l->path,name,NULL),m->name,m->entry.offset);
+      g_free(name);
+    }
+    break;
+  }
+  return 0;
+}
+
+/* back to the start of the archive */
+static int rewind_export(im_image * image, if_export * export) {
+  if (export->levels != NULL) {
+    g_ptr_array_free(export->levels,TRUE);
+  }
+  export->levels = g_ptr_array_new_with_free_func(level_free);
+  export->start = 0;
+  export->in_member = FALSE;
+  // the top directory is named after itself, but for the root
+  const gchar * base = strrchr(export->target,'/');
+  base = base != NULL ? base + 1 : export->target;
+  if (*base == '\0') {
+    level_push(export,g_strdup("/"),"",export->top.offset);
+    return advance(image,export);
+  }
+  gchar * top = g_strconcat(base,"/",NULL);
+  level_push(export,g_strdup(export->target),top,export->top.offset);
+  g_free(top);
+  level * l = g_ptr_array_index(export->levels,0);
+  member m = { l->name, export->top, 0 };
+  set_pax_size(&m);
+  export->current = m;
+  export->in_member = TRUE;
+  return 0;
+}
+
+static if_export * export_new(const gchar * target, const im_entry * dir) {
+  if_export * export = g_new0(if_export,1);
+  export->target = g_strdup(target);
+  export->top = *dir;
+  g_mutex_init(&export->lock);
+  return export;
+}
+
+typedef enum {
+  EXPORT_NONE,
+  EXPORT_TOP,  // /.isomounter
+  EXPORT_DIR,  // mirroring target
+  EXPORT_TAR,  // the archive of target
+} export_kind;
+
+/* what path is, and the path in the image it is about */
+static export_kind resolve(const gchar * path, gchar ** target) {
+  *target = NULL;
+  if (!g_str_has_prefix(path,IF_EXPORT_TOP)) {
+    return EXPORT_NONE;
+  }
+  const gchar * rest = path + strlen(IF_EXPORT_TOP);
+  if (*rest == '\0') {
+    return EXPORT_TOP;
+  }
+  if (*rest != '/' || !g_str_has_prefix(rest + 1,IF_EXPORT_DIR)) {
+    return EXPORT_NONE;
+  }
+  rest += 1 + strlen(IF_EXPORT_DIR);
+  if (*rest != '\0' && *rest != '/') {
+    return EXPORT_NONE;
+  }
+  export_kind kind = EXPORT_DIR;
+  gsize len = strlen(rest);
+  if (g_str_has_suffix(rest,"/" IF_EXPORT_FILE)) {
+    kind = EXPORT_TAR;
+    len -= strlen("/" IF_EXPORT_FILE);
+  }
+  *target = len > 0 ? g_strndup(rest,len) : g_strdup("/");
+  return kind;
+}
+
+/* the directory of the image target is, for export and tar entries */
+static int target_dir(im_image * image, const gchar * target, im_entry * entry) {
+  int result = im_image_lookup(image,target,entry);
+  if (result == 0 && !entry->is_dir) {
+    result = -ENOENT;
+  }
+  return result;
+}
+
+int if_export_lookup(im_image * image, const gchar * path, im_entry * entry,
+		     if_export ** export) {
+  gchar * target;
+  export_kind kind = resolve(path,&target);
+  int result = 0;
+  switch (kind) {
+  case EXPORT_NONE:
+    return IF_EXPORT_MISS;
+  case EXPORT_TOP:
+    result = im_image_lookup(image,"/",entry);
+    break;
+  case EXPORT_DIR:
+    result = target_dir(image,target,entry);
+    break;
+  case EXPORT_TAR:
+    result = target_dir(image,target,entry);
+    if (result == 0) {
+      if (export != NULL) {
+	*export = export_new(target,entry);
+      }
+      // its size is known once it has been read
+      entry->is_dir = FALSE;
+      entry->fragmented = FALSE;
+      entry->offset = 0;
+      entry->size = 0;
+    }
+    break;
+  }
+  g_free(target);
+  return result;
+}
+
+/* pass on the subdirectories only */
+typedef struct dir_filter_s {
+  im_dir_filler filler;
+  gpointer data;
+} dir_filter;
+
+static int filter_dirs(gpointer data, const gchar * name, const im_entry * entry) {
+  dir_filter * f = (dir_filter *) data;
+  return entry->is_dir ? f->filler(f->data,name,entry) : 0;
+}
+
+int if_export_readdir(im_image * image, const gchar * path,
+		      im_dir_filler filler, gpointer data) {
+  gchar * target;
+  export_kind kind = resolve(path,&target);
+  im_entry entry;
+  int result = 0;
+  switch (kind) {
+  case EXPORT_NONE:
+    return IF_EXPORT_MISS;
+  case EXPORT_TOP:
+    result = im_image_lookup(image,"/",&entry);
+    if (result == 0) {
+      entry.size = 0;
+      filler(data,IF_EXPORT_DIR,&entry);
+    }
+    break;
+  case EXPORT_DIR:
+    result = target_dir(image,target,&entry);
+    if (result == 0 && filler(data,IF_EXPORT_FILE,&entry) == 0) {
+      dir_filter f = { filler, data };
+      result = im_image_readdir(image,target,filter_dirs,&f);
+    }
+    break;
+  case EXPORT_TAR:
+    result = -ENOTDIR;
+    break;
+  }
+  g_free(target);
+  return result;
+}
+
+gssize if_export_read(im_image * image, if_export * export,
+		      gchar * buf, gsize size, guint64 offset) {
+  g_mutex_lock(&export->lock);
+  int result = 0;
+  if (export->levels == NULL || offset < export->start) {
+    result = rewind_export(image,export);
+  }
+  // the members before offset are skipped, without reading them
+  while (result == 0 && export->in_member &&
+	 offset >= export->start + header_size(&export->current) + data_size(&export->current)) {
+    result = advance(image,export);
+  }
+  gsize done = 0;
+  while (result == 0 && done < size && export->in_member) {
+    const member * m = &export->current;
+    guint64 headers = header_size(m);
+    guint64 skip = offset + done - export->start;
+    if (skip < headers) {
+      guint8 * h = make_headers(m);
+      gsize len = MIN(size - done,headers - skip);
+      memcpy(buf + done,h + skip,len);
+      g_free(h);
+      done += len;
+      skip += len;
+    }
+    if (done < size && skip < headers + data_size(m)) {
+      guint64 at = skip - headers;
+      gsize len = MIN(size - done,data_size(m) - at);
+      gsize from_file = at < m->entry.size ? MIN(len,m->entry.size - at) : 0;
+      if (from_file > 0) {
+	gssize n = im_image_read(image,&m->entry,buf + done,from_file,at);
+	if (n < 0) {
+	  result = n;
+	  break;
+	}
+      }
+      // the padding to the block
+      memset(buf + done + from_file,0,len - from_file);
+      done += len;
+      skip += len;
+    }
+    if (skip == headers + data_size(m)) {
+      result = advance(image,export);
+    }
+  }
+  // the two empty blocks at the end
+  if (result == 0 && !export->in_member && offset + done < export->start + TAR_TRAILER) {
+    gsize len = MIN(size - done,export->start + TAR_TRAILER - (offset + done));
+    memset(buf + done,0,len);
+    done += len;
+  }
+  g_mutex_unlock(&export->lock);
+  return done > 0 || result == 0 ? (gssize) done : result;
+}
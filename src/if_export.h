@@ -0,0 +1,64 @@
+/* if_export.h - directories read as tar archives
+ *
+ * Copyright (C) 2016 Leo Cacciari <leo.cacciari@gmail.com>
+ *
+ * This file belongs to the isomounter project.
+ * isomounter is free software and is distributed under the terms of the
+ * GNU GPL. See the file COPYING for details.
+ */
+#ifndef __IF_EXPORT_H__
+#define __IF_EXPORT_H__
+#include "common.h"
+#include "im_image.h"
+
+#define IF_EXPORT_TOP "/.isomounter"
+#define IF_EXPORT_DIR "export"
+#define IF_EXPORT_FILE ".tar"
+
+/* what the functions below return for paths that aren't theirs */
+#define IF_EXPORT_MISS 1
+
+/**
+ * A hidden tree, not listed in the root: /.isomounter/export mirrors
+ * the directories of the image, and each of them has a file .tar,
+ * a tar archive (POSIX, with pax headers for long names and big files)
+ * of the directory in the image. /.isomounter/export/.tar is the
+ * whole image, /.isomounter/export/a/b/.tar is /a/b, with members
+ * named b/...
+ *
+ * Each directory comes with its files in the order they are in the
+ * image, then its subdirectories, so that reading the archive whole
+ * reads the image mostly from start to end. It is made on the fly as
+ * it is read, listing a directory when its turn comes: what stays in
+ * memory is the listing of the directories from the top down to the
+ * one being written, however big or deep the subtree.
+ *
+ * So its size isn't known before it has been read: like the files
+ * in /proc, it shows as empty, and is opened for direct I/O, to be
+ * read until the end. Reading is meant to be sequential: going back
+ * walks the subtree again from the start.
+ */
+typedef struct if_export_s if_export;
+
+/**
+ * Fill entry for a path in the hidden tree, and give a new reader of
+ * its archive in export, if not NULL and it is one.
+ */
+int if_export_lookup(im_image * image, const gchar * path, im_entry * entry,
+		     if_export ** export);
+
+/**
+ * List a directory of the hidden tree.
+ */
+int if_export_readdir(im_image * image, const gchar * path,
+		      im_dir_filler filler, gpointer data);
+
+/**
+ * Read up to size bytes of the archive, from offset; fewer at its end.
+ */
+gssize if_export_read(im_image * image, if_export * export,
+		      gchar * buf, gsize size, guint64 offset);
+
+void if_export_free(if_export * export);
+
+#endif /*__IF_EXPORT_H__*/
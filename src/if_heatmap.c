@@ -0,0 +1,173 @@
+/* if_heatmap.c - what gets read, and in which order
+ *
+ * Copyright (C) 2016 Leo Cacciari <leo.cacciari@gmail.com>
+ *
+ * This file belongs to the isomounter project.
+ * isomounter is free software and is distributed under the terms of the
+ * GNU GPL. See the file COPYING for details.
+ */
+#include "common.h"
+#include "if_heatmap.h"
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#define SECTOR_SIZE 2048
+
+/*
+ * Reads only bump counters, with atomics; opens take the lock the
+ * first time a path is seen, which is once per file.
+ */
+struct if_heatmap_s {
+  guint64 range;  // bytes per counter, a multiple of the sector
+  guint n_ranges;
+  gint * reads;
+  GMutex lock;    // for the fields below
+  GHashTable * seen; // paths opened, owned by order
+  GPtrArray * order; // of first open
+};
+
+if_heatmap * if_heatmap_new(guint64 image_size) {
+  if_heatmap * heatmap = g_new0(if_heatmap,1);
+  heatmap->range = IF_HEATMAP_MIN_RANGE;
+  while ((image_size + heatmap->range - 1) / heatmap->range > IF_HEATMAP_MAX_RANGES) {
+    heatmap->range *= 2;
+  }
+  heatmap->n_ranges = MAX((image_size + heatmap->range - 1) / heatmap->range,1);
+  heatmap->reads = g_new0(gint,heatmap->n_ranges);
+  g_mutex_init(&heatmap->lock);
+  heatmap->seen = g_hash_table_new(g_str_hash,g_str_equal);
+  heatmap->order = g_ptr_array_new_with_free_func(g_free);
+  return heatmap;
+}
+
+void if_heatmap_free(if_heatmap * heatmap) {
+  if (heatmap == NULL) {
+    return;
+  }
+  g_hash_table_destroy(heatmap->seen);
+  g_ptr_array_free(heatmap->order,TRUE);
+  g_mutex_clear(&heatmap->lock);
+  g_free(heatmap->reads);
+  g_free(heatmap);
+}
+
+void if_heatmap_open(if_heatmap * heatmap, const gchar * path) {
+  g_mutex_lock(&heatmap->lock);
+  if (!g_hash_table_contains(heatmap->seen,path)) {
+    gchar * copy = g_strdup(path);
+    g_ptr_array_add(heatmap->order,copy);
+    g_hash_table_add(heatmap->seen,copy);
+  }
+  g_mutex_unlock(&heatmap->lock);
+}
+
+void if_heatmap_read(if_heatmap * heatmap, guint64 offset, guint64 size) {
+  if (size == 0) {
+    return;
+  }
+  guint64 first = offset / heatmap->range;
+  guint64 last = (offset + size - 1) / heatmap->range;
+  for (guint64 idx = first; idx <= last && idx < heatmap->n_ranges; idx++) {
+    g_atomic_int_inc(&heatmap->reads[idx]);
+  }
+}
+
+/* as saved: range, n_ranges, n_paths, the counters, then each path as length and bytes */
+typedef struct saved_heatmap_s {
+  guint64 range;
+  guint32 n_ranges;
+  guint32 n_paths;
+} saved_heatmap;
+
+void if_heatmap_save(if_heatmap * heatmap, GByteArray * out) {
+  g_mutex_lock(&heatmap->lock);
+  saved_heatmap saved = { heatmap->range, heatmap->n_ranges, heatmap->order->len };
+  g_byte_array_append(out,(const guint8 *) &saved,sizeof(saved));
+  for (guint idx = 0; idx < heatmap->n_ranges; idx++) {
+    gint32 reads = g_atomic_int_get(&heatmap->reads[idx]);
+    g_byte_array_append(out,(const guint8 *) &reads,sizeof(reads));
+  }
+  for (guint idx = 0; idx < heatmap->order->len; idx++) {
+    const gchar * file = g_ptr_array_index(heatmap->order,idx);
+    guint32 len = strlen(file);
+    g_byte_array_append(out,(const guint8 *) &len,sizeof(len));
+    g_byte_array_append(out,(const guint8 *) file,len);
+  }
+  g_mutex_unlock(&heatmap->lock);
+}
+
+gboolean if_heatmap_load(if_heatmap * heatmap, const guint8 * data, gsize size) {
+  saved_heatmap saved;
+  if (size < sizeof(saved)) {
+    return FALSE;
+  }
+  memcpy(&saved,data,sizeof(saved));
+  if (saved.range != heatmap->range || saved.n_ranges != heatmap->n_ranges ||
+      (size - sizeof(saved)) / sizeof(gint32) < saved.n_ranges) {
+    return FALSE;
+  }
+  const guint8 * counts = data + sizeof(saved);
+  const guint8 * paths = counts + saved.n_ranges * sizeof(gint32);
+  const guint8 * end = data + size;
+  // all of it checked before anything is added
+  const guint8 * p = paths;
+  for (guint idx = 0; idx < saved.n_paths; idx++) {
+    guint32 len;
+    if ((gsize) (end - p) < sizeof(len)) {
+      return FALSE;
+    }
+    memcpy(&len,p,sizeof(len));
+    p += sizeof(len);
+    if ((gsize) (end - p) < len) {
+      return FALSE;
+    }
+    p += len;
+  }
+  for (guint idx = 0; idx < saved.n_ranges; idx++) {
+    gint32 reads;
+    memcpy(&reads,counts + idx * sizeof(reads),sizeof(reads));
+    g_atomic_int_add(&heatmap->reads[idx],reads);
+  }
+  p = paths;
+  for (guint idx = 0; idx < saved.n_paths; idx++) {
+    guint32 len;
+    memcpy(&len,p,sizeof(len));
+    p += sizeof(len);
+    gchar * file = g_strndup((const gchar *) p,len);
+    if_heatmap_open(heatmap,file);
+    g_free(file);
+    p += len;
+  }
+  return TRUE;
+}
+
+gboolean if_heatmap_write(if_heatmap * heatmap, const gchar * path, GError ** error) {
+  GString * text = g_string_new("# first_lsn last_lsn reads\n");
+  guint64 sectors = heatmap->range / SECTOR_SIZE;
+  for (guint idx = 0; idx < heatmap->n_ranges; idx++) {
+    gint reads = g_atomic_int_get(&heatmap->reads[idx]);
+    if (reads > 0) {
+      g_string_append_printf(text,"%" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %d\n",
+			     idx * sectors,(idx + 1) * sectors - 1,reads);
+    }
+  }
+  gboolean ok = g_file_set_contents(path,text->str,text->len,error);
+  g_string_truncate(text,0);
+  g_mutex_lock(&heatmap->lock);
+  guint n = heatmap->order->len;
+  for (guint idx = 0; idx < n; idx++) {
+    const gchar * file = g_ptr_array_index(heatmap->order,idx);
+    // relative to the root
+    g_string_append_printf(text,"%s %u\n",file + (file[0] == '/'),n - idx);
+  }
+  g_mutex_unlock(&heatmap->lock);
+  if (ok) {
+    gchar * sort = g_strconcat(path,".sort",NULL);
+    ok = g_file_set_contents(sort,text->str,text->len,error);
+    g_free(sort);
+  }
+  g_string_free(text,TRUE);
+  return ok;
+}
@@ -0,0 +1,58 @@
+/* if_heatmap.h - what gets read, and in which order
+ *
+ * Copyright (C) 2016 Leo Cacciari <leo.cacciari@gmail.com>
+ *
+ * This file belongs to the isomounter project.
+ * isomounter is free software and is distributed under the terms of the
+ * GNU GPL. See the file COPYING for details.
+ */
+#ifndef __IF_HEATMAP_H__
+#define __IF_HEATMAP_H__
+#include "common.h"
+#include "im_image.h"
+
+/* the smallest range of the image counted on its own */
+#define IF_HEATMAP_MIN_RANGE (1024 * 1024)
+/* ranges are made larger for images that would need more */
+#define IF_HEATMAP_MAX_RANGES 65536
+
+/**
+ * Reads counted by range of the image, and files in the order they
+ * were first opened, for laying the next images out the way they get
+ * used: files opened one after the other end up one after the other.
+ */
+typedef struct if_heatmap_s if_heatmap;
+
+if_heatmap * if_heatmap_new(guint64 image_size);
+void if_heatmap_free(if_heatmap * heatmap);
+
+/* path was opened */
+void if_heatmap_open(if_heatmap * heatmap, const gchar * path);
+/* size bytes at offset in the image were read */
+void if_heatmap_read(if_heatmap * heatmap, guint64 offset, guint64 size);
+
+/* append the counts to out, for if_heatmap_load in another process */
+void if_heatmap_save(if_heatmap * heatmap, GByteArray * out);
+/**
+ * Add the counts saved by if_heatmap_save to those of heatmap, made
+ * for an image of the same size. FALSE if data isn't such counts.
+ */
+gboolean if_heatmap_load(if_heatmap * heatmap, const guint8 * data, gsize size);
+
+/**
+ * Write the reads to path, one line per range read, "first_lsn
+ * last_lsn reads", and the files to path.sort, one line per file
+ * opened, "path weight", for mkisofs -sort (or xorriso, in its
+ * mkisofs emulation): the first opened, the heaviest, is the first
+ * written. Paths are relative to the root of the image; put the
+ * source directory in front as needed.
+ *
+ * The paths are the names as mounted: the Rock Ridge ones if the image
+ * has them, else the ISO9660 identifiers translated to lower case,
+ * without version. They match the source tree of an image made with
+ * Rock Ridge (mkisofs -R); for one without, rename them to the source
+ * names before using the sort file.
+ */
+gboolean if_heatmap_write(if_heatmap * heatmap, const gchar * path, GError ** error);
+
+#endif /*__IF_HEATMAP_H__*/
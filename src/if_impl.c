@@ -47,14 +47,32 @@
  */
 static void * if_init(struct fuse_conn_info *conn) {
   if_status * status = get_status();
-  g_debug("opening imagefile %s",status->path);
-  status->fh = iso9660_open(status->path);
-  if (status->fh == NULL) {
+  GError * error = NULL;
+  // taking over, it's already open
+  if (status->image == NULL) {
+    g_debug("opening imagefile %s",status->path);
+    status->image = im_image_open_full(status->path,&status->open_options,&error);
+  }
+  if (status->image == NULL) {
     // TODO check return value
-    g_error("Failed to open image at %s",status->path);
+    g_error("Failed to open image: %s",error->message);
     status->phase = IN_ERROR;
     return NULL;
   }
+  // the prescan goes on in the background while requests get served
+  if (status->prescan_threads > 0 &&
+      !im_image_prescan(status->image,status->prescan_threads,&error)) {
+    g_warning("prescan not started: %s",error->message);
+    g_clear_error(&error);
+  }
+  status->pressure = if_pressure_start(status->image);
+  if (status->heatmap_path != NULL) {
+    status->heatmap = if_heatmap_new(im_image_size(status->image));
+  }
+  // let file data go from the image to the kernel without copies
+  if (conn->capable & FUSE_CAP_SPLICE_WRITE) {
+    conn->want |= FUSE_CAP_SPLICE_WRITE;
+  }
   status->phase = AFTER_MOUNT;
   return status;
 }
@@ -68,11 +86,26 @@ static void * if_init(struct fuse_conn_info *conn) {
  */
 static void if_destroy(void * data) {
   if_status * status = (if_status *) data;
+  // the new process carries on with the heatmap, and writes it
+  gboolean handed_over = status->phase == HANDED_OVER;
   g_debug("if_destroy called");
   g_debug("closing image at %s",status->path);
+  if_pressure_stop(status->pressure);
+  status->pressure = NULL;
+  if (status->heatmap != NULL && !handed_over) {
+    GError * error = NULL;
+    if (!if_heatmap_write(status->heatmap,status->heatmap_path,&error)) {
+      g_warning("heatmap not written: %s",error->message);
+      g_clear_error(&error);
+    }
+  }
+  if_heatmap_free(status->heatmap);
+  status->heatmap = NULL;
   // TODO check errors?
-  iso9660_close(status->fh);
-  status->phase = AFTER_UMOUNT;
+  im_image_close(status->image);
+  status->image = NULL;
+  if_handles_clear();
+  if (!handed_over) status->phase = AFTER_UMOUNT;
 }
 
 
@@ -83,17 +116,19 @@ static void if_destroy(void * data) {
  * mount option is given.
  */
 static int if_getattr(const char * path, struct stat * p_stat) {
-  iso9660_t * iso = get_status()->fh;
+  im_image * image = get_status()->image;
   g_debug("getatr called for %s",path);
-  iso9660_stat_t * info =  iso9660_ifs_stat(iso,path);
-  if (info == NULL) {
+  im_entry info;
+  int result = if_export_lookup(image,path,&info,NULL);
+  if (result == IF_EXPORT_MISS) {
+    result = im_image_lookup(image,path,&info);
+  }
+  if (result != 0) {
     // file not found
     g_debug("file not found: %s",path);
-    return -ENOENT;
+    return result;
   }
-  int result = translate_stat(info,p_stat);
-  g_free(info);
-  return result;
+  return translate_stat(&info,p_stat);
 }
 
 /*
@@ -112,34 +147,39 @@ static int if_getattr(const char * path, struct stat * p_stat) {
  * Introduced in version 2.3
  */
 static int if_opendir(const char * path, struct fuse_file_info * info) {
-  iso9660_t * iso = get_status()->fh;
-  iso9660_stat_t * stats = iso9660_ifs_stat(iso,path);  
-  if (stats == NULL) {
-    return - ENOENT;
-  }
-  if (!IS_DIRECTORY(stats)) {
-    g_free(stats);
-    return - ENOTDIR;
+  im_image * image = get_status()->image;
+  im_entry stats;
+  int rc = if_export_lookup(image,path,&stats,NULL);
+  if (rc == IF_EXPORT_MISS) {
+    rc = im_image_lookup(image,path,&stats);
   }
-  char * path_copy = g_strdup(path);
-  if (path_copy == NULL) {
-    g_free(stats);
-    return -ENOMEM;
+  if (rc != 0) {
+    return rc;
   }
-  if_dir * data = g_malloc0(sizeof(if_dir));
-  if (data == NULL) {
-    g_free(path_copy);
-    g_free(stats);
-    return -ENOMEM;
+  if (!IS_DIRECTORY(&stats)) {
+    return - ENOTDIR;
   }
-  data->path = path_copy;
-  data->info = stats;
   // we don't realy need this, but maybe we could use it for not
   // reading a directory completly
-  info->fh = (intptr_t) data;
+  info->fh = (intptr_t) if_handle_new(&stats);
   return 0;
 }
 
+/* im_image_readdir() callback, passing entries on to fuse */
+typedef struct if_fill_ctx_s {
+  void * buf;
+  fuse_fill_dir_t filler;
+  gboolean full;
+} if_fill_ctx;
+
+static int fill_one(gpointer data, const gchar * name, const im_entry * entry) {
+  if_fill_ctx * ctx = (if_fill_ctx *) data;
+  if (ctx->filler(ctx->buf,name,NULL,0) != 0) {
+    ctx->full = TRUE;
+  }
+  return ctx->full;
+}
+
 /** Read directory
  *
  * This supersedes the old getdir() interface.  New applications
@@ -164,33 +204,18 @@ static int if_opendir(const char * path, struct fuse_file_info * info) {
 static int if_readdir(const char * path, void * buf, fuse_fill_dir_t filler,
 	       off_t offset,struct fuse_file_info * info) {
   g_debug("if_readdir called");
-  CdioList_t * list;
-  CdioListNode_t * node;
-  int result = 0;
-  iso9660_t * iso = get_status()->fh;
-  if_dir * data = (if_dir *) (uintptr_t) info->fh;
-  list = iso9660_ifs_readdir(iso,data->path);
-  if (list == NULL) {
-    return - EIO;
-  }
-#ifdef _DIRENT_HAVE_D_TYPE
-  // we could use this for retuning the data one at the time
-  off_t off = 0;
-#endif
-  _CDIO_LIST_FOREACH(node,list) {
-    struct dirent dh;
-    iso9660_stat_t * stats = (iso9660_stat_t *) _cdio_list_node_data(node);
-    iso9660_name_translate(stats->filename,dh.d_name);
-#ifdef _DIRENT_HAVE_D_TYPE
-    dh.d_off = off++;
-#endif
-    int rc = filler(buf,dh.d_name,NULL,0);
-    if (rc != 0) {
-      result = - ENOMEM;
-      break;
-    }
+  im_image * image = get_status()->image;
+  if (filler(buf,".",NULL,0) != 0 || filler(buf,"..",NULL,0) != 0) {
+    return - ENOMEM;
+  }
+  if_fill_ctx ctx = { buf, filler, FALSE };
+  int result = if_export_readdir(image,path,fill_one,&ctx);
+  if (result == IF_EXPORT_MISS) {
+    result = im_image_readdir(image,path,fill_one,&ctx);
+  }
+  if (result == 0 && ctx.full) {
+    result = - ENOMEM;
   }
-  _cdio_list_free(list,true);
   return result;
 }
 
@@ -200,12 +225,8 @@ static int if_readdir(const char * path, void * buf, fuse_fill_dir_t filler,
  */
 static int if_releasedir(const char * path, struct fuse_file_info * info) {
   g_debug("if_releasedir called");
-  iso9660_t * iso = get_status()->fh;
-  if_dir * data = (if_dir *) (uintptr_t) info->fh;
   // just destroy the user data
-  g_free(data->path);
-  g_free(data->info);
-  g_free(data);
+  if_handle_free((if_handle *) (uintptr_t) info->fh);
   return 0;
 }
 
@@ -230,16 +251,32 @@ static int if_releasedir(const char * path, struct fuse_file_info * info) {
  * Changed in version 2.2
  */
 static int if_open(const char * path, struct fuse_file_info * info) {
-  iso9660_t * iso = get_status()->fh;
-  iso9660_stat_t * stats = iso9660_ifs_stat(iso,path);  
-  if (stats == NULL) {
-    return - ENOENT;
+  im_image * image = get_status()->image;
+  im_entry stats;
+  if_export * export = NULL;
+  int rc = if_export_lookup(image,path,&stats,&export);
+  if (rc == 0 && export != NULL) {
+    info->fh = (intptr_t) if_handle_new(&stats);
+    ((if_handle *) (uintptr_t) info->fh)->export = export;
+    // its size isn't known: read it to the end
+    info->direct_io = 1;
+    return 0;
+  }
+  if (rc == IF_EXPORT_MISS) {
+    rc = im_image_lookup(image,path,&stats);
+  }
+  if (rc != 0) {
+    return rc;
   }
-  if (IS_DIRECTORY(stats)) {
-    g_free(stats);
+  if (IS_DIRECTORY(&stats)) {
     return - EISDIR;
   }
-  info->fh = (intptr_t) stats;
+  // files are mostly read whole
+  im_image_advise(image,&stats,TRUE);
+  if (get_status()->heatmap != NULL) {
+    if_heatmap_open(get_status()->heatmap,path);
+  }
+  info->fh = (intptr_t) if_handle_new(&stats);
   return 0;  
 }
 
@@ -254,37 +291,123 @@ static int if_open(const char * path, struct fuse_file_info * info) {
  *
  * Changed in version 2.2
  */
+/* count size bytes read at offset of the file in the heatmap, if any */
+static void record_read(if_status * status, const im_entry * entry,
+			guint64 offset, gsize size) {
+  if (status->heatmap == NULL || size == 0) {
+    return;
+  }
+  if (!entry->fragmented) {
+    if_heatmap_read(status->heatmap,entry->offset + offset,size);
+    return;
+  }
+  GArray * runs = g_array_sized_new(FALSE,FALSE,sizeof(im_run),2);
+  if (im_image_map(status->image,entry,offset,size,runs) == 0) {
+    for (guint idx = 0; idx < runs->len; idx++) {
+      const im_run * run = &g_array_index(runs,im_run,idx);
+      if_heatmap_read(status->heatmap,run->offset,run->size);
+    }
+  }
+  g_array_free(runs,TRUE);
+}
+
 static int if_read(const char * path,
 	    char * buf,size_t size, off_t offset,struct fuse_file_info * info) {
-  iso9660_t * iso = get_status()->fh;
-  iso9660_stat_t * stats = (iso9660_stat_t *) (uintptr_t) info->fh;
-  off_t bk_offset = offset / ISO_BLOCKSIZE;
-  off_t off = offset % ISO_BLOCKSIZE; // offset in first bock
-  // calculate how many block we must read
-  off_t bk_size = (size + off + ISO_BLOCKSIZE - 1) / ISO_BLOCKSIZE;
-  size_t bytes_read = 0;
-  for (int block = 0; block < bk_size; block++) {
-    char data[ISO_BLOCKSIZE];
-    const lsn_t lsn = stats->lsn + bk_offset + block;
-    size_t read = iso9660_iso_seek_read(iso,data,lsn,1);
-    if (read != ISO_BLOCKSIZE) {
-      return -EIO;
+  if_status * status = get_status();
+  if_handle * handle = (if_handle *) (uintptr_t) info->fh;
+  if (handle->export != NULL) {
+    return if_export_read(status->image,handle->export,buf,size,offset);
+  }
+  gssize n = im_image_read(status->image,&handle->entry,buf,size,offset);
+  if (n > 0) {
+    record_read(status,&handle->entry,offset,n);
+  }
+  return n;
+}
+
+/** Store data from an open file in a buffer
+ *
+ * Similar to the read() method, but data is stored and
+ * returned in a generic buffer.
+ *
+ * No actual copying of data has to take place, the source
+ * file descriptor may simply be stored in the buffer for
+ * later data transfer.
+ *
+ * Introduced in version 2.9
+ *
+ * This is what we do: the buffer just points to the extent in the
+ * image, so fuse can splice it to the kernel and the file data never
+ * goes through user space.
+ */
+static int if_read_buf(const char * path, struct fuse_bufvec ** bufp,
+		       size_t size, off_t offset, struct fuse_file_info * info) {
+  if_status * status = get_status();
+  if_handle * handle = (if_handle *) (uintptr_t) info->fh;
+  const im_entry * stats = &handle->entry;
+  if (offset < 0) {
+    return -EINVAL;
+  }
+  // archives end where their data does, with no size to go by
+  if (handle->export == NULL && (guint64) offset >= stats->size) {
+    size = 0;
+  } else if (handle->export == NULL && size > stats->size - offset) {
+    size = stats->size - offset;
+  }
+  // archives are made in memory
+  int fd = handle->export != NULL ? -1 : im_image_fd(status->image);
+  if (fd >= 0) {
+    // a buffer for each contiguous run, spliced one after the other
+    GArray * runs = g_array_sized_new(FALSE,FALSE,sizeof(im_run),2);
+    int result = im_image_map(status->image,stats,offset,size,runs);
+    guint count = MAX(runs->len,1);
+    struct fuse_bufvec * src = result != 0 ? NULL :
+      malloc(sizeof(struct fuse_bufvec) + (count - 1) * sizeof(struct fuse_buf));
+    if (src != NULL) {
+      *src = FUSE_BUFVEC_INIT(size);
+      src->count = count;
+      for (guint idx = 0; idx < runs->len; idx++) {
+	const im_run * run = &g_array_index(runs,im_run,idx);
+	src->buf[idx] = src->buf[0];
+	src->buf[idx].size = run->size;
+	src->buf[idx].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+	src->buf[idx].fd = fd;
+	src->buf[idx].pos = run->offset;
+	if (status->heatmap != NULL) {
+	  if_heatmap_read(status->heatmap,run->offset,run->size);
+	}
+      }
+    }
+    g_array_free(runs,TRUE);
+    if (src == NULL) {
+      return result != 0 ? result : -ENOMEM;
     }
-    /* In this block there are at most ISO_BLOCKSIZE - off
-     * of the remaining size - bytes_read bytes to read
-     * (note that off is possibly not zero only on first pass (se below)
-     */
-    size_t remains_to_read = size - bytes_read;
-    size_t good_in_block = ISO_BLOCKSIZE - off;
-    size_t actually_read =
-      remains_to_read < good_in_block ? remains_to_read : good_in_block;
-    //     
-    memcpy(buf + bytes_read,data + off,actually_read);
-    bytes_read += actually_read;
-    // blocks following the first are read from the beginning
-    off = 0;
-  }
-  return bytes_read;
+    *bufp = src;
+    return 0;
+  }
+  // the caller frees it with free(), and its memory buffer too
+  struct fuse_bufvec * src = malloc(sizeof(struct fuse_bufvec));
+  if (src == NULL) {
+    return -ENOMEM;
+  }
+  *src = FUSE_BUFVEC_INIT(size);
+  // not a plain file: no splicing
+  src->buf[0].mem = malloc(MAX(size,1));
+  gssize n = src->buf[0].mem == NULL ? -ENOMEM :
+    handle->export != NULL ?
+    if_export_read(status->image,handle->export,src->buf[0].mem,size,offset) :
+    im_image_read(status->image,stats,src->buf[0].mem,size,offset);
+  if (n < 0) {
+    free(src->buf[0].mem);
+    free(src);
+    return n;
+  }
+  src->buf[0].size = n;
+  if (handle->export == NULL) {
+    record_read(status,stats,offset,n);
+  }
+  *bufp = src;
+  return 0;
 }
 
 /** Release an open file
@@ -302,13 +425,121 @@ static int if_read(const char * path,
  * Changed in version 2.2
  */
 static int if_release(const char * path, struct fuse_file_info * info) {
-  iso9660_stat_t * stats = (iso9660_stat_t *) (uintptr_t) info->fh;
-  g_free(stats);
+  if_handle * handle = (if_handle *) (uintptr_t) info->fh;
+  if (handle->export != NULL) {
+    if_export_free(handle->export);
+  } else {
+    im_image_advise(get_status()->image,&handle->entry,FALSE);
+  }
+  if_handle_free(handle);
   info->fh = 0;
   return 0;
 }
 
 
+#ifdef HAVE_SYS_XATTR_H
+/*
+ * Extended attributes: read only, they tell where the data of a
+ * file is, so that tools can read it from the image by themselves.
+ */
+#define XATTR_EXTENT "user.isomounter.extent"
+#define XATTR_IMAGE "user.isomounter.image"
+#define XATTR_INDEX "user.isomounter.index"
+#define XATTR_CACHE "user.isomounter.cache"
+#define XATTR_TREE_BYTES "user.isomounter.tree_bytes"
+#define XATTR_TREE_FILES "user.isomounter.tree_files"
+
+/* follow the getxattr/listxattr protocol to return value */
+static int xattr_reply(const char * value, size_t len, char * buf, size_t size) {
+  if (size == 0) {
+    // caller just wants to know how big is the value
+    return len;
+  }
+  if (size < len) {
+    return -ERANGE;
+  }
+  memcpy(buf,value,len);
+  return len;
+}
+
+/** Get extended attributes
+ *
+ * user.isomounter.extent is "offset length" (in bytes, decimal) of
+ * the data in the image, user.isomounter.image the image path,
+ * user.isomounter.index "entries bytes" of the resident index,
+ * user.isomounter.cache "budget used max" in bytes of the memory
+ * cache, all 0 without one. On directories,
+ * user.isomounter.tree_bytes and user.isomounter.tree_files are the
+ * bytes and files under them, at any depth, once the prescan is over:
+ * du without walking the tree.
+ */
+static int if_getxattr(const char * path, const char * name,
+		       char * buf, size_t size) {
+  if_status * status = get_status();
+  im_entry stats;
+  int result = im_image_lookup(status->image,path,&stats);
+  if (result != 0) {
+    return result;
+  }
+  if (strcmp(name,XATTR_EXTENT) == 0) {
+    gchar * value = g_strdup_printf("%" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT,
+				    stats.offset,stats.size);
+    result = xattr_reply(value,strlen(value),buf,size);
+    g_free(value);
+  } else if (strcmp(name,XATTR_IMAGE) == 0) {
+    const gchar * image_path = im_image_path(status->image);
+    result = xattr_reply(image_path,strlen(image_path),buf,size);
+  } else if (strcmp(name,XATTR_INDEX) == 0) {
+    guint64 n_entries;
+    gsize memory = im_image_index_memory(status->image,&n_entries);
+    gchar * value = g_strdup_printf("%" G_GUINT64_FORMAT " %" G_GSIZE_FORMAT,
+				    n_entries,memory);
+    result = xattr_reply(value,strlen(value),buf,size);
+    g_free(value);
+  } else if (strcmp(name,XATTR_CACHE) == 0) {
+    im_budget budget = { 0 };
+    im_image_get_budget(status->image,&budget);
+    gchar * value = g_strdup_printf("%" G_GSIZE_FORMAT " %" G_GSIZE_FORMAT " %" G_GSIZE_FORMAT,
+				    budget.budget,budget.used,budget.max);
+    result = xattr_reply(value,strlen(value),buf,size);
+    g_free(value);
+  } else if (strcmp(name,XATTR_TREE_BYTES) == 0 || strcmp(name,XATTR_TREE_FILES) == 0) {
+    guint64 bytes, files;
+    result = im_image_totals(status->image,path,&bytes,&files);
+    if (result == 0) {
+      gchar * value = g_strdup_printf("%" G_GUINT64_FORMAT,
+				      strcmp(name,XATTR_TREE_BYTES) == 0 ? bytes : files);
+      result = xattr_reply(value,strlen(value),buf,size);
+      g_free(value);
+    } else {
+      // not there yet, or not a directory
+      result = -ENODATA;
+    }
+  } else {
+    result = -ENODATA;
+  }
+  return result;
+}
+
+/** List extended attributes */
+static int if_listxattr(const char * path, char * buf, size_t size) {
+  static const char names[] = XATTR_EXTENT "\0" XATTR_IMAGE "\0" XATTR_INDEX "\0" XATTR_CACHE;
+  static const char dir_names[] = XATTR_EXTENT "\0" XATTR_IMAGE "\0" XATTR_INDEX "\0" XATTR_CACHE
+    "\0" XATTR_TREE_BYTES "\0" XATTR_TREE_FILES;
+  im_image * image = get_status()->image;
+  im_entry stats;
+  int result = im_image_lookup(image,path,&stats);
+  if (result != 0) {
+    return result;
+  }
+  // the totals are there only once the prescan is over
+  guint64 bytes, files;
+  gboolean totals = IS_DIRECTORY(&stats) && im_image_totals(image,path,&bytes,&files) == 0;
+  // sizeof counts the trailing NUL too
+  return totals ? xattr_reply(dir_names,sizeof(dir_names),buf,size)
+    : xattr_reply(names,sizeof(names),buf,size);
+}
+#endif
 
 struct fuse_operations isofuse_ops = {
   .getattr = if_getattr,
@@ -341,9 +572,10 @@ struct fuse_operations isofuse_ops = {
   .fsync = NULL,
   
 #ifdef HAVE_SYS_XATTR_H
+  // read only attributes
   .setxattr = NULL,
-  .getxattr = NULL,
-  .listxattr = NULL,
+  .getxattr = if_getxattr,
+  .listxattr = if_listxattr,
   .removexattr = NULL,
 #endif
   
@@ -359,7 +591,9 @@ struct fuse_operations isofuse_ops = {
   .create = NULL,
   .ftruncate = NULL,
   // this is currently called only after create, which we don't use, thus...
-  .fgetattr = NULL
+  .fgetattr = NULL,
+  // preferred by fuse to .read when both are set
+  .read_buf = if_read_buf
 };
 
 
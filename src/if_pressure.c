@@ -0,0 +1,182 @@
+/* if_pressure.c - sizing the caches to the memory there is
+ *
+ * Copyright (C) 2016 Leo Cacciari <leo.cacciari@gmail.com>
+ *
+ * This file belongs to the isomounter project.
+ * isomounter is free software and is distributed under the terms of the
+ * GNU GPL. See the file COPYING for details.
+ */
+#include "common.h"
+#include "if_pressure.h"
+#include <stdio.h>
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+/* percent of the last 10 seconds some task waited for memory */
+#define HIGH_PRESSURE 10.0
+#define LOW_PRESSURE 1.0
+/* cgroup usage over its limit, in percent, that counts as tight */
+#define TIGHT_LIMIT 90
+/* the system has memory to spare with this percent available */
+#define FREE_MEMORY 20
+/* growing goes in steps of max / GROW_STEPS */
+#define GROW_STEPS 8
+
+struct if_pressure_s {
+  im_image * image;
+  gchar * cgroup; // our cgroup v2 directory, NULL if there's none
+  GThread * thread;
+  GMutex lock;
+  GCond stop_cond;
+  gboolean stop;
+};
+
+/* the cgroup v2 directory of this process */
+static gchar * find_cgroup(void) {
+  gchar * contents = NULL;
+  if (!g_file_get_contents("/proc/self/cgroup",&contents,NULL,NULL)) {
+    return NULL;
+  }
+  gchar * dir = NULL;
+  gchar ** lines = g_strsplit(contents,"\n",-1);
+  for (guint idx = 0; lines[idx] != NULL && dir == NULL; idx++) {
+    if (g_str_has_prefix(lines[idx],"0::")) {
+      dir = g_build_filename("/sys/fs/cgroup",lines[idx] + 3,NULL);
+    }
+  }
+  g_strfreev(lines);
+  g_free(contents);
+  return dir;
+}
+
+/* "some avg10" of the PSI file at path, -1 if it can't be read */
+static double read_pressure(const gchar * path) {
+  gchar * contents = NULL;
+  double avg10 = -1;
+  if (g_file_get_contents(path,&contents,NULL,NULL)) {
+    if (sscanf(contents,"some avg10=%lf",&avg10) != 1) {
+      avg10 = -1;
+    }
+    g_free(contents);
+  }
+  return avg10;
+}
+
+/* a number in the file name under dir; 0 if it's "max" or missing */
+static guint64 read_value(const gchar * dir, const gchar * name) {
+  gchar * path = g_build_filename(dir,name,NULL);
+  gchar * contents = NULL;
+  guint64 value = 0;
+  if (g_file_get_contents(path,&contents,NULL,NULL)) {
+    value = g_ascii_strtoull(contents,NULL,10);
+    g_free(contents);
+  }
+  g_free(path);
+  return value;
+}
+
+/* percent of the system memory available, -1 if unknown */
+static gint available_memory(void) {
+  gchar * contents = NULL;
+  if (!g_file_get_contents("/proc/meminfo",&contents,NULL,NULL)) {
+    return -1;
+  }
+  guint64 total = 0, available = 0;
+  gchar ** lines = g_strsplit(contents,"\n",-1);
+  for (guint idx = 0; lines[idx] != NULL; idx++) {
+    sscanf(lines[idx],"MemTotal: %" G_GUINT64_FORMAT,&total);
+    sscanf(lines[idx],"MemAvailable: %" G_GUINT64_FORMAT,&available);
+  }
+  g_strfreev(lines);
+  g_free(contents);
+  return total > 0 ? (gint) (available * 100 / total) : -1;
+}
+
+static void adjust(if_pressure * p) {
+  im_budget budget;
+  if (!im_image_get_budget(p->image,&budget)) {
+    return;
+  }
+  double pressure = -1;
+  gboolean tight = FALSE;
+  if (p->cgroup != NULL) {
+    gchar * path = g_build_filename(p->cgroup,"memory.pressure",NULL);
+    pressure = read_pressure(path);
+    g_free(path);
+    guint64 limit = read_value(p->cgroup,"memory.max");
+    guint64 current = read_value(p->cgroup,"memory.current");
+    tight = limit > 0 && current >= limit / 100 * TIGHT_LIMIT;
+  }
+  if (pressure < 0) {
+    pressure = read_pressure("/proc/pressure/memory");
+  }
+  gsize next = budget.budget;
+  if (pressure >= HIGH_PRESSURE || tight) {
+    next = budget.budget / 2;
+  } else if (pressure >= 0 && pressure < LOW_PRESSURE &&
+	     available_memory() >= FREE_MEMORY) {
+    next = MIN(budget.budget + budget.max / GROW_STEPS,budget.max);
+  }
+  if (next != budget.budget) {
+    im_image_set_budget(p->image,next);
+    im_image_get_budget(p->image,&budget);
+    g_debug("memory pressure %.2f%s: cache budget %" G_GSIZE_FORMAT " KiB",
+	    pressure,tight ? ", cgroup near its limit" : "",budget.budget / 1024);
+  }
+}
+
+static gpointer watch(gpointer data) {
+  if_pressure * p = (if_pressure *) data;
+  g_mutex_lock(&p->lock);
+  while (!p->stop) {
+    gint64 until = g_get_monotonic_time() + IF_PRESSURE_INTERVAL * G_TIME_SPAN_SECOND;
+    g_cond_wait_until(&p->stop_cond,&p->lock,until);
+    if (!p->stop) {
+      g_mutex_unlock(&p->lock);
+      adjust(p);
+      g_mutex_lock(&p->lock);
+    }
+  }
+  g_mutex_unlock(&p->lock);
+  return NULL;
+}
+
+if_pressure * if_pressure_start(im_image * image) {
+  im_budget budget;
+  if (!im_image_get_budget(image,&budget)) {
+    return NULL;
+  }
+  if_pressure * p = g_new0(if_pressure,1);
+  p->image = image;
+  p->cgroup = find_cgroup();
+  g_mutex_init(&p->lock);
+  g_cond_init(&p->stop_cond);
+  GError * error = NULL;
+  p->thread = g_thread_try_new("pressure",watch,p,&error);
+  if (p->thread == NULL) {
+    g_warning("cache sizes won't follow memory pressure: %s",error->message);
+    g_error_free(error);
+    if_pressure_stop(p);
+    return NULL;
+  }
+  return p;
+}
+
+void if_pressure_stop(if_pressure * p) {
+  if (p == NULL) {
+    return;
+  }
+  if (p->thread != NULL) {
+    g_mutex_lock(&p->lock);
+    p->stop = TRUE;
+    g_cond_signal(&p->stop_cond);
+    g_mutex_unlock(&p->lock);
+    g_thread_join(p->thread);
+  }
+  g_cond_clear(&p->stop_cond);
+  g_mutex_clear(&p->lock);
+  g_free(p->cgroup);
+  g_free(p);
+}
@@ -0,0 +1,30 @@
+/* if_pressure.h - sizing the caches to the memory there is
+ *
+ * Copyright (C) 2016 Leo Cacciari <leo.cacciari@gmail.com>
+ *
+ * This file belongs to the isomounter project.
+ * isomounter is free software and is distributed under the terms of the
+ * GNU GPL. See the file COPYING for details.
+ */
+#ifndef __IF_PRESSURE_H__
+#define __IF_PRESSURE_H__
+#include "common.h"
+
+/* how often memory is looked at */
+#define IF_PRESSURE_INTERVAL 2 // seconds
+
+/**
+ * A thread watching the memory pressure the kernel reports (PSI) and
+ * how close our cgroup is to its memory limit. The caches of the
+ * image are halved as soon as memory gets tight, and grow back a bit
+ * at a time while it is free, up to the size they were opened with.
+ */
+typedef struct if_pressure_s if_pressure;
+
+/**
+ * NULL if the image has no cache to size.
+ */
+if_pressure * if_pressure_start(im_image * image);
+void if_pressure_stop(if_pressure * pressure);
+
+#endif /*__IF_PRESSURE_H__*/
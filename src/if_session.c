@@ -0,0 +1,1563 @@
+/* if_session.c - the fuse session, and handing it over
+ *
+ * Copyright (C) 2016 Leo Cacciari <leo.cacciari@gmail.com>
+ *
+ * This file belongs to the isomounter project.
+ * isomounter is free software and is distributed under the terms of the
+ * GNU GPL. See the file COPYING for details.
+ */
+#include "common.h"
+#include "if_session.h"
+#include "im_config.h"
+#include <fuse_lowlevel.h>
+#include <glib-unix.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+/*
+ * libfuse's high level API keeps the inodes it gives the kernel to
+ * itself, so this is a thin one of our own over the low level API:
+ * inodes are paths, open handles are numbers, and isofuse_ops does
+ * the rest as before.
+ *
+ * Handing over: the new process connects to the control socket of
+ * the one serving the mountpoint, which stops its workers between
+ * requests and sends the fuse device along with its state. The new
+ * process replays the kernel's INIT to its own libfuse, opens again
+ * what was open and says so; the old one then quits without
+ * unmounting. The kernel just sees requests answered by someone
+ * else, and its page cache stays warm.
+ *
+ * Workers wait for requests in a blocking read() of the fuse device,
+ * which wakes just one of them per request. To stop, park or retire,
+ * a worker is kicked out of it with KICK_SIGNAL.
+ */
+
+/* as libfuse's high level API does by default */
+#define ATTR_TIMEOUT 1.0
+#define ENTRY_TIMEOUT 1.0
+#define UNKNOWN_INO 0xffffffff
+/* workers by default, but for -s */
+#define DEFAULT_WORKERS 8
+#define MAX_WORKERS 64
+/* a worker over the minimum idle this long goes away */
+#define WORKER_IDLE_TIMEOUT 10000 // ms
+/* gets a worker out of read(), to look at what changed */
+#define KICK_SIGNAL SIGUSR1
+/* kicks may land before read() starts: again after this long */
+#define KICK_RETRY 10 // ms
+/* as libfuse's own channel on /dev/fuse */
+#define CHAN_BUFSIZE 0x21000
+/* how long the old process waits for the new one to be ready */
+#define TAKEOVER_TIMEOUT 30000 // ms
+#define TAKEOVER_MAGIC 0x494d544bu // "IMTK"
+#define TAKEOVER_VERSION 2
+/* the INIT request made up when taking over, whose reply is dropped */
+#define TAKEOVER_UNIQUE G_MAXUINT64
+
+/* the headers of the fuse protocol, as in linux/fuse.h */
+typedef struct in_header_s {
+  guint32 len;
+  guint32 opcode;
+  guint64 unique;
+  guint64 nodeid;
+  guint32 uid;
+  guint32 gid;
+  guint32 pid;
+  guint32 padding;
+} in_header;
+
+typedef struct init_in_s {
+  guint32 major;
+  guint32 minor;
+  guint32 max_readahead;
+  guint32 flags;
+} init_in;
+
+typedef struct out_header_s {
+  guint32 len;
+  gint32 error;
+  guint64 unique;
+} out_header;
+
+#define FUSE_OPCODE_INIT 26
+
+typedef struct if_node_s {
+  fuse_ino_t ino;
+  guint64 nlookup;
+  gchar * path;
+} if_node;
+
+/* an open file or directory */
+typedef struct if_open_s {
+  guint64 id;
+  gboolean is_dir;
+  int flags;
+  gchar * path;
+  guint64 fh;        // isofuse_ops' handle
+  GMutex lock;       // for the listing
+  GByteArray * listing; // directories: the entries, once read
+} if_open;
+
+/* what each worker keeps from one request to the next */
+typedef struct if_worker_s {
+  struct if_session_s * session;
+  guint index;
+  GThread * thread;
+  pthread_t tid;   // once started
+  gboolean started;
+  gint retire;     // asked to go away, atomic
+  gchar * reply;   // for data read in memory
+  gsize reply_size;
+} if_worker;
+
+static GPrivate current_worker = G_PRIVATE_INIT(NULL);
+
+/*
+ * The options of libfuse's high level API that its low level one
+ * refuses: taken out of the arguments and done here.
+ */
+typedef struct if_mount_conf_s {
+  double attr_timeout;
+  double entry_timeout;
+  double negative_timeout; // 0: failed lookups aren't cached
+  int set_uid;
+  unsigned uid;
+  int set_gid;
+  unsigned gid;
+  int set_mode;
+  unsigned umask;
+  int use_ino;     // st_ino from isofuse_ops, when it gives one
+  int readdir_ino; // inodes in listings, for the entries looked up
+} if_mount_conf;
+
+#define CONF_OPT(t,p,v) { t, offsetof(if_mount_conf,p), v }
+/* the high level API's cache options, which have no use here */
+#define CONF_KEY_CACHE 1
+
+static const struct fuse_opt conf_opts[] = {
+  CONF_OPT("attr_timeout=%lf",attr_timeout,0),
+  CONF_OPT("entry_timeout=%lf",entry_timeout,0),
+  CONF_OPT("negative_timeout=%lf",negative_timeout,0),
+  CONF_OPT("uid=",set_uid,1),
+  CONF_OPT("uid=%u",uid,0),
+  CONF_OPT("gid=",set_gid,1),
+  CONF_OPT("gid=%u",gid,0),
+  CONF_OPT("umask=",set_mode,1),
+  CONF_OPT("umask=%o",umask,0),
+  CONF_OPT("use_ino",use_ino,1),
+  CONF_OPT("readdir_ino",readdir_ino,1),
+  FUSE_OPT_KEY("kernel_cache",CONF_KEY_CACHE),
+  FUSE_OPT_KEY("auto_cache",CONF_KEY_CACHE),
+  FUSE_OPT_KEY("noauto_cache",CONF_KEY_CACHE),
+  FUSE_OPT_END
+};
+
+/* the image never changes, so open files always keep their cache */
+static int conf_proc(void * data, const char * arg, int key, struct fuse_args * outargs) {
+  if (key == CONF_KEY_CACHE) {
+    g_warning("option %s ignored: file data always stays in the kernel cache",arg);
+    return 0;
+  }
+  return 1;
+}
+
+typedef struct if_session_s {
+  if_status * status;
+  if_mount_conf conf;
+  struct fuse_session * se;
+  struct fuse_chan * ch;
+  gchar * mountpoint;
+  int fd;
+  guint min_workers;
+  guint max_workers;    // more start while all are busy, up to these
+  gboolean pin_workers; // each to a processor
+  cpu_set_t cpus;       // the process may run on, empty if unknown
+  gint busy;            // workers serving a request, atomic
+  gint peak;            // most busy at once since the last trim, atomic
+  gchar * control_path;
+  GMutex lock;          // for all the fields below
+  GCond changed;
+  GPtrArray * workers;  // if_worker
+  guint next_worker;
+  gboolean joining;
+  gint quiesce;         // also read without the lock
+  guint parked;
+  guint running;
+  GHashTable * nodes;   // ino -> if_node
+  GHashTable * paths;   // path -> if_node
+  fuse_ino_t next_ino;
+  GHashTable * opens;   // id -> if_open
+  guint64 next_open;
+  struct fuse_conn_info conn; // as the kernel offered it
+} if_session;
+
+/* written to by signals, to get the control loop out of poll() */
+static int wake_pipe[2] = { -1, -1 };
+static volatile sig_atomic_t stopping = 0;
+
+static void wake(void) {
+  char c = 0;
+  if (write(wake_pipe[1],&c,1) < 0) {
+    // full already: it's awake
+  }
+}
+
+static void drain_wake(void) {
+  char buf[64];
+  while (read(wake_pipe[0],buf,sizeof(buf)) > 0);
+}
+
+static void on_signal(int sig) {
+  int saved = errno;
+  stopping = 1;
+  wake();
+  errno = saved;
+}
+
+static void on_kick(int sig) {
+  // nothing: read() returning EINTR is the point
+}
+
+static gboolean setup_signals(GError ** error) {
+  if (!g_unix_open_pipe(wake_pipe,FD_CLOEXEC,error)) {
+    return FALSE;
+  }
+  fcntl(wake_pipe[0],F_SETFL,O_NONBLOCK);
+  fcntl(wake_pipe[1],F_SETFL,O_NONBLOCK);
+  struct sigaction sa = { 0 };
+  sa.sa_handler = on_signal;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGINT,&sa,NULL);
+  sigaction(SIGTERM,&sa,NULL);
+  sigaction(SIGHUP,&sa,NULL);
+  // no SA_RESTART, so that it interrupts reads
+  sa.sa_handler = on_kick;
+  sigaction(KICK_SIGNAL,&sa,NULL);
+  sa.sa_handler = SIG_IGN;
+  sigaction(SIGPIPE,&sa,NULL);
+  return TRUE;
+}
+
+/*
+ * Inodes
+ */
+
+static void node_free(gpointer data) {
+  if_node * node = (if_node *) data;
+  g_free(node->path);
+  g_free(node);
+}
+
+/* called with the lock held */
+static if_node * node_add(if_session * s, fuse_ino_t ino, const gchar * path,
+			  guint64 nlookup) {
+  if_node * node = g_new(if_node,1);
+  node->ino = ino;
+  node->nlookup = nlookup;
+  node->path = g_strdup(path);
+  g_hash_table_insert(s->paths,node->path,node);
+  g_hash_table_insert(s->nodes,&node->ino,node);
+  return node;
+}
+
+/* a copy of the path of ino, NULL if the kernel shouldn't know it */
+static gchar * node_path(if_session * s, fuse_ino_t ino) {
+  g_mutex_lock(&s->lock);
+  if_node * node = g_hash_table_lookup(s->nodes,&ino);
+  gchar * path = node != NULL ? g_strdup(node->path) : NULL;
+  g_mutex_unlock(&s->lock);
+  return path;
+}
+
+/* the inode of path, for one more lookup by the kernel */
+static fuse_ino_t node_ref(if_session * s, const gchar * path) {
+  g_mutex_lock(&s->lock);
+  if_node * node = g_hash_table_lookup(s->paths,path);
+  if (node == NULL) {
+    node = node_add(s,s->next_ino++,path,0);
+  }
+  node->nlookup++;
+  fuse_ino_t ino = node->ino;
+  g_mutex_unlock(&s->lock);
+  return ino;
+}
+
+static void node_forget(if_session * s, fuse_ino_t ino, guint64 nlookup) {
+  g_mutex_lock(&s->lock);
+  if_node * node = g_hash_table_lookup(s->nodes,&ino);
+  if (node != NULL && ino != FUSE_ROOT_ID) {
+    node->nlookup -= MIN(nlookup,node->nlookup);
+    if (node->nlookup == 0) {
+      g_hash_table_remove(s->paths,node->path);
+      g_hash_table_remove(s->nodes,&ino);
+    }
+  }
+  g_mutex_unlock(&s->lock);
+}
+
+static gchar * child_path(const gchar * dir, const gchar * name) {
+  return strcmp(dir,"/") == 0 ? g_strconcat("/",name,NULL) : g_strconcat(dir,"/",name,NULL);
+}
+
+/*
+ * Open handles
+ */
+
+static void open_free(gpointer data) {
+  if_open * o = (if_open *) data;
+  if (o->listing != NULL) {
+    g_byte_array_free(o->listing,TRUE);
+  }
+  g_mutex_clear(&o->lock);
+  g_free(o->path);
+  g_free(o);
+}
+
+/* called with the lock held */
+static if_open * open_add(if_session * s, guint64 id, const gchar * path,
+			  gboolean is_dir, const struct fuse_file_info * fi) {
+  if_open * o = g_new0(if_open,1);
+  o->id = id;
+  o->is_dir = is_dir;
+  o->flags = fi->flags;
+  o->path = g_strdup(path);
+  o->fh = fi->fh;
+  g_mutex_init(&o->lock);
+  g_hash_table_insert(s->opens,&o->id,o);
+  return o;
+}
+
+/* the kernel doesn't use a handle after releasing it */
+static if_open * open_get(if_session * s, guint64 id) {
+  g_mutex_lock(&s->lock);
+  if_open * o = g_hash_table_lookup(s->opens,&id);
+  g_mutex_unlock(&s->lock);
+  return o;
+}
+
+static void open_remove(if_session * s, guint64 id) {
+  g_mutex_lock(&s->lock);
+  g_hash_table_remove(s->opens,&id);
+  g_mutex_unlock(&s->lock);
+}
+
+/*
+ * The low level operations, on top of isofuse_ops
+ */
+
+/* what getattr found, as the options want it */
+static void fix_attr(if_session * s, struct stat * st, fuse_ino_t ino) {
+  if (!s->conf.use_ino || st->st_ino == 0) st->st_ino = ino;
+  if (s->conf.set_uid) st->st_uid = s->conf.uid;
+  if (s->conf.set_gid) st->st_gid = s->conf.gid;
+  if (s->conf.set_mode) st->st_mode = (st->st_mode & S_IFMT) | (0777 & ~s->conf.umask);
+}
+
+static void ll_init(void * data, struct fuse_conn_info * conn) {
+  if_session * s = (if_session *) data;
+  s->conn = *conn;
+  if (isofuse_ops.init != NULL) {
+    isofuse_ops.init(conn);
+  }
+}
+
+static void ll_destroy(void * data) {
+  if_session * s = (if_session *) data;
+  if (isofuse_ops.destroy != NULL) {
+    isofuse_ops.destroy(s->status);
+  }
+}
+
+static void ll_lookup(fuse_req_t req, fuse_ino_t parent, const char * name) {
+  if_session * s = fuse_req_userdata(req);
+  gchar * dir = node_path(s,parent);
+  if (dir == NULL) {
+    fuse_reply_err(req,ESTALE);
+    return;
+  }
+  gchar * path = child_path(dir,name);
+  struct fuse_entry_param e;
+  memset(&e,0,sizeof(e));
+  int result = isofuse_ops.getattr(path,&e.attr);
+  if (result == 0) {
+    e.ino = node_ref(s,path);
+    fix_attr(s,&e.attr,e.ino);
+    e.attr_timeout = s->conf.attr_timeout;
+    e.entry_timeout = s->conf.entry_timeout;
+    if (fuse_reply_entry(req,&e) == -ENOENT) {
+      // interrupted: the kernel won't count this lookup
+      node_forget(s,e.ino,1);
+    }
+  } else if (result == -ENOENT && s->conf.negative_timeout > 0) {
+    // inode 0: the kernel remembers that there is nothing there
+    e.entry_timeout = s->conf.negative_timeout;
+    fuse_reply_entry(req,&e);
+  } else {
+    fuse_reply_err(req,-result);
+  }
+  g_free(path);
+  g_free(dir);
+}
+
+static void ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup) {
+  node_forget(fuse_req_userdata(req),ino,nlookup);
+  fuse_reply_none(req);
+}
+
+static void ll_forget_multi(fuse_req_t req, size_t count,
+			    struct fuse_forget_data * forgets) {
+  if_session * s = fuse_req_userdata(req);
+  for (size_t idx = 0; idx < count; idx++) {
+    node_forget(s,forgets[idx].ino,forgets[idx].nlookup);
+  }
+  fuse_reply_none(req);
+}
+
+static void ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info * fi) {
+  if_session * s = fuse_req_userdata(req);
+  gchar * path = node_path(s,ino);
+  if (path == NULL) {
+    fuse_reply_err(req,ESTALE);
+    return;
+  }
+  struct stat st;
+  memset(&st,0,sizeof(st));
+  int result = isofuse_ops.getattr(path,&st);
+  if (result == 0) {
+    fix_attr(s,&st,ino);
+    fuse_reply_attr(req,&st,s->conf.attr_timeout);
+  } else {
+    fuse_reply_err(req,-result);
+  }
+  g_free(path);
+}
+
+/* open and opendir */
+static void do_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info * fi,
+		    gboolean is_dir) {
+  if_session * s = fuse_req_userdata(req);
+  gchar * path = node_path(s,ino);
+  if (path == NULL) {
+    fuse_reply_err(req,ESTALE);
+    return;
+  }
+  struct fuse_file_info impl = *fi;
+  int (*open_op)(const char *, struct fuse_file_info *) =
+    is_dir ? isofuse_ops.opendir : isofuse_ops.open;
+  int result = open_op != NULL ? open_op(path,&impl) : 0;
+  if (result != 0) {
+    fuse_reply_err(req,-result);
+    g_free(path);
+    return;
+  }
+  g_mutex_lock(&s->lock);
+  guint64 id = s->next_open++;
+  open_add(s,id,path,is_dir,&impl);
+  g_mutex_unlock(&s->lock);
+  fi->fh = id;
+  fi->direct_io = impl.direct_io;
+  // the image never changes: what the kernel has cached stays good
+  fi->keep_cache = !is_dir || impl.keep_cache;
+  if (fuse_reply_open(req,fi) == -ENOENT) {
+    // interrupted: there won't be a release
+    int (*release_op)(const char *, struct fuse_file_info *) =
+      is_dir ? isofuse_ops.releasedir : isofuse_ops.release;
+    if (release_op != NULL) release_op(path,&impl);
+    open_remove(s,id);
+  }
+  g_free(path);
+}
+
+static void ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info * fi) {
+  do_open(req,ino,fi,FALSE);
+}
+
+static void ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info * fi) {
+  do_open(req,ino,fi,TRUE);
+}
+
+/* release and releasedir */
+static void do_release(fuse_req_t req, struct fuse_file_info * fi) {
+  if_session * s = fuse_req_userdata(req);
+  if_open * o = open_get(s,fi->fh);
+  if (o != NULL) {
+    struct fuse_file_info impl = *fi;
+    impl.fh = o->fh;
+    int (*release_op)(const char *, struct fuse_file_info *) =
+      o->is_dir ? isofuse_ops.releasedir : isofuse_ops.release;
+    if (release_op != NULL) release_op(o->path,&impl);
+    open_remove(s,fi->fh);
+  }
+  fuse_reply_err(req,0);
+}
+
+static void ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info * fi) {
+  do_release(req,fi);
+}
+
+static void ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info * fi) {
+  do_release(req,fi);
+}
+
+/* fuse_buf memory that isn't a file descriptor is ours to free */
+static void free_bufvec(struct fuse_bufvec * buf) {
+  for (size_t idx = 0; idx < buf->count; idx++) {
+    if (!(buf->buf[idx].flags & FUSE_BUF_IS_FD)) {
+      free(buf->buf[idx].mem);
+    }
+  }
+  free(buf);
+}
+
+static void ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+		    struct fuse_file_info * fi) {
+  if_session * s = fuse_req_userdata(req);
+  if_open * o = open_get(s,fi->fh);
+  if (o == NULL) {
+    fuse_reply_err(req,EBADF);
+    return;
+  }
+  struct fuse_file_info impl = *fi;
+  impl.fh = o->fh;
+  if (isofuse_ops.read_buf != NULL && im_image_fd(s->status->image) >= 0) {
+    struct fuse_bufvec * buf = NULL;
+    int result = isofuse_ops.read_buf(o->path,&buf,size,off,&impl);
+    if (result == 0) {
+      fuse_reply_data(req,buf,FUSE_BUF_SPLICE_MOVE);
+    } else {
+      fuse_reply_err(req,-result);
+    }
+    if (buf != NULL) free_bufvec(buf);
+  } else {
+    // nothing to splice: into the buffer of the worker
+    if_worker * w = g_private_get(&current_worker);
+    gchar * buf;
+    if (w != NULL) {
+      if (w->reply_size < size) {
+	w->reply = g_realloc(w->reply,size);
+	w->reply_size = size;
+      }
+      buf = w->reply;
+    } else {
+      buf = g_malloc(MAX(size,1));
+    }
+    int result = isofuse_ops.read(o->path,buf,size,off,&impl);
+    if (result >= 0) {
+      fuse_reply_buf(req,buf,result);
+    } else {
+      fuse_reply_err(req,-result);
+    }
+    if (w == NULL) g_free(buf);
+  }
+}
+
+typedef struct if_listing_s {
+  fuse_req_t req;
+  GByteArray * buf;
+  if_session * s;
+  const gchar * dir;
+} if_listing;
+
+/* the inode of name in dir if the kernel has it already, for readdir_ino */
+static fuse_ino_t known_ino(if_session * s, const gchar * dir, const gchar * name) {
+  if (strcmp(name,".") == 0 || strcmp(name,"..") == 0) {
+    return UNKNOWN_INO;
+  }
+  gchar * path = child_path(dir,name);
+  g_mutex_lock(&s->lock);
+  if_node * node = g_hash_table_lookup(s->paths,path);
+  fuse_ino_t ino = node != NULL ? node->ino : UNKNOWN_INO;
+  g_mutex_unlock(&s->lock);
+  g_free(path);
+  return ino;
+}
+
+/* the filler isofuse_ops.readdir gets: entries go one after the other,
+ * each with the offset of the next one */
+static int fill_entry(void * data, const char * name, const struct stat * st, off_t off) {
+  if_listing * listing = (if_listing *) data;
+  struct stat blank;
+  if (st == NULL) {
+    memset(&blank,0,sizeof(blank));
+    blank.st_ino = listing->s->conf.readdir_ino ?
+      known_ino(listing->s,listing->dir,name) : UNKNOWN_INO;
+    st = &blank;
+  }
+  size_t len = fuse_add_direntry(listing->req,NULL,0,name,st,0);
+  guint at = listing->buf->len;
+  g_byte_array_set_size(listing->buf,at + len);
+  fuse_add_direntry(listing->req,(char *) listing->buf->data + at,len,name,st,at + len);
+  return 0;
+}
+
+static void ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+		       struct fuse_file_info * fi) {
+  if_session * s = fuse_req_userdata(req);
+  if_open * o = open_get(s,fi->fh);
+  if (o == NULL) {
+    fuse_reply_err(req,EBADF);
+    return;
+  }
+  g_mutex_lock(&o->lock);
+  // read it all at the start, then hand it out in pieces
+  if (o->listing == NULL || off == 0) {
+    if_listing listing = { req, g_byte_array_new(), s, o->path };
+    struct fuse_file_info impl = *fi;
+    impl.fh = o->fh;
+    int result = isofuse_ops.readdir(o->path,&listing,fill_entry,0,&impl);
+    if (result != 0) {
+      g_byte_array_free(listing.buf,TRUE);
+      g_mutex_unlock(&o->lock);
+      fuse_reply_err(req,-result);
+      return;
+    }
+    if (o->listing != NULL) g_byte_array_free(o->listing,TRUE);
+    o->listing = listing.buf;
+  }
+  if ((guint64) off < o->listing->len) {
+    fuse_reply_buf(req,(const char *) o->listing->data + off,
+		   MIN(size,o->listing->len - off));
+  } else {
+    fuse_reply_buf(req,NULL,0);
+  }
+  g_mutex_unlock(&o->lock);
+}
+
+/* getxattr and listxattr: size 0 asks how much room the value needs */
+static void reply_xattr(fuse_req_t req, int result, const char * buf, size_t size) {
+  if (result < 0) {
+    fuse_reply_err(req,-result);
+  } else if (size == 0) {
+    fuse_reply_xattr(req,result);
+  } else {
+    fuse_reply_buf(req,buf,result);
+  }
+}
+
+static void ll_getxattr(fuse_req_t req, fuse_ino_t ino, const char * name, size_t size) {
+  if_session * s = fuse_req_userdata(req);
+  gchar * path = node_path(s,ino);
+  if (path == NULL) {
+    fuse_reply_err(req,ESTALE);
+    return;
+  }
+  gchar * buf = size > 0 ? g_malloc(size) : NULL;
+  int result = isofuse_ops.getxattr != NULL ?
+    isofuse_ops.getxattr(path,name,buf,size) : -ENOSYS;
+  reply_xattr(req,result,buf,size);
+  g_free(buf);
+  g_free(path);
+}
+
+static void ll_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size) {
+  if_session * s = fuse_req_userdata(req);
+  gchar * path = node_path(s,ino);
+  if (path == NULL) {
+    fuse_reply_err(req,ESTALE);
+    return;
+  }
+  gchar * buf = size > 0 ? g_malloc(size) : NULL;
+  int result = isofuse_ops.listxattr != NULL ?
+    isofuse_ops.listxattr(path,buf,size) : -ENOSYS;
+  reply_xattr(req,result,buf,size);
+  g_free(buf);
+  g_free(path);
+}
+
+static const struct fuse_lowlevel_ops ll_ops = {
+  .init = ll_init,
+  .destroy = ll_destroy,
+  .lookup = ll_lookup,
+  .forget = ll_forget,
+  .forget_multi = ll_forget_multi,
+  .getattr = ll_getattr,
+  .open = ll_open,
+  .read = ll_read,
+  .release = ll_release,
+  .opendir = ll_opendir,
+  .readdir = ll_readdir,
+  .releasedir = ll_releasedir,
+  .getxattr = ll_getxattr,
+  .listxattr = ll_listxattr,
+};
+
+/*
+ * The channel of a process that took the fuse device over. It is
+ * libfuse's own but for the reply to the INIT made up for it.
+ */
+
+static int chan_receive(struct fuse_chan ** chp, char * buf, size_t size) {
+  struct fuse_chan * ch = *chp;
+  struct fuse_session * se = fuse_chan_session(ch);
+  ssize_t n;
+  do {
+    // ENOENT: the request was interrupted, there may be another
+    n = read(fuse_chan_fd(ch),buf,size);
+  } while (n < 0 && errno == ENOENT);
+  if (fuse_session_exited(se)) {
+    return 0;
+  }
+  if (n < 0) {
+    if (errno == ENODEV) {
+      // unmounted
+      fuse_session_exit(se);
+      return 0;
+    }
+    return -errno;
+  }
+  return n;
+}
+
+static int chan_send(struct fuse_chan * ch, const struct iovec iov[], size_t count) {
+  const out_header * out = (const out_header *) iov[0].iov_base;
+  if (out->unique == TAKEOVER_UNIQUE) {
+    return 0;
+  }
+  ssize_t n = writev(fuse_chan_fd(ch),iov,count);
+  return n < 0 ? -errno : 0;
+}
+
+static void chan_destroy(struct fuse_chan * ch) {
+  if (fuse_chan_fd(ch) >= 0) close(fuse_chan_fd(ch));
+}
+
+static struct fuse_chan_ops taken_chan_ops = {
+  .receive = chan_receive,
+  .send = chan_send,
+  .destroy = chan_destroy,
+};
+
+/*
+ * Workers
+ */
+
+/* get the workers out of read(); called with the lock held */
+static void kick(if_session * s) {
+  for (guint idx = 0; idx < s->workers->len; idx++) {
+    if_worker * w = g_ptr_array_index(s->workers,idx);
+    if (w->started) pthread_kill(w->tid,KICK_SIGNAL);
+  }
+}
+
+/* kick the workers until done(s); called with the lock held */
+static void kick_until(if_session * s, gboolean (*done)(if_session *)) {
+  while (!done(s)) {
+    kick(s);
+    g_cond_wait_until(&s->changed,&s->lock,
+		      g_get_monotonic_time() + KICK_RETRY * G_TIME_SPAN_MILLISECOND);
+  }
+}
+
+/* wait while a takeover is under way; called with the lock held */
+static void park(if_session * s) {
+  s->parked++;
+  g_cond_broadcast(&s->changed);
+  while (s->quiesce && !fuse_session_exited(s->se)) {
+    g_cond_wait(&s->changed,&s->lock);
+  }
+  s->parked--;
+}
+
+/* run on the index-th of the processors the process may run on */
+static void pin(if_session * s, guint index) {
+  if (CPU_COUNT(&s->cpus) == 0) {
+    return;
+  }
+  guint nth = index % CPU_COUNT(&s->cpus);
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (CPU_ISSET(cpu,&s->cpus) && nth-- == 0) {
+      cpu_set_t one;
+      CPU_ZERO(&one);
+      CPU_SET(cpu,&one);
+      // 0 is the calling thread
+      if (sched_setaffinity(0,sizeof(one),&one) != 0) {
+	g_debug("worker %u not pinned to %d: %s",index,cpu,g_strerror(errno));
+      }
+      return;
+    }
+  }
+}
+
+static gpointer worker(gpointer data);
+
+/* called with the lock held */
+static gboolean spawn(if_session * s, GError ** error) {
+  if_worker * w = g_new0(if_worker,1);
+  w->session = s;
+  w->index = s->next_worker++;
+  w->thread = g_thread_try_new("worker",worker,w,error);
+  if (w->thread == NULL) {
+    g_free(w);
+    return FALSE;
+  }
+  s->running++;
+  g_ptr_array_add(s->workers,w);
+  return TRUE;
+}
+
+/* all workers are busy: one more, if there may be */
+static void grow(if_session * s) {
+  g_mutex_lock(&s->lock);
+  if (!s->joining && !s->quiesce && s->running < s->max_workers &&
+      (guint) g_atomic_int_get(&s->busy) >= s->running) {
+    GError * error = NULL;
+    if (!spawn(s,&error)) {
+      g_debug("no more workers: %s",error->message);
+      g_error_free(error);
+    }
+  }
+  g_mutex_unlock(&s->lock);
+}
+
+/*
+ * Fewer workers, if fewer than are running were busy at once since
+ * the last time: called by the control loop every WORKER_IDLE_TIMEOUT.
+ */
+static void trim(if_session * s) {
+  g_mutex_lock(&s->lock);
+  guint peak = g_atomic_int_get(&s->peak);
+  g_atomic_int_set(&s->peak,g_atomic_int_get(&s->busy));
+  guint keep = MAX(peak,s->min_workers);
+  for (guint idx = s->workers->len; !s->joining && !s->quiesce && idx > keep; idx--) {
+    if_worker * w = g_ptr_array_index(s->workers,idx - 1);
+    // kicked again if the last kick was lost
+    g_atomic_int_set(&w->retire,1);
+    if (w->started) pthread_kill(w->tid,KICK_SIGNAL);
+  }
+  g_mutex_unlock(&s->lock);
+}
+
+/* a worker asked to go away does; called with the lock held */
+static void retire(if_session * s, if_worker * w) {
+  g_ptr_array_remove_fast(s->workers,w);
+  s->running--;
+  // nobody joins it
+  g_thread_unref(w->thread);
+  g_cond_broadcast(&s->changed);
+}
+
+static gpointer worker(gpointer data) {
+  if_worker * w = (if_worker *) data;
+  if_session * s = w->session;
+  g_private_set(&current_worker,w);
+  g_mutex_lock(&s->lock);
+  w->tid = pthread_self();
+  w->started = TRUE;
+  g_mutex_unlock(&s->lock);
+  if (s->pin_workers) {
+    pin(s,w->index);
+  }
+  gboolean adaptive = s->max_workers > s->min_workers;
+  gsize bufsize = fuse_chan_bufsize(s->ch);
+  struct fuse_buf buf;
+  memset(&buf,0,sizeof(buf));
+  buf.mem = g_malloc(bufsize);
+  buf.size = bufsize;
+  gboolean retired = FALSE;
+  while (!fuse_session_exited(s->se)) {
+    if (g_atomic_int_get(&s->quiesce) || g_atomic_int_get(&w->retire)) {
+      g_mutex_lock(&s->lock);
+      retired = w->retire && !s->joining;
+      if (retired) {
+	retire(s,w);
+      } else if (s->quiesce) {
+	park(s);
+      }
+      g_mutex_unlock(&s->lock);
+      if (retired) break;
+      continue;
+    }
+    struct fuse_chan * ch = s->ch;
+    buf.size = bufsize;
+    int n = fuse_session_receive_buf(s->se,&buf,&ch);
+    if (n == -EINTR || n == -EAGAIN) {
+      // kicked, or another worker got it
+      continue;
+    }
+    if (n <= 0) {
+      fuse_session_exit(s->se);
+      break;
+    }
+    gint busy = g_atomic_int_add(&s->busy,1) + 1;
+    gint peak;
+    while (busy > (peak = g_atomic_int_get(&s->peak)) &&
+	   !g_atomic_int_compare_and_exchange(&s->peak,peak,busy));
+    if (adaptive && (guint) busy >= s->min_workers) {
+      grow(s);
+    }
+    fuse_session_process_buf(s->se,&buf,ch);
+    g_atomic_int_add(&s->busy,-1);
+  }
+  g_private_set(&current_worker,NULL);
+  g_free(buf.mem);
+  g_free(w->reply);
+  w->reply = NULL;
+  if (retired) {
+    g_free(w);
+    return NULL;
+  }
+  g_mutex_lock(&s->lock);
+  s->running--;
+  g_cond_broadcast(&s->changed);
+  g_mutex_unlock(&s->lock);
+  // the others, and the control loop, have to notice
+  wake();
+  return NULL;
+}
+
+static gboolean start_workers(if_session * s, GError ** error) {
+  gboolean ok = TRUE;
+  g_mutex_lock(&s->lock);
+  for (guint idx = 0; idx < s->min_workers && ok; idx++) {
+    ok = spawn(s,error);
+  }
+  g_mutex_unlock(&s->lock);
+  return ok;
+}
+
+static gboolean none_running(if_session * s) {
+  return s->running == 0;
+}
+
+static gboolean all_parked(if_session * s) {
+  return s->parked >= s->running;
+}
+
+static void join_workers(if_session * s) {
+  fuse_session_exit(s->se);
+  g_mutex_lock(&s->lock);
+  // no more start or go away by themselves
+  s->joining = TRUE;
+  g_cond_broadcast(&s->changed);
+  kick_until(s,none_running);
+  GPtrArray * workers = s->workers;
+  s->workers = g_ptr_array_new();
+  g_mutex_unlock(&s->lock);
+  for (guint idx = 0; idx < workers->len; idx++) {
+    if_worker * w = g_ptr_array_index(workers,idx);
+    g_thread_join(w->thread);
+    g_free(w);
+  }
+  g_ptr_array_free(workers,TRUE);
+}
+
+/* get all workers out of the way, between two requests */
+static void quiesce(if_session * s) {
+  g_mutex_lock(&s->lock);
+  g_atomic_int_set(&s->quiesce,TRUE);
+  kick_until(s,all_parked);
+  g_mutex_unlock(&s->lock);
+}
+
+static void resume(if_session * s) {
+  g_mutex_lock(&s->lock);
+  drain_wake();
+  g_atomic_int_set(&s->quiesce,FALSE);
+  g_cond_broadcast(&s->changed);
+  g_mutex_unlock(&s->lock);
+  if (stopping) wake();
+}
+
+/*
+ * The state handed over. Both ends are the same program on the same
+ * host, so it goes as it is in memory.
+ */
+typedef struct takeover_request_s {
+  guint32 magic;
+  guint32 version;
+} takeover_request;
+
+typedef struct takeover_state_s {
+  guint32 magic;
+  guint32 version;
+  guint32 proto_major;
+  guint32 proto_minor;
+  guint32 max_readahead;
+  guint32 capable;
+  guint32 n_nodes;
+  guint32 n_opens;
+  guint32 managed;
+  guint32 index_size;
+  guint32 heatmap_size; // its counts follow this
+  guint32 padding;
+  guint64 next_ino;
+  guint64 next_open;
+  gchar identity[68];
+} takeover_state;
+
+typedef struct saved_node_s {
+  guint64 ino;
+  guint64 nlookup;
+  guint32 path_len;
+  guint32 padding;
+} saved_node;
+
+typedef struct saved_open_s {
+  guint64 id;
+  guint32 is_dir;
+  gint32 flags;
+  guint32 path_len;
+  guint32 listing_len; // G_MAXUINT32 if it wasn't read
+} saved_open;
+
+/* called with the workers parked */
+static GByteArray * save_state(if_session * s) {
+  GByteArray * out = g_byte_array_new();
+  takeover_state state;
+  memset(&state,0,sizeof(state));
+  state.magic = TAKEOVER_MAGIC;
+  state.version = TAKEOVER_VERSION;
+  state.proto_major = s->conn.proto_major;
+  state.proto_minor = s->conn.proto_minor;
+  state.max_readahead = s->conn.max_readahead;
+  state.capable = s->conn.capable;
+  state.n_nodes = g_hash_table_size(s->nodes);
+  state.n_opens = g_hash_table_size(s->opens);
+  state.managed = s->status->mountpoint_managed;
+  state.next_ino = s->next_ino;
+  state.next_open = s->next_open;
+  gchar * identity = im_image_identity(s->status->image,NULL);
+  if (identity != NULL) {
+    g_strlcpy(state.identity,identity,sizeof(state.identity));
+    g_free(identity);
+  }
+  GByteArray * index = g_byte_array_new();
+  if (im_image_save_index(s->status->image,index)) {
+    state.index_size = index->len;
+  }
+  GByteArray * heatmap = g_byte_array_new();
+  if (s->status->heatmap != NULL) {
+    if_heatmap_save(s->status->heatmap,heatmap);
+    state.heatmap_size = heatmap->len;
+  }
+  g_byte_array_append(out,(const guint8 *) &state,sizeof(state));
+  g_byte_array_append(out,heatmap->data,heatmap->len);
+  g_byte_array_free(heatmap,TRUE);
+  GHashTableIter iter;
+  gpointer value;
+  g_hash_table_iter_init(&iter,s->nodes);
+  while (g_hash_table_iter_next(&iter,NULL,&value)) {
+    const if_node * node = (const if_node *) value;
+    saved_node saved = { node->ino, node->nlookup, strlen(node->path), 0 };
+    g_byte_array_append(out,(const guint8 *) &saved,sizeof(saved));
+    g_byte_array_append(out,(const guint8 *) node->path,saved.path_len);
+  }
+  g_hash_table_iter_init(&iter,s->opens);
+  while (g_hash_table_iter_next(&iter,NULL,&value)) {
+    const if_open * o = (const if_open *) value;
+    saved_open saved = { o->id, o->is_dir, o->flags, strlen(o->path),
+			 o->listing != NULL ? o->listing->len : G_MAXUINT32 };
+    g_byte_array_append(out,(const guint8 *) &saved,sizeof(saved));
+    g_byte_array_append(out,(const guint8 *) o->path,saved.path_len);
+    if (o->listing != NULL) {
+      g_byte_array_append(out,o->listing->data,o->listing->len);
+    }
+  }
+  g_byte_array_append(out,index->data,index->len);
+  g_byte_array_free(index,TRUE);
+  return out;
+}
+
+/* reads state, checking it doesn't run past the end */
+typedef struct reader_s {
+  const guint8 * p;
+  const guint8 * end;
+} reader;
+
+static gboolean get(reader * r, gpointer dest, gsize size) {
+  if ((gsize) (r->end - r->p) < size) {
+    return FALSE;
+  }
+  memcpy(dest,r->p,size);
+  r->p += size;
+  return TRUE;
+}
+
+static gchar * get_string(reader * r, gsize len) {
+  if ((gsize) (r->end - r->p) < len) {
+    return NULL;
+  }
+  gchar * string = g_strndup((const gchar *) r->p,len);
+  r->p += len;
+  return string;
+}
+
+/* tell libfuse about the connection the kernel set up with the old process */
+static void replay_init(if_session * s, const takeover_state * state) {
+  struct {
+    in_header header;
+    init_in init;
+  } request;
+  memset(&request,0,sizeof(request));
+  request.header.len = sizeof(request);
+  request.header.opcode = FUSE_OPCODE_INIT;
+  request.header.unique = TAKEOVER_UNIQUE;
+  request.header.uid = getuid();
+  request.header.gid = getgid();
+  request.header.pid = getpid();
+  request.init.major = state->proto_major;
+  request.init.minor = state->proto_minor;
+  request.init.max_readahead = state->max_readahead;
+  request.init.flags = state->capable;
+  fuse_session_process(s->se,(const char *) &request,sizeof(request),s->ch);
+}
+
+/* take the state the old process sent; the workers aren't running yet */
+static gboolean load_state(if_session * s, const guint8 * data, gsize size,
+			   GError ** error) {
+  reader r = { data, data + size };
+  takeover_state state;
+  if (!get(&r,&state,sizeof(state)) || state.magic != TAKEOVER_MAGIC ||
+      state.version != TAKEOVER_VERSION) {
+    g_set_error(error,IM_ERROR_DOMAIN,IM_ERROR_TAKEOVER,"unknown state format");
+    return FALSE;
+  }
+  // check the image before isofuse_ops.init, which takes it as it is
+  im_image * image = im_image_open_full(s->status->path,&s->status->open_options,error);
+  if (image == NULL) {
+    return FALSE;
+  }
+  gchar * identity = im_image_identity(image,error);
+  gboolean same = identity != NULL && strcmp(identity,state.identity) == 0;
+  if (identity != NULL && !same) {
+    g_set_error(error,IM_ERROR_DOMAIN,IM_ERROR_TAKEOVER,
+		"%s is not the image mounted",s->status->path);
+  }
+  g_free(identity);
+  if (!same) {
+    im_image_close(image);
+    return FALSE;
+  }
+  s->status->image = image;
+  guint prescan_threads = s->status->prescan_threads;
+  s->status->prescan_threads = 0;
+  replay_init(s,&state);
+  s->status->prescan_threads = prescan_threads;
+  // before the files are opened again, which would come first otherwise
+  if (state.heatmap_size > 0) {
+    if ((gsize) (r.end - r.p) < state.heatmap_size) {
+      g_set_error(error,IM_ERROR_DOMAIN,IM_ERROR_TAKEOVER,"truncated state");
+      return FALSE;
+    }
+    if (s->status->heatmap != NULL &&
+	!if_heatmap_load(s->status->heatmap,r.p,state.heatmap_size)) {
+      g_warning("heatmap not taken over");
+    }
+    r.p += state.heatmap_size;
+  }
+  g_hash_table_remove_all(s->nodes);
+  g_hash_table_remove_all(s->paths);
+  for (guint32 idx = 0; idx < state.n_nodes; idx++) {
+    saved_node saved;
+    gchar * path;
+    if (!get(&r,&saved,sizeof(saved)) || (path = get_string(&r,saved.path_len)) == NULL) {
+      g_set_error(error,IM_ERROR_DOMAIN,IM_ERROR_TAKEOVER,"truncated state");
+      return FALSE;
+    }
+    node_add(s,saved.ino,path,saved.nlookup);
+    g_free(path);
+  }
+  for (guint32 idx = 0; idx < state.n_opens; idx++) {
+    saved_open saved;
+    gchar * path;
+    if (!get(&r,&saved,sizeof(saved)) || (path = get_string(&r,saved.path_len)) == NULL) {
+      g_set_error(error,IM_ERROR_DOMAIN,IM_ERROR_TAKEOVER,"truncated state");
+      return FALSE;
+    }
+    struct fuse_file_info fi;
+    memset(&fi,0,sizeof(fi));
+    fi.flags = saved.flags;
+    int (*open_op)(const char *, struct fuse_file_info *) =
+      saved.is_dir ? isofuse_ops.opendir : isofuse_ops.open;
+    int result = open_op != NULL ? open_op(path,&fi) : 0;
+    if (result != 0) {
+      g_set_error(error,IM_ERROR_DOMAIN,IM_ERROR_TAKEOVER,
+		  "can't open %s again: %s",path,g_strerror(-result));
+      g_free(path);
+      return FALSE;
+    }
+    if_open * o = open_add(s,saved.id,path,saved.is_dir,&fi);
+    g_free(path);
+    if (saved.listing_len != G_MAXUINT32) {
+      o->listing = g_byte_array_sized_new(saved.listing_len);
+      g_byte_array_set_size(o->listing,saved.listing_len);
+      if (!get(&r,o->listing->data,saved.listing_len)) {
+	g_set_error(error,IM_ERROR_DOMAIN,IM_ERROR_TAKEOVER,"truncated state");
+	return FALSE;
+      }
+    }
+  }
+  s->next_ino = state.next_ino;
+  s->next_open = state.next_open;
+  s->status->mountpoint_managed = state.managed;
+  GError * index_error = NULL;
+  if (state.index_size > 0 &&
+      !im_image_load_index(s->status->image,r.p,MIN(state.index_size,r.end - r.p),
+			   &index_error)) {
+    g_warning("index not taken over: %s",index_error->message);
+    g_clear_error(&index_error);
+  }
+  // scan again if it wasn't done, or is lost
+  if (s->status->prescan_threads > 0 && im_image_index_memory(s->status->image,NULL) == 0 &&
+      !im_image_prescan(s->status->image,s->status->prescan_threads,&index_error)) {
+    g_warning("prescan not started: %s",index_error->message);
+    g_clear_error(&index_error);
+  }
+  return TRUE;
+}
+
+/*
+ * The control socket
+ */
+
+static gchar * control_path(const gchar * mountpoint) {
+  gchar * hash = g_compute_checksum_for_string(G_CHECKSUM_SHA1,mountpoint,-1);
+  gchar * name = g_strconcat(hash,".sock",NULL);
+  gchar * path = g_build_filename(g_get_user_runtime_dir(),PACKAGE_NAME,name,NULL);
+  g_free(name);
+  g_free(hash);
+  return path;
+}
+
+static gboolean control_address(const gchar * path, struct sockaddr_un * addr,
+				GError ** error) {
+  memset(addr,0,sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr->sun_path)) {
+    g_set_error(error,IM_ERROR_DOMAIN,IM_ERROR_TAKEOVER,"control socket path too long: %s",path);
+    return FALSE;
+  }
+  strcpy(addr->sun_path,path);
+  return TRUE;
+}
+
+static int control_listen(const gchar * path, GError ** error) {
+  struct sockaddr_un addr;
+  if (!control_address(path,&addr,error)) {
+    return -1;
+  }
+  gchar * dir = g_path_get_dirname(path);
+  g_mkdir_with_parents(dir,0700);
+  g_free(dir);
+  unlink(path);
+  int fd = socket(AF_UNIX,SOCK_STREAM | SOCK_CLOEXEC,0);
+  if (fd < 0 || bind(fd,(struct sockaddr *) &addr,sizeof(addr)) != 0 || listen(fd,1) != 0) {
+    g_set_error(error,IM_ERROR_DOMAIN,IM_ERROR_TAKEOVER,
+		"control socket %s: %s",path,g_strerror(errno));
+    if (fd >= 0) close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static gboolean write_all(int fd, const guint8 * data, gsize size) {
+  while (size > 0) {
+    ssize_t n = write(fd,data,size);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return FALSE;
+    data += n;
+    size -= n;
+  }
+  return TRUE;
+}
+
+static gboolean read_all(int fd, guint8 * data, gsize size) {
+  while (size > 0) {
+    ssize_t n = read(fd,data,size);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return FALSE;
+    data += n;
+    size -= n;
+  }
+  return TRUE;
+}
+
+/* size, with the fuse device along */
+static gboolean send_device(int sock, int fd, guint64 size) {
+  char control[CMSG_SPACE(sizeof(int))];
+  memset(control,0,sizeof(control));
+  struct iovec iov = { &size, sizeof(size) };
+  struct msghdr msg;
+  memset(&msg,0,sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  struct cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg),&fd,sizeof(int));
+  return sendmsg(sock,&msg,0) == sizeof(size);
+}
+
+static int receive_device(int sock, guint64 * size) {
+  char control[CMSG_SPACE(sizeof(int))];
+  struct iovec iov = { size, sizeof(*size) };
+  struct msghdr msg;
+  memset(&msg,0,sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  if (recvmsg(sock,&msg,MSG_CMSG_CLOEXEC) != sizeof(*size)) {
+    return -1;
+  }
+  struct cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+    return -1;
+  }
+  int fd;
+  memcpy(&fd,CMSG_DATA(cmsg),sizeof(int));
+  return fd;
+}
+
+/* serve a process asking to take over; TRUE if it did */
+static gboolean hand_over(if_session * s, int sock) {
+  struct ucred cred;
+  socklen_t len = sizeof(cred);
+  takeover_request request;
+  if (getsockopt(sock,SOL_SOCKET,SO_PEERCRED,&cred,&len) != 0 || cred.uid != getuid() ||
+      !read_all(sock,(guint8 *) &request,sizeof(request)) ||
+      request.magic != TAKEOVER_MAGIC || request.version != TAKEOVER_VERSION) {
+    g_warning("takeover refused");
+    return FALSE;
+  }
+  g_message("handing the mount over to process %d",(int) cred.pid);
+  quiesce(s);
+  GByteArray * state = save_state(s);
+  gboolean ok = send_device(sock,s->fd,state->len) &&
+    write_all(sock,state->data,state->len);
+  g_byte_array_free(state,TRUE);
+  // the new process says when it's ready, or closes the socket
+  char reply = 0;
+  struct pollfd pfd = { sock, POLLIN, 0 };
+  ok = ok && poll(&pfd,1,TAKEOVER_TIMEOUT) == 1 && read(sock,&reply,1) == 1 && reply == 'K';
+  if (!ok) {
+    g_warning("takeover by process %d failed, going on",(int) cred.pid);
+    resume(s);
+    return FALSE;
+  }
+  s->status->phase = HANDED_OVER;
+  fuse_session_exit(s->se);
+  g_mutex_lock(&s->lock);
+  g_cond_broadcast(&s->changed);
+  g_mutex_unlock(&s->lock);
+  return TRUE;
+}
+
+/* the main thread, while the workers serve requests */
+static void control_loop(if_session * s, int listener) {
+  struct pollfd fds[2] = { { wake_pipe[0], POLLIN, 0 }, { listener, POLLIN, 0 } };
+  gboolean adaptive = s->max_workers > s->min_workers;
+  while (!stopping && !fuse_session_exited(s->se)) {
+    int ready = poll(fds,listener >= 0 ? 2 : 1,adaptive ? WORKER_IDLE_TIMEOUT : -1);
+    if (ready < 0) {
+      continue;
+    }
+    if (ready == 0) {
+      trim(s);
+      continue;
+    }
+    if (fds[0].revents & POLLIN) {
+      drain_wake();
+    }
+    if (listener >= 0 && (fds[1].revents & POLLIN)) {
+      int sock = accept4(listener,NULL,NULL,SOCK_CLOEXEC);
+      if (sock >= 0) {
+	gboolean gone = hand_over(s,sock);
+	close(sock);
+	if (gone) break;
+      }
+    }
+  }
+}
+
+/* get the fuse device and state from the process serving mountpoint */
+static int take_over(if_session * s, GError ** error) {
+  struct sockaddr_un addr;
+  if (!control_address(s->control_path,&addr,error)) {
+    return -1;
+  }
+  int sock = socket(AF_UNIX,SOCK_STREAM | SOCK_CLOEXEC,0);
+  if (sock < 0 || connect(sock,(struct sockaddr *) &addr,sizeof(addr)) != 0) {
+    g_set_error(error,IM_ERROR_DOMAIN,IM_ERROR_TAKEOVER,
+		"no isomounter serving %s: %s",s->mountpoint,g_strerror(errno));
+    if (sock >= 0) close(sock);
+    return -1;
+  }
+  takeover_request request = { TAKEOVER_MAGIC, TAKEOVER_VERSION };
+  guint64 size = 0;
+  int fd = -1;
+  if (write_all(sock,(const guint8 *) &request,sizeof(request))) {
+    fd = receive_device(sock,&size);
+  }
+  if (fd < 0) {
+    g_set_error(error,IM_ERROR_DOMAIN,IM_ERROR_TAKEOVER,"the serving process refused");
+    close(sock);
+    return -1;
+  }
+  guint8 * data = g_malloc(MAX(size,1));
+  if (!read_all(sock,data,size)) {
+    g_set_error(error,IM_ERROR_DOMAIN,IM_ERROR_TAKEOVER,"state cut short");
+    g_free(data);
+    close(fd);
+    close(sock);
+    return -1;
+  }
+  s->fd = fd;
+  s->ch = fuse_chan_new(&taken_chan_ops,fd,CHAN_BUFSIZE,NULL);
+  gboolean ok = s->ch != NULL;
+  if (!ok) {
+    g_set_error(error,IM_ERROR_DOMAIN,IM_ERROR_TAKEOVER,"can't set up the fuse channel");
+    close(fd);
+  } else {
+    fuse_session_add_chan(s->se,s->ch);
+    ok = load_state(s,data,size,error);
+  }
+  g_free(data);
+  // the old process quits when it reads this
+  ok = ok && write_all(sock,(const guint8 *) "K",1);
+  close(sock);
+  return ok ? fd : -1;
+}
+
+static if_session * session_new(if_status * status) {
+  if_session * s = g_new0(if_session,1);
+  s->status = status;
+  s->fd = -1;
+  g_mutex_init(&s->lock);
+  g_cond_init(&s->changed);
+  s->workers = g_ptr_array_new();
+  s->nodes = g_hash_table_new(g_int64_hash,g_int64_equal);
+  s->paths = g_hash_table_new_full(g_str_hash,g_str_equal,NULL,node_free);
+  s->opens = g_hash_table_new_full(g_int64_hash,g_int64_equal,NULL,open_free);
+  node_add(s,FUSE_ROOT_ID,"/",1);
+  s->next_ino = FUSE_ROOT_ID + 1;
+  s->next_open = 1;
+  return s;
+}
+
+static void session_free(if_session * s) {
+  g_hash_table_destroy(s->opens);
+  g_hash_table_destroy(s->nodes);
+  g_hash_table_destroy(s->paths);
+  g_ptr_array_free(s->workers,TRUE);
+  g_cond_clear(&s->changed);
+  g_mutex_clear(&s->lock);
+  g_free(s->control_path);
+  g_free(s->mountpoint);
+  g_free(s);
+}
+
+int if_session_main(gchar ** argv, if_status * status, gboolean takeover) {
+  GError * error = NULL;
+  struct fuse_args args = FUSE_ARGS_INIT(g_strv_length(argv),argv);
+  char * mountpoint = NULL;
+  int multithreaded = 0;
+  int foreground = 0;
+  if_mount_conf conf = { ATTR_TIMEOUT, ENTRY_TIMEOUT };
+  if (fuse_parse_cmdline(&args,&mountpoint,&multithreaded,&foreground) != 0 ||
+      mountpoint == NULL || fuse_opt_parse(&args,&conf,conf_opts,conf_proc) != 0) {
+    g_warning("bad fuse arguments");
+    free(mountpoint);
+    return 1;
+  }
+  if_session * s = session_new(status);
+  s->conf = conf;
+  s->mountpoint = g_strdup(mountpoint);
+  free(mountpoint);
+  s->control_path = control_path(s->mountpoint);
+  if (!multithreaded) {
+    s->min_workers = s->max_workers = 1;
+  } else if (status->max_workers > 0) {
+    s->max_workers = MIN(status->max_workers,MAX_WORKERS);
+    s->min_workers = MAX(MIN(status->min_workers,s->max_workers),1);
+  } else {
+    s->min_workers = s->max_workers = MAX(2,MIN(g_get_num_processors(),DEFAULT_WORKERS));
+  }
+  s->pin_workers = status->pin_workers;
+  // once: a worker started by a pinned one would get just its processor
+  if (sched_getaffinity(0,sizeof(s->cpus),&s->cpus) != 0) {
+    CPU_ZERO(&s->cpus);
+  }
+  int result = 1;
+  // whether the mount is ours to undo when we are done
+  gboolean owner = FALSE;
+  if (!setup_signals(&error)) {
+    goto out;
+  }
+  if (!takeover) {
+    s->ch = fuse_mount(s->mountpoint,&args);
+    if (s->ch == NULL) {
+      goto out;
+    }
+    s->fd = fuse_chan_fd(s->ch);
+    owner = TRUE;
+  }
+  s->se = fuse_lowlevel_new(&args,&ll_ops,sizeof(ll_ops),s);
+  if (s->se == NULL) {
+    goto out;
+  }
+  if (takeover) {
+    if (take_over(s,&error) < 0) {
+      goto out;
+    }
+    // the old process is gone, it is ours now
+    owner = TRUE;
+  } else {
+    fuse_session_add_chan(s->se,s->ch);
+  }
+  if (fuse_daemonize(foreground) != 0) {
+    goto out;
+  }
+  // blocking, whatever the process that had it before did
+  fcntl(s->fd,F_SETFL,fcntl(s->fd,F_GETFL) & ~O_NONBLOCK);
+  // without a control socket, nobody can take over but we still serve
+  int listener = control_listen(s->control_path,&error);
+  if (listener < 0) {
+    g_warning("%s",error->message);
+    g_clear_error(&error);
+  }
+  if (start_workers(s,&error)) {
+    control_loop(s,listener);
+    result = 0;
+  }
+  join_workers(s);
+  if (listener >= 0) {
+    close(listener);
+    // the new process has its own by now
+    if (status->phase != HANDED_OVER) unlink(s->control_path);
+  }
+ out:
+  if (error != NULL) {
+    g_warning("%s",error->message);
+    g_clear_error(&error);
+  }
+  if (s->se != NULL) {
+    if (s->ch != NULL) fuse_session_remove_chan(s->ch);
+    fuse_session_destroy(s->se);
+  }
+  if (s->ch != NULL) {
+    if (!owner || status->phase == HANDED_OVER) {
+      // somebody else keeps it mounted
+      fuse_chan_destroy(s->ch);
+    } else {
+      fuse_unmount(s->mountpoint,s->ch);
+    }
+  }
+  fuse_opt_free_args(&args);
+  session_free(s);
+  return result;
+}
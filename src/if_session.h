@@ -0,0 +1,29 @@
+/* if_session.h - the fuse session, and handing it over
+ *
+ * Copyright (C) 2016 Leo Cacciari <leo.cacciari@gmail.com>
+ *
+ * This file belongs to the isomounter project.
+ * isomounter is free software and is distributed under the terms of the
+ * GNU GPL. See the file COPYING for details.
+ */
+#ifndef __IF_SESSION_H__
+#define __IF_SESSION_H__
+#include "common.h"
+#include "if_utils.h"
+
+/**
+ * Serve the mount with the operations in isofuse_ops, as fuse_main()
+ * would with the same arguments, from a pool of threads: as many as
+ * status says, growing while all are busy and shrinking when idle if
+ * it gives a range, and each pinned to a processor if it asks. The inode
+ * numbers and open handles the kernel knows are ours rather than
+ * libfuse's, so that they can be given to another process.
+ *
+ * With takeover, nothing is mounted: the fuse connection of the
+ * isomounter process serving the mountpoint is taken over, with its
+ * inodes, open files and index, and that process quits without
+ * unmounting. Returns the exit status.
+ */
+int if_session_main(gchar ** argv, if_status * status, gboolean takeover);
+
+#endif /*__IF_SESSION_H__*/
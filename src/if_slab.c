@@ -0,0 +1,129 @@
+/* if_slab.c - per thread allocation of small fixed size objects
+ *
+ * Copyright (C) 2016 Leo Cacciari <leo.cacciari@gmail.com>
+ *
+ * This file belongs to the isomounter project.
+ * isomounter is free software and is distributed under the terms of the
+ * GNU GPL. See the file COPYING for details.
+ */
+#include "common.h"
+#include "if_slab.h"
+
+/*
+ * A free object holds the pointer to the next one in its first
+ * bytes, so objects are at least as big as a pointer.
+ */
+typedef struct cache_s {
+  if_slab * slab;
+  gint generation;  // objects from before if_slab_clear() are gone
+  gpointer free;
+  guint n_free;
+} cache;
+
+static gsize object_size(const if_slab * slab) {
+  gsize size = MAX(slab->size,sizeof(gpointer));
+  return (size + sizeof(gpointer) - 1) & ~(sizeof(gpointer) - 1);
+}
+
+void if_slab_cache_release(gpointer data) {
+  cache * c = (cache *) data;
+  if_slab * slab = c->slab;
+  g_mutex_lock(&slab->lock);
+  if (c->free != NULL && c->generation == slab->generation) {
+    gpointer * tail = c->free;
+    while (*tail != NULL) tail = *tail;
+    *tail = slab->depot;
+    slab->depot = c->free;
+  }
+  g_mutex_unlock(&slab->lock);
+  g_free(c);
+}
+
+static cache * cache_get(if_slab * slab) {
+  cache * c = g_private_get(&slab->cache);
+  gint generation = g_atomic_int_get(&slab->generation);
+  if (c == NULL || c->generation != generation) {
+    c = g_new(cache,1);
+    c->slab = slab;
+    c->generation = generation;
+    c->free = NULL;
+    c->n_free = 0;
+    g_private_replace(&slab->cache,c);
+  }
+  return c;
+}
+
+/* cut the first IF_SLAB_CHUNK objects, at most, off *list, the
+ * last one in *last */
+static gpointer take_chunk(gpointer * list, guint * n, gpointer ** last) {
+  gpointer first = *list;
+  *last = first;
+  for (*n = 1; *n < IF_SLAB_CHUNK && **last != NULL; (*n)++) {
+    *last = **last;
+  }
+  *list = **last;
+  **last = NULL;
+  return first;
+}
+
+/* a chunk's worth from the depot, or a new chunk */
+static void refill(if_slab * slab, cache * c) {
+  g_mutex_lock(&slab->lock);
+  if (slab->depot != NULL) {
+    gpointer * last;
+    c->free = take_chunk(&slab->depot,&c->n_free,&last);
+  } else {
+    gsize size = object_size(slab);
+    guint8 * chunk = g_malloc(size * IF_SLAB_CHUNK);
+    slab->chunks = g_slist_prepend(slab->chunks,chunk);
+    for (guint idx = 0; idx < IF_SLAB_CHUNK; idx++) {
+      gpointer * object = (gpointer *) (chunk + idx * size);
+      *object = idx + 1 < IF_SLAB_CHUNK ? chunk + (idx + 1) * size : NULL;
+    }
+    c->free = chunk;
+    c->n_free = IF_SLAB_CHUNK;
+  }
+  g_mutex_unlock(&slab->lock);
+}
+
+gpointer if_slab_alloc(if_slab * slab) {
+  cache * c = cache_get(slab);
+  if (c->free == NULL) {
+    refill(slab,c);
+  }
+  gpointer * object = c->free;
+  c->free = *object;
+  c->n_free--;
+  return object;
+}
+
+void if_slab_free(if_slab * slab, gpointer object) {
+  if (object == NULL) {
+    return;
+  }
+  cache * c = cache_get(slab);
+  *(gpointer *) object = c->free;
+  c->free = object;
+  if (++c->n_free > IF_SLAB_LOCAL_MAX) {
+    guint n;
+    gpointer * tail;
+    gpointer spilled = take_chunk(&c->free,&n,&tail);
+    c->n_free -= n;
+    g_mutex_lock(&slab->lock);
+    // unless if_slab_clear() came in the meantime
+    if (c->generation == slab->generation) {
+      *tail = slab->depot;
+      slab->depot = spilled;
+    }
+    g_mutex_unlock(&slab->lock);
+  }
+}
+
+void if_slab_clear(if_slab * slab) {
+  g_mutex_lock(&slab->lock);
+  g_slist_free_full(slab->chunks,g_free);
+  slab->chunks = NULL;
+  slab->depot = NULL;
+  g_atomic_int_inc(&slab->generation);
+  g_mutex_unlock(&slab->lock);
+}
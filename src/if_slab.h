@@ -0,0 +1,51 @@
+/* if_slab.h - per thread allocation of small fixed size objects
+ *
+ * Copyright (C) 2016 Leo Cacciari <leo.cacciari@gmail.com>
+ *
+ * This file belongs to the isomounter project.
+ * isomounter is free software and is distributed under the terms of the
+ * GNU GPL. See the file COPYING for details.
+ */
+#ifndef __IF_SLAB_H__
+#define __IF_SLAB_H__
+#include "common.h"
+
+/* objects carved from the system at once */
+#define IF_SLAB_CHUNK 64
+/* past these on a thread's free list, a chunk's worth goes to the depot */
+#define IF_SLAB_LOCAL_MAX (2 * IF_SLAB_CHUNK)
+
+/**
+ * Objects come from a free list of the calling thread, and go back
+ * to the one of the thread freeing them, so that the fuse workers
+ * never contend for them. The lists are refilled with whole chunks.
+ * The free list of a thread that exits goes to a shared depot,
+ * where the others look before asking for a new chunk, and so does
+ * what a thread freeing more than it allocates has in excess.
+ *
+ * Declare slabs as static variables, initialized with IF_SLAB_INIT.
+ */
+typedef struct if_slab_s {
+  gsize size;
+  GPrivate cache;  // the list of the calling thread
+  GMutex lock;     // for the fields below
+  gint generation;
+  GSList * chunks;
+  gpointer depot;
+} if_slab;
+
+void if_slab_cache_release(gpointer data);
+
+#define IF_SLAB_INIT(type) { .size = sizeof(type), \
+      .cache = G_PRIVATE_INIT(if_slab_cache_release) }
+
+gpointer if_slab_alloc(if_slab * slab);
+void if_slab_free(if_slab * slab, gpointer object);
+
+/**
+ * Give all the memory back. Every object allocated from slab goes
+ * too, with the free lists of the threads still around.
+ */
+void if_slab_clear(if_slab * slab);
+
+#endif /*__IF_SLAB_H__*/
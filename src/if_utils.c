@@ -9,11 +9,15 @@
 #include "common.h"
 #include "if_utils.h"
 #include "im_config.h"
+#include "if_slab.h"
 #include <time.h>
 
 #define DEFAULT_FILE_PERMISSIONS S_IRUSR | S_IRGRP | S_IROTH
 #define DEFAULT_DIR_PERMISSIONS DEFAULT_FILE_PERMISSIONS | S_IXUSR | S_IXGRP | S_IXOTH 
 
+// there is one mount per process
+static if_status * _status = NULL;
+
 if_status * if_status_new() {
   const im_config_t * config = im_get_config();
   if_status * status = g_malloc0(sizeof(if_status));
@@ -23,25 +27,58 @@ if_status * if_status_new() {
     status->owner_gid = getgid();
     status->default_file_mode = DEFAULT_FILE_PERMISSIONS | S_IFREG;
     status->default_dir_mode = DEFAULT_DIR_PERMISSIONS | S_IFDIR;
+    status->prescan_threads = config->prescan ? config->prescan_threads : 0;
+    status->open_options.cache_size = (gsize) config->cache_size * 1024 * 1024;
+    status->open_options.prefetch = config->prefetch;
+    status->open_options.l2cache_dir = config->l2cache_dir;
+    status->open_options.l2cache_size = (guint64) config->l2cache_size * 1024 * 1024;
+    status->open_options.shm_cache_size = (guint64) config->shm_cache_size * 1024 * 1024;
+    status->open_options.mmap = config->mmap;
+    status->open_options.dedup_dir = config->dedup_dir;
+    status->open_options.dedup_size = (guint64) config->dedup_size * 1024 * 1024;
+    status->heatmap_path = config->heatmap_path;
+    status->min_workers = config->min_workers;
+    status->max_workers = config->max_workers;
+    status->pin_workers = config->pin_workers;
+    status->open_options.crypt_key = config->crypt_key;
+    status->open_options.crypt_key_size = config->crypt_key_size;
+    status->open_options.crypt_unit = config->crypt_unit;
   }
+  _status = status;
   return status;
 }
 
 void if_status_destroy(if_status * status) {
   if (status != NULL) {
+    if (_status == status) _status = NULL;
     g_free(status->path);
     g_free(status);
   }
 }
 
+static if_slab handle_slab = IF_SLAB_INIT(if_handle);
+
+if_handle * if_handle_new(const im_entry * entry) {
+  if_handle * handle = if_slab_alloc(&handle_slab);
+  handle->entry = *entry;
+  handle->export = NULL;
+  return handle;
+}
+
+void if_handle_free(if_handle * handle) {
+  if_slab_free(&handle_slab,handle);
+}
+
+void if_handles_clear() {
+  if_slab_clear(&handle_slab);
+}
+
 if_status * get_status() {
-  struct fuse_context * ctx = fuse_get_context();
-  return ctx != NULL ? (if_status *) ctx->private_data : NULL;
+  return _status;
 }
 
-int translate_stat(iso9660_stat_t * src,struct stat * dest) {
-  struct fuse_context * ctx = fuse_get_context();
-  if_status * status = (if_status *) ctx->private_data;
+int translate_stat(const im_entry * src,struct stat * dest) {
+  if_status * status = get_status();
   // dest->st_dev ignored
   // dest->st_ino ignored. Can be useful
   dest->st_mode = IS_DIRECTORY(src) ?
@@ -50,12 +87,11 @@ int translate_stat(iso9660_stat_t * src,struct stat * dest) {
   dest->st_nlink = 1; // ???
   dest->st_uid = status->owner_uid;
   dest->st_gid = status->owner_gid;
-  dest->st_size = src->size; // TODO Check endianity
-  time_t ct = mktime(&src->tm);
+  dest->st_size = src->size;
   // we don't keep track of last access...
   dest->st_atim.tv_sec =
     dest->st_mtim.tv_sec =
-    dest->st_ctim.tv_sec = ct;
+    dest->st_ctim.tv_sec = src->mtime;
 
   return 0;
 }
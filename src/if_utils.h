@@ -10,18 +10,24 @@
 #define  __IF_UTILS_H__
 
 #include "common.h"
-#include <cdio/cdio.h>
-#include <cdio/iso9660.h>
+#include "im_image.h"
+#include "if_pressure.h"
+#include "if_heatmap.h"
+#include "if_export.h"
 #include <fuse.h>
 
-#define IS_DIRECTORY(stats) ((stats)->type == _STAT_DIR)
+#define IS_DIRECTORY(entry) ((entry)->is_dir)
 
 extern struct fuse_operations isofuse_ops;
 
-typedef struct if_dir_s {
-  gchar * path;
-  iso9660_stat_t * info;
-} if_dir;
+/**
+ * What open and opendir leave in fuse_file_info.fh. Paths aren't
+ * kept: fuse passes them along with the handle.
+ */
+typedef struct if_handle_s {
+  im_entry entry;
+  if_export * export; // for the archives of the hidden tree
+} if_handle;
 
 /**
  * Used to store the status of this fuse instance.
@@ -31,6 +37,7 @@ typedef struct isofuse_status_s {
     AT_START = 0,
     AFTER_MOUNT,
     AFTER_UMOUNT,
+    HANDED_OVER,  // another process serves the mount now
     IN_ERROR
   } phase;
   gchar     * path;
@@ -40,7 +47,17 @@ typedef struct isofuse_status_s {
   gid_t owner_gid;
   mode_t default_file_mode;
   mode_t default_dir_mode;
-  iso9660_t * fh;
+  // 0 for no prescan
+  guint prescan_threads;
+  im_open_options open_options;
+  im_image * image;
+  if_pressure * pressure; // NULL if the image caches nothing in memory
+  // 0 for the default; fewer than max if the pool may grow and shrink
+  guint min_workers;
+  guint max_workers;
+  gboolean pin_workers;
+  const gchar * heatmap_path; // where to write the heatmap at unmount, or NULL
+  if_heatmap * heatmap;
 } if_status;
 
 if_status * if_status_new();
@@ -48,10 +65,17 @@ void if_status_destroy(if_status * status);
 if_status * get_status();
 
 
+/**
+ * Handles come from a per thread slab.
+ */
+if_handle * if_handle_new(const im_entry * entry);
+void if_handle_free(if_handle * handle);
+void if_handles_clear();
+
 /**
  * Extract data 
  */
-int translate_stat(iso9660_stat_t * src,struct stat * dest);
+int translate_stat(const im_entry * src,struct stat * dest);
 
 
 #endif /*  __IF_UTILS_H__ */
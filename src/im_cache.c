@@ -0,0 +1,244 @@
+/* im_cache.c - a memory cache of image chunks
+ *
+ * Copyright (C) 2016 Leo Cacciari <leo.cacciari@gmail.com>
+ *
+ * This file belongs to the isomounter project.
+ * isomounter is free software and is distributed under the terms of the
+ * GNU GPL. See the file COPYING for details.
+ */
+#include "common.h"
+#include "im_source.h"
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+/*
+ * The inner source is read in aligned chunks, kept in LRU order.
+ * A chunk is in the table from the moment someone starts loading
+ * it: whoever needs it meanwhile waits for that load instead of
+ * starting another one. Chunks are reference counted, the table
+ * holding one reference, so that eviction doesn't pull one from
+ * under a reader.
+ */
+typedef enum {
+  CHUNK_LOADING,
+  CHUNK_READY,
+  CHUNK_FAILED,
+} chunk_state;
+
+typedef struct chunk_s {
+  guint64 index;
+  gint refs;
+  chunk_state state;
+  int error;
+  gsize size;  // the last chunk of the image is shorter
+  GList link;  // in the LRU list, when ready
+  guint8 data[];
+} chunk;
+
+typedef struct cache_source_s {
+  im_source base;
+  im_source * inner;
+  guint max_capacity; // in chunks, as opened
+  guint prefetch;
+  GMutex lock;    // for all the fields below
+  GCond loaded;
+  guint capacity; // in chunks, now
+  GHashTable * chunks; // index -> chunk
+  GQueue lru;          // most recent first
+  GThreadPool * prefetcher;
+  guint64 hits;
+  guint64 misses;
+} cache_source;
+
+static void chunk_unref(chunk * c) {
+  if (g_atomic_int_dec_and_test(&c->refs)) {
+    g_free(c);
+  }
+}
+
+/* a loading chunk, in the table; called with the lock held */
+static chunk * chunk_start(cache_source * cache, guint64 index) {
+  guint64 start = index * IM_CACHE_CHUNK_SIZE;
+  chunk * c = g_malloc(sizeof(chunk) + IM_CACHE_CHUNK_SIZE);
+  c->index = index;
+  c->refs = 2; // the table's and the loader's
+  c->state = CHUNK_LOADING;
+  c->error = 0;
+  c->size = MIN(IM_CACHE_CHUNK_SIZE,cache->base.size - start);
+  c->link.data = c;
+  c->link.prev = c->link.next = NULL;
+  g_hash_table_insert(cache->chunks,&c->index,c);
+  return c;
+}
+
+/* called with the lock held */
+static void evict(cache_source * cache) {
+  while (cache->lru.length > cache->capacity) {
+    GList * link = cache->lru.tail;
+    chunk * c = (chunk *) link->data;
+    g_queue_unlink(&cache->lru,link);
+    g_hash_table_remove(cache->chunks,&c->index);
+    chunk_unref(c);
+  }
+}
+
+/* read c from the inner source, and tell who waits for it */
+static void chunk_load(cache_source * cache, chunk * c) {
+  int result = im_source_read(cache->inner,c->data,c->size,
+			      c->index * IM_CACHE_CHUNK_SIZE);
+  g_mutex_lock(&cache->lock);
+  if (result == 0) {
+    c->state = CHUNK_READY;
+    g_queue_push_head_link(&cache->lru,&c->link);
+    evict(cache);
+  } else {
+    // out of the table, so that the next reader tries again
+    c->state = CHUNK_FAILED;
+    c->error = result;
+    g_hash_table_remove(cache->chunks,&c->index);
+    chunk_unref(c);
+  }
+  g_cond_broadcast(&cache->loaded);
+  g_mutex_unlock(&cache->lock);
+}
+
+static void prefetch_one(gpointer data, gpointer user_data) {
+  cache_source * cache = (cache_source *) user_data;
+  chunk * c = (chunk *) data;
+  chunk_load(cache,c);
+  chunk_unref(c);
+}
+
+/* get chunks after index on their way; called with the lock held */
+static void prefetch(cache_source * cache, guint64 index) {
+  guint64 n_chunks = (cache->base.size + IM_CACHE_CHUNK_SIZE - 1) / IM_CACHE_CHUNK_SIZE;
+  for (guint64 next = index + 1; next <= index + cache->prefetch && next < n_chunks; next++) {
+    if (g_hash_table_lookup(cache->chunks,&next) == NULL) {
+      g_thread_pool_push(cache->prefetcher,chunk_start(cache,next),NULL);
+    }
+  }
+}
+
+/* the chunk at index, loaded; NULL with *error set if it can't be */
+static chunk * chunk_get(cache_source * cache, guint64 index, int * error) {
+  g_mutex_lock(&cache->lock);
+  chunk * c = g_hash_table_lookup(cache->chunks,&index);
+  gboolean load = FALSE;
+  if (c == NULL) {
+    cache->misses++;
+    c = chunk_start(cache,index);
+    load = TRUE;
+  } else {
+    cache->hits++;
+    g_atomic_int_inc(&c->refs);
+    if (c->state == CHUNK_READY) {
+      // move to the front
+      g_queue_unlink(&cache->lru,&c->link);
+      g_queue_push_head_link(&cache->lru,&c->link);
+    }
+  }
+  if (cache->prefetch > 0) {
+    prefetch(cache,index);
+  }
+  g_mutex_unlock(&cache->lock);
+  if (load) {
+    chunk_load(cache,c);
+  } else {
+    g_mutex_lock(&cache->lock);
+    while (c->state == CHUNK_LOADING) {
+      g_cond_wait(&cache->loaded,&cache->lock);
+    }
+    g_mutex_unlock(&cache->lock);
+  }
+  if (c->state == CHUNK_FAILED) {
+    *error = c->error;
+    chunk_unref(c);
+    return NULL;
+  }
+  return c;
+}
+
+static gssize cache_pread(im_source * source, gpointer buf, gsize size,
+			  guint64 offset) {
+  cache_source * cache = (cache_source *) source;
+  guint8 * data = (guint8 *) buf;
+  gsize done = 0;
+  while (done < size && offset < source->size) {
+    int error = 0;
+    chunk * c = chunk_get(cache,offset / IM_CACHE_CHUNK_SIZE,&error);
+    if (c == NULL) {
+      return done > 0 ? (gssize) done : error;
+    }
+    gsize skip = offset % IM_CACHE_CHUNK_SIZE;
+    gsize len = MIN(size - done,c->size - skip);
+    memcpy(data + done,c->data + skip,len);
+    chunk_unref(c);
+    done += len;
+    offset += len;
+  }
+  return done;
+}
+
+static void cache_close(im_source * source) {
+  cache_source * cache = (cache_source *) source;
+  // wait for the prefetches under way
+  g_thread_pool_free(cache->prefetcher,FALSE,TRUE);
+  g_debug("cache of %s: %" G_GUINT64_FORMAT " hits, %" G_GUINT64_FORMAT " misses",
+	  source->name,cache->hits,cache->misses);
+  GList * link;
+  while ((link = g_queue_pop_head_link(&cache->lru)) != NULL) {
+    chunk_unref((chunk *) link->data);
+  }
+  g_hash_table_destroy(cache->chunks);
+  g_mutex_clear(&cache->lock);
+  g_cond_clear(&cache->loaded);
+  im_source_close(cache->inner);
+}
+
+static void cache_get_budget(im_source * source, im_budget * budget) {
+  cache_source * cache = (cache_source *) source;
+  g_mutex_lock(&cache->lock);
+  budget->max = (gsize) cache->max_capacity * IM_CACHE_CHUNK_SIZE;
+  budget->budget = (gsize) cache->capacity * IM_CACHE_CHUNK_SIZE;
+  budget->used = (gsize) cache->lru.length * IM_CACHE_CHUNK_SIZE;
+  g_mutex_unlock(&cache->lock);
+}
+
+static void cache_set_budget(im_source * source, gsize bytes) {
+  cache_source * cache = (cache_source *) source;
+  g_mutex_lock(&cache->lock);
+  // room for what is being read ahead, still
+  cache->capacity = CLAMP(bytes / IM_CACHE_CHUNK_SIZE,cache->prefetch + 1,
+			  cache->max_capacity);
+  evict(cache);
+  g_mutex_unlock(&cache->lock);
+}
+
+static const im_source_ops cache_ops = {
+  .pread = cache_pread,
+  .get_budget = cache_get_budget,
+  .set_budget = cache_set_budget,
+  .close = cache_close,
+};
+
+im_source * im_cache_source_new(im_source * inner, gsize size, guint prefetch) {
+  cache_source * cache = g_new0(cache_source,1);
+  cache->base.ops = &cache_ops;
+  cache->base.name = g_strdup(inner->name);
+  cache->base.size = inner->size;
+  cache->base.version = g_strdup(inner->version);
+  cache->base.fd = -1;
+  cache->inner = inner;
+  // room for what is being read ahead, at least
+  cache->capacity = MAX(size / IM_CACHE_CHUNK_SIZE,prefetch + 1);
+  cache->max_capacity = cache->capacity;
+  cache->prefetch = prefetch;
+  g_mutex_init(&cache->lock);
+  g_cond_init(&cache->loaded);
+  cache->chunks = g_hash_table_new(g_int64_hash,g_int64_equal);
+  g_queue_init(&cache->lru);
+  cache->prefetcher = g_thread_pool_new(prefetch_one,cache,MAX(prefetch,1),FALSE,NULL);
+  return &cache->base;
+}
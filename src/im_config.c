@@ -8,10 +8,32 @@
  */
 #include "common.h"
 #include "im_config.h"
+#include "im_source.h"
+#include "im_dedup.h"
 #include <glib/gstdio.h>
+#include <fcntl.h>
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+#ifdef HAVE_LIBCRYPTO
+#include <openssl/crypto.h>
+#endif
+
+/* AES-256-XTS, two keys of 32 bytes */
+#define MAX_KEY_SIZE 64
 
 static im_config_t * _config = NULL;
 
+/* clear a key in a way the compiler can't drop as a dead store */
+static void wipe_key(guint8 * key, gsize size) {
+#ifdef HAVE_LIBCRYPTO
+  OPENSSL_cleanse(key,size);
+#else
+  explicit_bzero(key,size);
+#endif
+}
+
 gboolean im_init_config(GError ** error) {
   _config = g_try_new0(im_config_t,1);
   if (_config != NULL) {
@@ -24,17 +46,68 @@ const im_config_t * im_get_config() {
   return _config;
 }
 
+void im_config_wipe_key() {
+  if (_config->crypt_key != NULL) {
+    wipe_key(_config->crypt_key,_config->crypt_key_size);
+    g_free(_config->crypt_key);
+    _config->crypt_key = NULL;
+    _config->crypt_key_size = 0;
+  }
+}
+
 void im_config_print() {
   gchar * options = g_strjoinv(",",_config->options);
   g_print("dry_run: %s\n",_config->dry_run ? "yes" : "no");
   g_print("debug: %s\n",_config->debug ? "yes" : "no");
   g_print("foreground: %s\n",_config->foreground ? "yes" : "no");
   g_print("single thread: %s\n",_config->single_thread ? "yes" : "no");
+  if (_config->max_workers > 0) {
+    g_print("workers: %d to %d%s\n",_config->min_workers,_config->max_workers,
+	    _config->pin_workers ? ", pinned" : "");
+  } else if (_config->pin_workers) {
+    g_print("workers pinned\n");
+  }
   g_print("fuse mount options: %s\n",options);
   g_print("manage mount point: %s\n",_config->manage ? "yes" : "no");
+  g_print("take over: %s\n",_config->takeover ? "yes" : "no");
   g_print("base dir is %s\n",_config->base_dir);
   g_print("image path %s\n",_config->image_path);
   g_print("mountpoint %s\n",_config->mountpoint);
+  if (_config->extract_dest != NULL) {
+    g_print("extract to %s with %d threads\n",_config->extract_dest,_config->extract_threads);
+  }
+  if (_config->prescan) {
+    g_print("prescan with %d threads\n",_config->prescan_threads);
+  }
+  if (_config->image_path != NULL && im_source_is_url(_config->image_path)) {
+    g_print("cache %d MiB, prefetch %d chunks\n",
+	    _config->cache_size > 0 ? _config->cache_size : IM_CACHE_DEFAULT_SIZE / (1024 * 1024),
+	    _config->prefetch > 0 ? _config->prefetch : IM_CACHE_DEFAULT_PREFETCH);
+  }
+  if (_config->mmap) {
+    g_print("image mapped in memory\n");
+  }
+  if (_config->shm_cache_size > 0) {
+    g_print("shared cache of %d MiB\n",_config->shm_cache_size);
+  }
+  if (_config->l2cache_dir != NULL) {
+    g_print("disk cache in %s, %d MiB\n",_config->l2cache_dir,
+	    _config->l2cache_size > 0 ? _config->l2cache_size
+	    : (gint) (IM_L2CACHE_DEFAULT_SIZE / (1024 * 1024)));
+  }
+  if (_config->crypt_key != NULL) {
+    g_print("encrypted with AES-XTS, %d bit key, units of %d bytes\n",
+	    (gint) _config->crypt_key_size * 4,
+	    _config->crypt_unit > 0 ? _config->crypt_unit : IM_CRYPT_DEFAULT_UNIT);
+  }
+  if (_config->heatmap_path != NULL) {
+    g_print("heatmap written to %s and %s.sort\n",_config->heatmap_path,_config->heatmap_path);
+  }
+  if (_config->dedup_dir != NULL) {
+    g_print("dedup store in %s, %d MiB\n",_config->dedup_dir,
+	    _config->dedup_size > 0 ? _config->dedup_size
+	    : (gint) (IM_DEDUP_DEFAULT_SIZE / (1024 * 1024)));
+  }
   g_free(options);
 }
 
@@ -70,6 +143,19 @@ gboolean parse_base_dir_option(const gchar * option,
   return result;
 }
 
+gboolean parse_extract_option(const gchar * option,
+			      const gchar * value,
+			      gpointer data,
+			      GError **error) {
+  g_free(_config->extract_dest);
+  if (g_path_is_absolute(value)) {
+    _config->extract_dest = g_build_filename(value,NULL);
+  } else {
+    _config->extract_dest = g_build_filename(g_get_current_dir(),value,NULL);
+  }
+  return TRUE;
+}
+
 
 gboolean parse_arguments(const gchar * option,
 			 const gchar * value,
@@ -77,7 +163,9 @@ gboolean parse_arguments(const gchar * option,
 			 GError **error) {
   static gint idx = 0;
   gchar * path = NULL;
-  if (g_path_is_absolute(value)) {
+  if (idx == 0 && im_source_is_url(value)) {
+    path = g_strdup(value);
+  } else if (g_path_is_absolute(value)) {
     path = g_build_filename(value,NULL);
   } else {
     path = g_build_filename(g_get_current_dir(),value,NULL);
@@ -101,11 +189,154 @@ gboolean parse_arguments(const gchar * option,
 }
 
 
+static gboolean parse_count(const gchar * name, const gchar * value,
+			    gint * count, GError ** error) {
+  gchar * end = NULL;
+  guint64 n = g_ascii_strtoull(value,&end,10);
+  if (*value == '\0' || *end != '\0' || n == 0 || n > G_MAXINT) {
+    g_set_error(error,G_OPTION_ERROR,G_OPTION_ERROR_BAD_VALUE,
+		"%s needs a positive number, not '%s'",name,value);
+    return FALSE;
+  }
+  *count = n;
+  return TRUE;
+}
+
+/* read a raw key of up to MAX_KEY_SIZE bytes from a file, or fd:N */
+static gboolean read_key(const gchar * value, GError ** error) {
+  gint fd;
+  if (g_str_has_prefix(value,"fd:")) {
+    if (!parse_count("cryptkey",value + 3,&fd,error)) {
+      return FALSE;
+    }
+  } else {
+    fd = open(value,O_RDONLY | O_CLOEXEC);
+  }
+  guint8 key[MAX_KEY_SIZE + 1];
+  gsize size = 0;
+  ssize_t n = fd < 0 ? -1 : 0;
+  while (fd >= 0 && size < sizeof(key)) {
+    n = read(fd,key + size,sizeof(key) - size);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break;
+    size += n;
+  }
+  int saved = errno;
+  if (fd >= 0) close(fd);
+  if (n < 0) {
+    g_set_error(error,G_OPTION_ERROR,G_OPTION_ERROR_BAD_VALUE,
+		"can't read the key from %s: %s",value,g_strerror(saved));
+    return FALSE;
+  }
+  if (size != 32 && size != 64) {
+    g_set_error(error,G_OPTION_ERROR,G_OPTION_ERROR_BAD_VALUE,
+		"the key in %s must be 32 or 64 bytes",value);
+    wipe_key(key,sizeof(key));
+    return FALSE;
+  }
+  im_config_wipe_key();
+  _config->crypt_key = g_malloc(size);
+  memcpy(_config->crypt_key,key,size);
+  _config->crypt_key_size = size;
+  wipe_key(key,sizeof(key));
+  return TRUE;
+}
+
+/*
+ * Handle option if it's one of ours rather than fuse's. Sets *taken
+ * accordingly.
+ */
+static gboolean parse_own_option(const gchar * option, gboolean * taken,
+				 GError ** error) {
+  gchar ** parts = g_strsplit(option,"=",2);
+  const gchar * name = parts[0];
+  const gchar * value = parts[1];
+  gboolean result = TRUE;
+  *taken = TRUE;
+  if (g_strcmp0(name,"prescan") == 0) {
+    // prescan[=threads]
+    _config->prescan = TRUE;
+    _config->prescan_threads = g_get_num_processors();
+    if (value != NULL) {
+      result = parse_count(name,value,&_config->prescan_threads,error);
+    }
+  } else if (g_strcmp0(name,"cache_size") == 0 && value != NULL) {
+    // cache_size=MiB, for remote images
+    result = parse_count(name,value,&_config->cache_size,error);
+  } else if (g_strcmp0(name,"prefetch") == 0 && value != NULL) {
+    result = parse_count(name,value,&_config->prefetch,error);
+  } else if (g_strcmp0(name,"l2cache") == 0 && value != NULL) {
+    // l2cache=DIR, blocks kept on a local disk across mounts
+    g_free(_config->l2cache_dir);
+    if (g_path_is_absolute(value)) {
+      _config->l2cache_dir = g_build_filename(value,NULL);
+    } else {
+      _config->l2cache_dir = g_build_filename(g_get_current_dir(),value,NULL);
+    }
+  } else if (g_strcmp0(name,"l2size") == 0 && value != NULL) {
+    result = parse_count(name,value,&_config->l2cache_size,error);
+  } else if (g_strcmp0(name,"dedup") == 0 && value != NULL) {
+    // dedup=DIR, file contents kept once for all the images using DIR
+    g_free(_config->dedup_dir);
+    if (g_path_is_absolute(value)) {
+      _config->dedup_dir = g_build_filename(value,NULL);
+    } else {
+      _config->dedup_dir = g_build_filename(g_get_current_dir(),value,NULL);
+    }
+  } else if (g_strcmp0(name,"dedupsize") == 0 && value != NULL) {
+    result = parse_count(name,value,&_config->dedup_size,error);
+  } else if (g_strcmp0(name,"heatmap") == 0 && value != NULL) {
+    // heatmap=FILE, reads and open order written at unmount
+    g_free(_config->heatmap_path);
+    if (g_path_is_absolute(value)) {
+      _config->heatmap_path = g_build_filename(value,NULL);
+    } else {
+      _config->heatmap_path = g_build_filename(g_get_current_dir(),value,NULL);
+    }
+  } else if (g_strcmp0(name,"cryptkey") == 0 && value != NULL) {
+    // cryptkey=FILE or fd:N, the image is encrypted with AES-XTS
+    result = read_key(value,error);
+  } else if (g_strcmp0(name,"cryptunit") == 0 && value != NULL) {
+    result = parse_count(name,value,&_config->crypt_unit,error);
+  } else if (g_strcmp0(name,"workers") == 0 && value != NULL) {
+    // workers=N, or MIN-MAX for a pool growing while all are busy
+    gchar ** range = g_strsplit(value,"-",2);
+    result = parse_count(name,range[0],&_config->min_workers,error);
+    _config->max_workers = _config->min_workers;
+    if (result && range[1] != NULL) {
+      result = parse_count(name,range[1],&_config->max_workers,error);
+    }
+    if (result && _config->max_workers < _config->min_workers) {
+      g_set_error(error,G_OPTION_ERROR,G_OPTION_ERROR_BAD_VALUE,
+		  "workers=%s: the maximum is below the minimum",value);
+      result = FALSE;
+    }
+    g_strfreev(range);
+  } else if (g_strcmp0(name,"pin") == 0 && value == NULL) {
+    // each worker on a processor of its own
+    _config->pin_workers = TRUE;
+  } else if (g_strcmp0(name,"mmap") == 0 && value == NULL) {
+    // read a local image through a memory mapping
+    _config->mmap = TRUE;
+  } else if (g_strcmp0(name,"shmcache") == 0) {
+    // shmcache[=MiB], shared with other mounts of the image
+    _config->shm_cache_size = IM_SHMCACHE_DEFAULT_SIZE / (1024 * 1024);
+    if (value != NULL) {
+      result = parse_count(name,value,&_config->shm_cache_size,error);
+    }
+  } else {
+    *taken = FALSE;
+  }
+  g_strfreev(parts);
+  return result;
+}
+
 /*
  * Split mops on comas, ensuring that each element of
  * get_config()->options[] contains just one option
  * This will make easier to check if some incompatible
- * option is missing, or if a needed one is missing
+ * option is missing, or if a needed one is missing.
+ * Our own options are taken out, fuse gets only its ones.
  */
 gboolean setup_fuse_options(gchar ** mops,GError ** error) {
   if (mops == NULL) {
@@ -113,9 +344,20 @@ gboolean setup_fuse_options(gchar ** mops,GError ** error) {
     return TRUE;
   }
   gchar * joined = g_strjoinv(",",mops);
-  _config->options = g_strsplit(joined,",",-1);
+  gchar ** all = g_strsplit(joined,",",-1);
   g_free(joined);
-  return TRUE;
+  _config->options = g_new0(gchar *,g_strv_length(all) + 1);
+  gboolean result = TRUE;
+  guint kept = 0;
+  for (guint idx = 0; all[idx] != NULL && result; idx++) {
+    gboolean taken = FALSE;
+    result = parse_own_option(all[idx],&taken,error);
+    if (result && !taken && all[idx][0] != '\0') {
+      _config->options[kept++] = g_strdup(all[idx]);
+    }
+  }
+  g_strfreev(all);
+  return result;
 }
 
 #define FIELD_ADDRESS(c,f) (&((c)->f))
@@ -125,9 +367,12 @@ gboolean process_options(gint * p_argc,gchar *** p_argv, GError ** error) {
     {"base-dir",0,G_OPTION_FLAG_FILENAME,G_OPTION_ARG_CALLBACK,parse_base_dir_option,"set the directory under which dynamic mountpoints are created","dir"},
     {"debug",'d',G_OPTION_FLAG_NONE,G_OPTION_ARG_NONE,FIELD_ADDRESS(_config,debug),"do not demonize and print debug messages",NULL},
     {"dry-run",'n',G_OPTION_FLAG_NONE,G_OPTION_ARG_NONE,FIELD_ADDRESS(_config,dry_run),"just print out what the program would do and exit",NULL},
+    {"extract",'x',G_OPTION_FLAG_FILENAME,G_OPTION_ARG_CALLBACK,parse_extract_option,"copy the whole image under dest instead of mounting it","dest"},
+    {"extract-threads",0,G_OPTION_FLAG_NONE,G_OPTION_ARG_INT,FIELD_ADDRESS(_config,extract_threads),"number of writer threads used by --extract (default: one per cpu)","n"},
     {"foreground",'f',G_OPTION_FLAG_NONE,G_OPTION_ARG_NONE,FIELD_ADDRESS(_config,foreground),"do not demonize",NULL},
     {"manage",'m',G_OPTION_FLAG_NONE,G_OPTION_ARG_NONE,FIELD_ADDRESS(_config,manage),"if the mountpoit doesn't exist create it and remove at exit",NULL},
-    {"options",'o',G_OPTION_FLAG_NONE,G_OPTION_ARG_STRING_ARRAY,&mops,"mount(1) options, included fuse-related ones","mode"},
+    {"options",'o',G_OPTION_FLAG_NONE,G_OPTION_ARG_STRING_ARRAY,&mops,"mount(1) options, included fuse-related ones, prescan[=threads] to index the whole tree at mount, cache_size=MiB and prefetch=chunks for images read over HTTP, l2cache=dir and l2size=MiB to keep blocks on a local disk, shmcache[=MiB] to share them with other mounts, dedup=dir and dedupsize=MiB to keep file contents once for all images, heatmap=file to write what was read, and a mkisofs sort file, at unmount, cryptkey=file|fd:N and cryptunit=bytes to read an image encrypted as dm-crypt aes-xts-plain64, workers=n or min-max threads serving requests and pin to keep each on a processor, mmap to read a local image through a memory mapping","mode"},
+    {"takeover",0,G_OPTION_FLAG_NONE,G_OPTION_ARG_NONE,FIELD_ADDRESS(_config,takeover),"take the mount over from the isomounter process serving mountpoint, without unmounting",NULL},
     {"single-thread",'s',G_OPTION_FLAG_NONE,G_OPTION_ARG_NONE,FIELD_ADDRESS(_config,single_thread),"use single thread imlementation"},
     {"version",0,G_OPTION_FLAG_NO_ARG,G_OPTION_ARG_CALLBACK,parse_version_option,"prints the version information and exit",NULL},
     {"",0,G_OPTION_FLAG_FILENAME,G_OPTION_ARG_CALLBACK,parse_arguments,"???","iso-image [mountpoint]"},
@@ -151,6 +396,10 @@ gboolean check_mountpoint(if_status * status,GError ** error) {
     _config->mountpoint = g_build_filename(_config->base_dir,name,NULL);
     g_free(name);
   } 
+  if (_config->takeover) {
+    // it's mounted already, and stays so
+    return TRUE;
+  }
   const gchar * path = _config->mountpoint;
   if (g_file_test(path,G_FILE_TEST_IS_DIR) && (g_access(path,W_OK) == 0)) {
     if (_config->manage) {
@@ -176,12 +425,24 @@ gboolean check_mountpoint(if_status * status,GError ** error) {
 }
 
 // check only that exists and is writable. should check is a iso file?
+// a split image is fine too, if its parts are there
 gboolean check_image_file(GError ** error) {
   const gchar * path = _config->image_path; 
   gboolean result = TRUE;
+  gchar ** parts = NULL;
   if (path == NULL) {
     result = FALSE;
     g_set_error(error,IM_ERROR_DOMAIN,IM_ERROR_IMAGE,"no image specified");
+  } else if (im_source_is_url(path)) {
+    // whether it's there is known only when it's opened
+  } else if ((parts = im_split_parts(path)) != NULL) {
+    for (guint idx = 0; parts[idx] != NULL && result; idx++) {
+      if (g_access(parts[idx],R_OK) != 0) {
+	result = FALSE;
+	g_set_error(error,IM_ERROR_DOMAIN,IM_ERROR_IMAGE,"image part %s isn't accessible",parts[idx]);
+      }
+    }
+    g_strfreev(parts);
   } else if (! g_file_test(path,G_FILE_TEST_IS_REGULAR) || (g_access(path,R_OK))) {
     result = FALSE;
     g_set_error(error,IM_ERROR_DOMAIN,IM_ERROR_IMAGE,"image file isn't accessible");
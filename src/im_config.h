@@ -11,6 +11,12 @@
 #include "common.h"
 #include "if_utils.h"
 
+/* errors of isomounter itself, in the domain of the library ones */
+typedef enum {
+  IM_ERROR_MOUNTPOINT_EXISTS = IM_ERROR_CLIENT,
+  IM_ERROR_MOUNTPOINT_ACCESS,
+  IM_ERROR_TAKEOVER,
+} im_client_error;
 
 typedef struct im_config_s {
   gboolean debug;
@@ -19,14 +25,37 @@ typedef struct im_config_s {
   gchar ** options;
   gboolean manage;
   gboolean dry_run;
+  gboolean takeover;
   gchar  * base_dir;
   gchar  * image_path;
   gchar  * mountpoint;
+  gchar  * extract_dest;
+  gint     extract_threads;
+  // from -o, see setup_fuse_options()
+  gboolean prescan;
+  gint     prescan_threads;
+  gint     cache_size; // MiB, 0 for the default
+  gint     prefetch;
+  gchar  * l2cache_dir;
+  gint     l2cache_size; // MiB, 0 for the default
+  gint     shm_cache_size; // MiB, 0 for none
+  gchar  * dedup_dir;
+  gint     dedup_size; // MiB, 0 for the default
+  gchar  * heatmap_path;
+  gint     min_workers; // 0 for the default
+  gint     max_workers;
+  gboolean pin_workers;
+  guint8 * crypt_key;
+  gsize    crypt_key_size;
+  gint     crypt_unit; // bytes, 0 for the default
+  gboolean mmap;
 } im_config_t;
 
 const im_config_t * im_get_config();
 void im_config_print();
 gboolean im_init_config(GError **error);
+/* clear and free the image key, once nothing reads the image any more */
+void im_config_wipe_key();
 gboolean process_options(gint * p_argc,gchar *** p_argv, GError ** error);
 
 /**
@@ -0,0 +1,184 @@
+/* im_crypt.c - images encrypted at rest
+ *
+ * Copyright (C) 2016 Leo Cacciari <leo.cacciari@gmail.com>
+ *
+ * This file belongs to the isomounter project.
+ * isomounter is free software and is distributed under the terms of the
+ * GNU GPL. See the file COPYING for details.
+ */
+#include "common.h"
+#include "im_source.h"
+
+#ifdef HAVE_LIBCRYPTO
+#include <openssl/evp.h>
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+/* the IV counts sectors of this size, whatever the data unit */
+#define IV_SECTOR 512
+
+/*
+ * AES-XTS with the plain64 IV, as dm-crypt in plain mode: an image
+ * written through "cryptsetup open --type plain --cipher
+ * aes-xts-plain64" reads back here with the same key. Each data unit
+ * is decrypted on its own, so any of them can be read without the
+ * others; libcrypto picks the AES-NI or VAES code when the processor
+ * has it.
+ *
+ * Contexts are set up with the key once, and reused by whichever
+ * thread reads next: only the IV changes from one unit to the next.
+ */
+typedef struct crypt_source_s {
+  im_source base;
+  im_source * inner;
+  const EVP_CIPHER * cipher;
+  guint8 key[64];
+  guint unit;
+  GMutex lock;     // for idle
+  GSList * idle;   // contexts not in use
+} crypt_source;
+
+static EVP_CIPHER_CTX * ctx_get(crypt_source * c) {
+  g_mutex_lock(&c->lock);
+  EVP_CIPHER_CTX * ctx = NULL;
+  if (c->idle != NULL) {
+    ctx = c->idle->data;
+    c->idle = g_slist_delete_link(c->idle,c->idle);
+  }
+  g_mutex_unlock(&c->lock);
+  if (ctx == NULL) {
+    ctx = EVP_CIPHER_CTX_new();
+    if (ctx != NULL && EVP_DecryptInit_ex(ctx,c->cipher,NULL,c->key,NULL) != 1) {
+      EVP_CIPHER_CTX_free(ctx);
+      ctx = NULL;
+    }
+  }
+  return ctx;
+}
+
+static void ctx_put(crypt_source * c, EVP_CIPHER_CTX * ctx) {
+  g_mutex_lock(&c->lock);
+  c->idle = g_slist_prepend(c->idle,ctx);
+  g_mutex_unlock(&c->lock);
+}
+
+/* decrypt size bytes at offset in place, whole units */
+static int decrypt(crypt_source * c, guint8 * data, gsize size, guint64 offset) {
+  EVP_CIPHER_CTX * ctx = ctx_get(c);
+  if (ctx == NULL) {
+    return -ENOMEM;
+  }
+  int result = 0;
+  for (gsize done = 0; done < size && result == 0; done += c->unit) {
+    guint8 iv[16] = { 0 };
+    guint64 sector = (offset + done) / IV_SECTOR;
+    for (guint idx = 0; idx < 8; idx++) {
+      iv[idx] = sector >> (8 * idx);
+    }
+    int len;
+    if (EVP_DecryptInit_ex(ctx,NULL,NULL,NULL,iv) != 1 ||
+	EVP_DecryptUpdate(ctx,data + done,&len,data + done,c->unit) != 1) {
+      result = -EIO;
+    }
+  }
+  ctx_put(c,ctx);
+  return result;
+}
+
+static gssize crypt_pread(im_source * source, gpointer buf, gsize size,
+			  guint64 offset) {
+  crypt_source * c = (crypt_source *) source;
+  if (offset >= source->size) {
+    return 0;
+  }
+  size = MIN(size,source->size - offset);
+  guint64 start = offset - offset % c->unit;
+  guint64 end = (offset + size + c->unit - 1) / c->unit * c->unit;
+  // whole units go straight into buf, the others through a copy
+  gboolean aligned = start == offset && end == offset + size;
+  guint8 * data = aligned ? buf : g_malloc(end - start);
+  int result = im_source_read(c->inner,data,end - start,start);
+  if (result == 0) {
+    result = decrypt(c,data,end - start,start);
+  }
+  if (!aligned) {
+    if (result == 0) {
+      memcpy(buf,data + (offset - start),size);
+    }
+    g_free(data);
+  }
+  return result == 0 ? (gssize) size : result;
+}
+
+static int crypt_advise(im_source * source, guint64 offset, guint64 size,
+			im_advice advice) {
+  return im_source_advise(((crypt_source *) source)->inner,offset,size,advice);
+}
+
+static void crypt_close(im_source * source) {
+  crypt_source * c = (crypt_source *) source;
+  g_slist_free_full(c->idle,(GDestroyNotify) EVP_CIPHER_CTX_free);
+  g_mutex_clear(&c->lock);
+  OPENSSL_cleanse(c->key,sizeof(c->key));
+  im_source_close(c->inner);
+}
+
+static const im_source_ops crypt_ops = {
+  .pread = crypt_pread,
+  .advise = crypt_advise,
+  .close = crypt_close,
+};
+
+im_source * im_crypt_source_new(im_source * inner, const guint8 * key, gsize key_size,
+				guint unit, GError ** error) {
+  const EVP_CIPHER * cipher = key_size == 32 ? EVP_aes_128_xts() :
+    key_size == 64 ? EVP_aes_256_xts() : NULL;
+  if (cipher == NULL) {
+    g_set_error(error,IM_ERROR_DOMAIN,IM_ERROR_IMAGE,
+		"the key for %s has %" G_GSIZE_FORMAT " bytes, not 32 or 64",
+		inner->name,key_size);
+    return NULL;
+  }
+  if (unit < IV_SECTOR || unit > 4096 || (unit & (unit - 1)) != 0 ||
+      inner->size % unit != 0) {
+    g_set_error(error,IM_ERROR_DOMAIN,IM_ERROR_IMAGE,
+		"%s isn't made of encrypted sectors of %u bytes",inner->name,unit);
+    return NULL;
+  }
+  crypt_source * c = g_new0(crypt_source,1);
+  c->base.ops = &crypt_ops;
+  c->base.name = g_strdup(inner->name);
+  c->base.size = inner->size;
+  c->base.version = g_strdup(inner->version);
+  // what is in the file isn't the image
+  c->base.fd = -1;
+  c->inner = inner;
+  c->cipher = cipher;
+  memcpy(c->key,key,key_size);
+  c->unit = unit;
+  g_mutex_init(&c->lock);
+  // a key libcrypto refuses (the two halves equal) fails here
+  EVP_CIPHER_CTX * ctx = ctx_get(c);
+  if (ctx == NULL) {
+    g_set_error(error,IM_ERROR_DOMAIN,IM_ERROR_IMAGE,
+		"the key for %s can't be used",inner->name);
+    c->inner = NULL;
+    im_source_close(&c->base);
+    return NULL;
+  }
+  ctx_put(c,ctx);
+  return &c->base;
+}
+
+#else /* HAVE_LIBCRYPTO */
+
+im_source * im_crypt_source_new(im_source * inner, const guint8 * key, gsize key_size,
+				guint unit, GError ** error) {
+  g_set_error(error,IM_ERROR_DOMAIN,IM_ERROR_IMAGE,
+	      "can't read %s: built without encryption support",inner->name);
+  return NULL;
+}
+
+#endif /* HAVE_LIBCRYPTO */
@@ -0,0 +1,361 @@
+/* im_dedup.c - file contents kept once, whatever image they are in
+ *
+ * Copyright (C) 2016 Leo Cacciari <leo.cacciari@gmail.com>
+ *
+ * This file belongs to the isomounter project.
+ * isomounter is free software and is distributed under the terms of the
+ * GNU GPL. See the file COPYING for details.
+ */
+#include "common.h"
+#include "im_dedup.h"
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <glib/gstdio.h>
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+/* chunks waiting to be written; past this, misses aren't kept */
+#define DEDUP_MAX_PENDING 64
+#define DEDUP_TMP_PREFIX ".tmp-"
+/* in seconds: younger temporaries and unlinked objects may be another mount's writes */
+#define DEDUP_GRACE 3600
+#define DEDUP_OBJECTS "objects"
+
+/*
+ * As in the disk cache, writes are done by a thread of their own and
+ * a chunk linked in the image directory is always whole: objects are
+ * written to a temporary file, synced, and linked in place.
+ *
+ * Evicting a chunk unlinks it from the image directory, and the
+ * object too once no image links it. Objects left unlinked by other
+ * processes, or by a crash, are removed at the next open.
+ */
+typedef struct dedup_chunk_s {
+  guint64 offset;
+  gsize size;
+  gchar * object; // name under objects/, NULL if not known
+  GList link; // in the LRU list
+} dedup_chunk;
+
+typedef struct dedup_write_s {
+  guint64 offset;
+  gsize size;
+  guint8 * data;
+} dedup_write;
+
+struct im_dedup_s {
+  gchar * objects;
+  gchar * dir;         // of the image
+  guint64 capacity;
+  GMutex lock;         // for all the fields below
+  guint64 used;
+  GHashTable * chunks; // offset -> dedup_chunk
+  GHashTable * pending; // offsets being written
+  GQueue lru;          // most recent first
+  GThreadPool * writer;
+};
+
+static gchar * chunk_path(im_dedup * dedup, guint64 offset) {
+  gchar name[24];
+  g_snprintf(name,sizeof(name),"%016" G_GINT64_MODIFIER "x",offset);
+  return g_build_filename(dedup->dir,name,NULL);
+}
+
+static void chunk_free(gpointer data) {
+  dedup_chunk * c = (dedup_chunk *) data;
+  g_free(c->object);
+  g_free(c);
+}
+
+/* called with the lock held; takes object */
+static void chunk_add(im_dedup * dedup, guint64 offset, gsize size, gchar * object) {
+  dedup_chunk * c = g_new0(dedup_chunk,1);
+  c->offset = offset;
+  c->size = size;
+  c->object = object;
+  c->link.data = c;
+  g_hash_table_insert(dedup->chunks,&c->offset,c);
+  g_queue_push_head_link(&dedup->lru,&c->link);
+  dedup->used += size;
+}
+
+/* called with the lock held */
+static void chunk_forget(im_dedup * dedup, dedup_chunk * c, gboolean unlink) {
+  if (unlink) {
+    gchar * path = chunk_path(dedup,c->offset);
+    g_unlink(path);
+    g_free(path);
+    if (c->object != NULL) {
+      // the last link is the object itself
+      path = g_build_filename(dedup->objects,c->object,NULL);
+      struct stat st;
+      if (g_stat(path,&st) == 0 && st.st_nlink == 1) {
+	g_unlink(path);
+      }
+      g_free(path);
+    }
+  }
+  g_queue_unlink(&dedup->lru,&c->link);
+  dedup->used -= c->size;
+  g_hash_table_remove(dedup->chunks,&c->offset);
+}
+
+/* make room for size more bytes; called with the lock held */
+static void evict(im_dedup * dedup, gsize size) {
+  while (dedup->used + size > dedup->capacity && dedup->lru.tail != NULL) {
+    chunk_forget(dedup,(dedup_chunk *) dedup->lru.tail->data,TRUE);
+  }
+}
+
+static gboolean write_all(int fd, const guint8 * data, gsize size) {
+  while (size > 0) {
+    ssize_t n = write(fd,data,size);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return FALSE;
+    data += n;
+    size -= n;
+  }
+  return TRUE;
+}
+
+/*
+ * Link the object of w's contents as path, writing it if it's new;
+ * the object name goes in *hash.
+ */
+static gboolean store(im_dedup * dedup, dedup_write * w, const gchar * path, gchar ** hash) {
+  *hash = g_compute_checksum_for_data(G_CHECKSUM_SHA256,w->data,w->size);
+  gchar * object = g_build_filename(dedup->objects,*hash,NULL);
+  gboolean ok = link(object,path) == 0 || errno == EEXIST;
+  if (!ok && errno == ENOENT) {
+    gchar * tmp = g_build_filename(dedup->objects,DEDUP_TMP_PREFIX "XXXXXX",NULL);
+    int fd = g_mkstemp(tmp);
+    if (fd >= 0) {
+      ok = write_all(fd,w->data,w->size) && fdatasync(fd) == 0;
+      ok = close(fd) == 0 && ok;
+      // someone else may have stored the same contents meanwhile
+      ok = ok && (link(tmp,object) == 0 || errno == EEXIST);
+      ok = ok && (link(object,path) == 0 || errno == EEXIST);
+      g_unlink(tmp);
+    }
+    g_free(tmp);
+  }
+  g_free(object);
+  return ok;
+}
+
+/* the writer thread: store one chunk */
+static void write_chunk(gpointer data, gpointer user_data) {
+  im_dedup * dedup = (im_dedup *) user_data;
+  dedup_write * w = (dedup_write *) data;
+  gchar * path = chunk_path(dedup,w->offset);
+  g_mutex_lock(&dedup->lock);
+  evict(dedup,w->size);
+  g_mutex_unlock(&dedup->lock);
+  gchar * hash;
+  gboolean ok = store(dedup,w,path,&hash);
+  int saved = errno;
+  g_mutex_lock(&dedup->lock);
+  if (ok && g_hash_table_lookup(dedup->chunks,&w->offset) == NULL) {
+    chunk_add(dedup,w->offset,w->size,hash);
+    hash = NULL;
+  }
+  g_hash_table_remove(dedup->pending,&w->offset);
+  g_mutex_unlock(&dedup->lock);
+  if (!ok) {
+    g_debug("dedup: chunk at %" G_GUINT64_FORMAT " not kept: %s",w->offset,g_strerror(saved));
+  }
+  g_free(hash);
+  g_free(path);
+  g_free(w->data);
+  g_free(w);
+}
+
+void im_dedup_admit(im_dedup * dedup, guint64 offset, guint8 * data, gsize size) {
+  dedup_write * w = g_new(dedup_write,1);
+  w->offset = offset;
+  w->size = size;
+  w->data = data;
+  g_mutex_lock(&dedup->lock);
+  gboolean take = size <= dedup->capacity &&
+    g_hash_table_size(dedup->pending) < DEDUP_MAX_PENDING &&
+    !g_hash_table_contains(dedup->pending,&offset);
+  if (take) {
+    g_hash_table_add(dedup->pending,&w->offset);
+  }
+  g_mutex_unlock(&dedup->lock);
+  if (take) {
+    g_thread_pool_push(dedup->writer,w,NULL);
+  } else {
+    g_free(data);
+    g_free(w);
+  }
+}
+
+gssize im_dedup_read(im_dedup * dedup, guint64 offset, gsize chunk_size,
+		     gpointer buf, gsize size, gsize skip) {
+  g_mutex_lock(&dedup->lock);
+  dedup_chunk * c = g_hash_table_lookup(dedup->chunks,&offset);
+  if (c != NULL && c->size == chunk_size) {
+    g_queue_unlink(&dedup->lru,&c->link);
+    g_queue_push_head_link(&dedup->lru,&c->link);
+  } else {
+    c = NULL;
+  }
+  g_mutex_unlock(&dedup->lock);
+  if (c == NULL) {
+    return -ENOENT;
+  }
+  gchar * path = chunk_path(dedup,offset);
+  int fd = open(path,O_RDONLY | O_CLOEXEC);
+  g_free(path);
+  ssize_t n = -1;
+  if (fd >= 0) {
+    do {
+      n = pread(fd,buf,size,skip);
+    } while (n < 0 && errno == EINTR);
+    close(fd);
+  }
+  if (n != (ssize_t) size) {
+    // gone, or cut short: forget it, the image has the data
+    g_mutex_lock(&dedup->lock);
+    c = g_hash_table_lookup(dedup->chunks,&offset);
+    if (c != NULL) {
+      chunk_forget(dedup,c,fd >= 0);
+    }
+    g_mutex_unlock(&dedup->lock);
+    return -ENOENT;
+  }
+  return n;
+}
+
+/*
+ * Remove the objects no image links, and temporaries left behind;
+ * returns the names of the others by inode.
+ */
+static GHashTable * sweep_objects(im_dedup * dedup) {
+  GHashTable * names = g_hash_table_new_full(g_int64_hash,g_int64_equal,g_free,g_free);
+  GDir * dir = g_dir_open(dedup->objects,0,NULL);
+  if (dir == NULL) {
+    return names;
+  }
+  const gchar * name;
+  guint removed = 0;
+  gint64 now = g_get_real_time() / G_USEC_PER_SEC;
+  while ((name = g_dir_read_name(dir)) != NULL) {
+    gchar * path = g_build_filename(dedup->objects,name,NULL);
+    struct stat st;
+    if (g_stat(path,&st) != 0) {
+      g_free(path);
+      continue;
+    }
+    if (g_str_has_prefix(name,DEDUP_TMP_PREFIX) || st.st_nlink == 1) {
+      // unless another mount is still writing or linking it: both
+      // change st_ctime
+      if (now - st.st_ctime > DEDUP_GRACE) {
+	g_unlink(path);
+	removed++;
+      }
+    } else {
+      gint64 * ino = g_new(gint64,1);
+      *ino = st.st_ino;
+      g_hash_table_insert(names,ino,g_strdup(name));
+    }
+    g_free(path);
+  }
+  g_dir_close(dir);
+  if (removed > 0) {
+    g_debug("dedup: %u objects removed from %s",removed,dedup->objects);
+  }
+  return names;
+}
+
+typedef struct dedup_found_s {
+  guint64 offset;
+  gsize size;
+  gint64 mtime;
+  gint64 ino;
+} dedup_found;
+
+static gint by_mtime(gconstpointer a, gconstpointer b) {
+  gint64 ma = ((const dedup_found *) a)->mtime, mb = ((const dedup_found *) b)->mtime;
+  return ma < mb ? -1 : ma > mb;
+}
+
+/*
+ * Pick up the chunks linked by earlier mounts, oldest first in the
+ * LRU; objects maps their inodes to the object names.
+ */
+static void load_chunks(im_dedup * dedup, GHashTable * objects) {
+  GDir * dir = g_dir_open(dedup->dir,0,NULL);
+  if (dir == NULL) {
+    return;
+  }
+  GArray * found = g_array_new(FALSE,FALSE,sizeof(dedup_found));
+  const gchar * name;
+  while ((name = g_dir_read_name(dir)) != NULL) {
+    gchar * path = g_build_filename(dedup->dir,name,NULL);
+    gchar * end = NULL;
+    guint64 offset = g_ascii_strtoull(name,&end,16);
+    struct stat st;
+    if (end != name && *end == '\0' && g_stat(path,&st) == 0 &&
+	S_ISREG(st.st_mode) && st.st_size > 0 && st.st_size <= IM_DEDUP_CHUNK_SIZE) {
+      dedup_found f = { offset, st.st_size, st.st_mtime, st.st_ino };
+      g_array_append_val(found,f);
+    } else {
+      g_unlink(path);
+    }
+    g_free(path);
+  }
+  g_dir_close(dir);
+  g_array_sort(found,by_mtime);
+  for (guint idx = 0; idx < found->len; idx++) {
+    dedup_found * f = &g_array_index(found,dedup_found,idx);
+    chunk_add(dedup,f->offset,f->size,g_strdup(g_hash_table_lookup(objects,&f->ino)));
+  }
+  evict(dedup,0);
+  g_debug("dedup %s: %u chunks, %" G_GUINT64_FORMAT " KiB",
+	  dedup->dir,g_hash_table_size(dedup->chunks),dedup->used / 1024);
+  g_array_free(found,TRUE);
+}
+
+im_dedup * im_dedup_new(const gchar * dir, const gchar * identity,
+			guint64 size, GError ** error) {
+  gchar * objects = g_build_filename(dir,DEDUP_OBJECTS,NULL);
+  gchar * path = g_build_filename(dir,identity,NULL);
+  if (g_mkdir_with_parents(objects,0700) != 0 || g_mkdir_with_parents(path,0700) != 0) {
+    g_set_error(error,IM_ERROR_DOMAIN,IM_ERROR_IMAGE,
+		"can't create dedup directory under %s: %s",dir,g_strerror(errno));
+    g_free(objects);
+    g_free(path);
+    return NULL;
+  }
+  im_dedup * dedup = g_new0(im_dedup,1);
+  dedup->objects = objects;
+  dedup->dir = path;
+  dedup->capacity = size;
+  g_mutex_init(&dedup->lock);
+  dedup->chunks = g_hash_table_new_full(g_int64_hash,g_int64_equal,NULL,chunk_free);
+  dedup->pending = g_hash_table_new(g_int64_hash,g_int64_equal);
+  g_queue_init(&dedup->lru);
+  GHashTable * names = sweep_objects(dedup);
+  load_chunks(dedup,names);
+  g_hash_table_destroy(names);
+  dedup->writer = g_thread_pool_new(write_chunk,dedup,1,FALSE,NULL);
+  return dedup;
+}
+
+void im_dedup_free(im_dedup * dedup) {
+  if (dedup == NULL) {
+    return;
+  }
+  // let the chunks on their way get there
+  g_thread_pool_free(dedup->writer,FALSE,TRUE);
+  g_hash_table_destroy(dedup->chunks);
+  g_hash_table_destroy(dedup->pending);
+  g_mutex_clear(&dedup->lock);
+  g_free(dedup->objects);
+  g_free(dedup->dir);
+  g_free(dedup);
+}
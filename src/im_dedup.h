@@ -0,0 +1,53 @@
+/* im_dedup.h - file contents kept once, whatever image they are in
+ *
+ * Copyright (C) 2016 Leo Cacciari <leo.cacciari@gmail.com>
+ *
+ * This file belongs to the isomounter project.
+ * isomounter is free software and is distributed under the terms of the
+ * GNU GPL. See the file COPYING for details.
+ */
+#ifndef __IM_DEDUP_H__
+#define __IM_DEDUP_H__
+#include "common.h"
+
+/* files are kept in chunks of this size, counted from their start */
+#define IM_DEDUP_CHUNK_SIZE (256 * 1024)
+#define IM_DEDUP_DEFAULT_SIZE (G_GUINT64_CONSTANT(1024) * 1024 * 1024)
+
+/**
+ * A store of file chunks on a local disk, shared by all the images
+ * using the same directory. Each chunk is a file under objects/,
+ * named after the SHA-256 of its contents, so that the same contents
+ * are there once, on disk and in the page cache, however many images
+ * or paths have them. Each image has a directory of its own,
+ * named after its identity, with a hard link to the object of each
+ * chunk it has read, named after where the chunk is in the image.
+ *
+ * The first read of a chunk by an image still goes to the image;
+ * from then on that image, in this mount or the next ones, reads it
+ * from the object.
+ */
+typedef struct im_dedup_s im_dedup;
+
+/**
+ * Open the store under dir for the image with identity, keeping up to
+ * size bytes of its chunks linked.
+ */
+im_dedup * im_dedup_new(const gchar * dir, const gchar * identity,
+			guint64 size, GError ** error);
+void im_dedup_free(im_dedup * dedup);
+
+/**
+ * Read size bytes from skip of the chunk of chunk_size bytes at
+ * offset in the image. Returns -ENOENT if it isn't kept.
+ */
+gssize im_dedup_read(im_dedup * dedup, guint64 offset, gsize chunk_size,
+		     gpointer buf, gsize size, gsize skip);
+
+/**
+ * Keep the chunk of size bytes at offset, read from the image; the
+ * store takes data, and may drop it.
+ */
+void im_dedup_admit(im_dedup * dedup, guint64 offset, guint8 * data, gsize size);
+
+#endif /*__IM_DEDUP_H__*/
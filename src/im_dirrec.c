@@ -0,0 +1,441 @@
+/* im_dirrec.c - decoding of ISO9660 directory records
+ *
+ * Copyright (C) 2016 Leo Cacciari <leo.cacciari@gmail.com>
+ *
+ * This file belongs to the isomounter project.
+ * isomounter is free software and is distributed under the terms of the
+ * GNU GPL. See the file COPYING for details.
+ */
+#include "common.h"
+#include "im_dirrec.h"
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+/* directories up to this size are read in a per thread buffer */
+#define SCRATCH_SIZE (256 * 1024)
+
+static GPrivate scratch_key = G_PRIVATE_INIT(g_free);
+
+/* System Use entries (IEEE P1281) and the Rock Ridge ones (P1282) */
+#define SU_LEN 2
+#define SU_MIN_LENGTH 4
+#define NM_FLAGS 4
+#define NM_NAME 5
+#define NM_CURRENT 0x02
+#define NM_PARENT 0x04
+#define CE_EXTENT 4  // both-endian 32 bits, as in directory records
+#define CE_OFFSET 12
+#define CE_SIZE 20
+#define CE_LENGTH 28
+/* continuation areas followed for a record, against loops */
+#define CE_MAX 8
+
+static guint32 read_le32(const guint8 * p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((guint32) p[3] << 24);
+}
+
+gsize im_name_translate(const gchar * name, gsize len, gchar * dest) {
+  gsize idx;
+  for (idx = 0; idx < len; idx++) {
+    gchar c = name[idx];
+    if (c == '\0') break;
+    // drop trailing ".;1" and ";1"
+    if (c == '.' && idx + 3 == len && name[idx + 1] == ';' && name[idx + 2] == '1') break;
+    if (c == ';' && idx + 2 == len && name[idx + 1] == '1') break;
+    if (c == ';') c = '.';
+    dest[idx] = g_ascii_tolower(c);
+  }
+  dest[idx] = '\0';
+  return idx;
+}
+
+gsize im_path_next(const gchar ** path) {
+  const gchar * end = *path;
+  while (*end != '\0' && *end != '/') end++;
+  gsize len = end - *path;
+  while (*end == '/') end++;
+  *path = end;
+  return len;
+}
+
+guint32 im_name_hash(guint32 seed, const gchar * name, gsize len) {
+  guint32 hash = 2166136261u ^ seed;
+  for (gsize idx = 0; idx < len; idx++) {
+    hash ^= (guint8) name[idx];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+/*
+ * Records never span sectors: a zero length byte means the rest of
+ * the sector is padding, so we jump to the next sector instead of
+ * scanning the padding. Returns the position of the next record or
+ * size if there's none.
+ */
+static gsize skip_padding(const guint8 * data, gsize size, gsize pos) {
+  while (pos < size && data[pos] == 0) {
+    pos = (pos / IM_SECTOR_SIZE + 1) * IM_SECTOR_SIZE;
+  }
+  return MIN(pos,size);
+}
+
+/* check that the record at pos fits where it is */
+static gboolean record_ok(const guint8 * data, gsize size, gsize pos) {
+  const guint8 * rec = data + pos;
+  gsize sector_end = MIN((pos / IM_SECTOR_SIZE + 1) * IM_SECTOR_SIZE,size);
+  return rec[DR_LENGTH] >= DR_MIN_LENGTH &&
+    pos + rec[DR_LENGTH] <= sector_end &&
+    DR_NAME + rec[DR_NAME_LEN] <= rec[DR_LENGTH];
+}
+
+/* a file in several extents has a record for each, one after the
+ * other, all flagged but the last: does rec go on with prev's file? */
+static gboolean continues(const guint8 * prev, const guint8 * rec) {
+  return prev != NULL && (prev[DR_FLAGS] & DR_FLAG_MULTI_EXTENT) != 0 &&
+    prev[DR_NAME_LEN] == rec[DR_NAME_LEN] &&
+    memcmp(prev + DR_NAME,rec + DR_NAME,rec[DR_NAME_LEN]) == 0;
+}
+
+/* the record after the one at pos, if it is of the same file; size if not */
+static gsize next_extent(const guint8 * data, gsize size, gsize pos) {
+  gsize next = skip_padding(data,size,pos + data[pos]);
+  return next < size && record_ok(data,size,next) &&
+    continues(data + pos,data + next) ? next : size;
+}
+
+/* where the System Use area of rec starts: the name is padded to even */
+static gsize su_start(const guint8 * rec) {
+  return DR_NAME + rec[DR_NAME_LEN] + !(rec[DR_NAME_LEN] & 1);
+}
+
+static gboolean su_is(const guint8 * entry, const gchar * sig) {
+  return entry[0] == sig[0] && entry[1] == sig[1];
+}
+
+/*
+ * The NM entries of rec, one after the other, into name; they may go
+ * on in continuation areas. Returns FALSE if there are none.
+ */
+static gboolean rr_name(im_source * source, const guint8 * rec, gchar * name, gsize * len) {
+  gsize start = su_start(rec);
+  const guint8 * area = rec + start;
+  gsize size = rec[DR_LENGTH] > start ? rec[DR_LENGTH] - start : 0;
+  guint8 * continuation = NULL;
+  gboolean found = FALSE;
+  *len = 0;
+  for (guint hops = 0;; hops++) {
+    guint64 ce_offset = 0;
+    gsize ce_size = 0;
+    for (gsize pos = 0; pos + SU_MIN_LENGTH <= size;) {
+      const guint8 * entry = area + pos;
+      gsize length = entry[SU_LEN];
+      if (length < SU_MIN_LENGTH || pos + length > size || su_is(entry,"ST")) {
+	break;
+      }
+      if (su_is(entry,"NM") && length >= NM_NAME &&
+	  !(entry[NM_FLAGS] & (NM_CURRENT | NM_PARENT))) {
+	gsize n = MIN(length - NM_NAME,IM_NAME_MAX - *len);
+	memcpy(name + *len,entry + NM_NAME,n);
+	*len += n;
+	found = TRUE;
+      } else if (su_is(entry,"CE") && length >= CE_LENGTH) {
+	ce_offset = (guint64) read_le32(entry + CE_EXTENT) * IM_SECTOR_SIZE +
+	  read_le32(entry + CE_OFFSET);
+	ce_size = read_le32(entry + CE_SIZE);
+      }
+      pos += length;
+    }
+    if (ce_size == 0 || ce_size > IM_SECTOR_SIZE || source == NULL || hops == CE_MAX) {
+      break;
+    }
+    continuation = g_realloc(continuation,ce_size);
+    if (im_source_read(source,continuation,ce_size,ce_offset) != 0) {
+      break;
+    }
+    area = continuation;
+    size = ce_size;
+  }
+  g_free(continuation);
+  name[*len] = '\0';
+  return found && *len > 0;
+}
+
+gsize im_dirrec_name(im_source * source, const guint8 * rec, gchar * dest) {
+  gsize len;
+  if (rr_name(source,rec,dest,&len)) {
+    return len;
+  }
+  return im_name_translate((const gchar *) rec + DR_NAME,rec[DR_NAME_LEN],dest);
+}
+
+/* "." and ".." are stored as the single bytes 0 and 1 */
+static gboolean is_self_or_parent(const guint8 * rec) {
+  return rec[DR_NAME_LEN] == 1 && rec[DR_NAME] <= 1;
+}
+
+/* days from 1970-01-01 to year-month-day of the proleptic gregorian calendar */
+static gint64 days_from_civil(gint64 year, guint month, guint day) {
+  year -= month <= 2;
+  gint64 era = (year >= 0 ? year : year - 399) / 400;
+  guint year_of_era = year - era * 400;
+  guint day_of_year = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+  guint day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+  return era * 146097 + day_of_era - 719468;
+}
+
+time_t im_dtime_decode(const guint8 * date) {
+  // years since 1900, month, day, hour, minute, second, offset
+  // from GMT in 15 minutes units
+  guint month = date[1], day = date[2];
+  if (month < 1 || month > 12 || day < 1 || day > 31) {
+    return 0;
+  }
+  gint64 seconds = days_from_civil(1900 + date[0],month,day) * 86400 +
+    date[3] * 3600 + date[4] * 60 + date[5];
+  return seconds - (gint8) date[6] * 15 * 60;
+}
+
+void im_dirrec_decode(const guint8 * rec, im_entry * entry) {
+  entry->offset = (guint64) read_le32(rec + DR_EXTENT) * IM_SECTOR_SIZE;
+  entry->size = read_le32(rec + DR_SIZE);
+  entry->mtime = im_dtime_decode(rec + DR_DATE);
+  entry->is_dir = (rec[DR_FLAGS] & DR_FLAG_DIR) != 0;
+  entry->fragmented = FALSE;
+}
+
+/* add the extent of rec to the file in entry, whose last one ends at *end */
+static void add_extent(im_entry * entry, const guint8 * rec, guint64 * end) {
+  im_entry part;
+  im_dirrec_decode(rec,&part);
+  // extents one after the other read as one
+  if (part.offset != *end || entry->size % IM_SECTOR_SIZE != 0) {
+    entry->fragmented = TRUE;
+  }
+  entry->size += part.size;
+  *end = part.offset + part.size;
+}
+
+im_dirlist * im_dirlist_decode(im_source * source, const guint8 * data, gsize size) {
+  gchar buf[IM_NAME_MAX + 1];
+  // first pass: validate and collect the names, read once as they may
+  // take reads of continuation areas
+  guint n_entries = 0;
+  GString * names = g_string_new(NULL);
+  GByteArray * lens = g_byte_array_new(); // at most IM_NAME_MAX
+  const guint8 * prev = NULL;
+  for (gsize pos = skip_padding(data,size,0); pos < size;
+       pos = skip_padding(data,size,pos + data[pos])) {
+    if (!record_ok(data,size,pos)) {
+      g_string_free(names,TRUE);
+      g_byte_array_free(lens,TRUE);
+      return NULL;
+    }
+    gboolean more = continues(prev,data + pos);
+    prev = data + pos;
+    if (!is_self_or_parent(data + pos) && !more) {
+      n_entries++;
+      gsize len = im_dirrec_name(source,data + pos,buf);
+      g_string_append_len(names,buf,len + 1);
+      guint8 byte = len;
+      g_byte_array_append(lens,&byte,1);
+    }
+  }
+  guint32 n_buckets = 1;
+  while (n_buckets < 2 * n_entries) n_buckets <<= 1;
+  gsize list_size = sizeof(im_dirlist) + n_entries * sizeof(im_dirent) +
+    n_buckets * sizeof(guint32) + names->len;
+  im_dirlist * list = g_malloc(list_size);
+  list->size = list_size;
+  list->n_entries = n_entries;
+  list->mask = n_buckets - 1;
+  list->buckets = (guint32 *) &list->entries[n_entries];
+  list->names = (gchar *) &list->buckets[n_buckets];
+  memset(list->buckets,0,n_buckets * sizeof(guint32));
+  memcpy(list->names,names->str,names->len);
+  g_string_free(names,TRUE);
+  // second pass: decode
+  im_dirent * dirent = list->entries;
+  gsize name = 0;
+  guint64 end = 0;
+  prev = NULL;
+  for (gsize pos = skip_padding(data,size,0); pos < size;
+       pos = skip_padding(data,size,pos + data[pos])) {
+    const guint8 * rec = data + pos;
+    gboolean more = continues(prev,rec);
+    prev = rec;
+    if (is_self_or_parent(rec)) {
+      continue;
+    }
+    if (more) {
+      // the previous record, of the same name, made an entry
+      add_extent(&dirent[-1].entry,rec,&end);
+      continue;
+    }
+    im_dirrec_decode(rec,&dirent->entry);
+    end = dirent->entry.offset + dirent->entry.size;
+    dirent->name = name;
+    gsize len = lens->data[dirent - list->entries];
+    guint32 bucket = im_name_hash(0,list->names + name,len) & list->mask;
+    while (list->buckets[bucket] != 0) {
+      bucket = (bucket + 1) & list->mask;
+    }
+    list->buckets[bucket] = dirent - list->entries + 1;
+    name += len + 1;
+    dirent++;
+  }
+  g_byte_array_free(lens,TRUE);
+  return list;
+}
+
+/* a buffer for size bytes, the thread's own if it's big enough */
+static guint8 * scratch_get(gsize size) {
+  if (size > SCRATCH_SIZE) {
+    return g_malloc(size);
+  }
+  guint8 * data = g_private_get(&scratch_key);
+  if (data == NULL) {
+    data = g_malloc(SCRATCH_SIZE);
+    g_private_set(&scratch_key,data);
+  }
+  return data;
+}
+
+static void scratch_release(guint8 * data, gsize size) {
+  if (size > SCRATCH_SIZE) {
+    g_free(data);
+  }
+}
+
+int im_dirlist_read(im_source * source, const im_entry * dir, im_dirlist ** list) {
+  if (dir->size > IM_DIR_MAX_SIZE || dir->offset + dir->size > source->size) {
+    return -EIO;
+  }
+  gsize size = dir->size;
+  guint8 * data = scratch_get(size);
+  int result = im_source_read(source,data,size,dir->offset);
+  if (result == 0) {
+    *list = im_dirlist_decode(source,data,size);
+    if (*list == NULL) {
+      result = -EIO;
+    }
+  }
+  scratch_release(data,size);
+  return result;
+}
+
+int im_dir_self(im_source * source, guint64 offset, im_entry * entry) {
+  guint8 sector[IM_SECTOR_SIZE];
+  int result = im_source_read(source,sector,IM_SECTOR_SIZE,offset);
+  if (result != 0) {
+    return result;
+  }
+  // the first record of a directory is "."
+  if (!record_ok(sector,IM_SECTOR_SIZE,0) || !is_self_or_parent(sector)) {
+    return -EIO;
+  }
+  im_dirrec_decode(sector,entry);
+  return 0;
+}
+
+gboolean im_dir_has_susp(im_source * source, const im_entry * dir) {
+  guint8 sector[IM_SECTOR_SIZE];
+  if (im_source_read(source,sector,IM_SECTOR_SIZE,dir->offset) != 0 ||
+      !record_ok(sector,IM_SECTOR_SIZE,0) || !is_self_or_parent(sector)) {
+    return FALSE;
+  }
+  // SP: length 7, version 1, check bytes 0xbe 0xef
+  gsize start = su_start(sector);
+  const guint8 * sp = sector + start;
+  return start + 7 <= sector[DR_LENGTH] && su_is(sp,"SP") && sp[SU_LEN] >= 7 &&
+    sp[4] == 0xbe && sp[5] == 0xef;
+}
+
+/* position of the first record of the file called name, in *pos */
+static int find_record(im_source * source, const guint8 * data, gsize size,
+		       const gchar * name, gsize len, gsize * pos) {
+  for (gsize at = skip_padding(data,size,0); at < size;
+       at = skip_padding(data,size,at + data[at])) {
+    const guint8 * rec = data + at;
+    if (!record_ok(data,size,at)) {
+      return -EIO;
+    }
+    if (is_self_or_parent(rec) || len > IM_NAME_MAX) {
+      continue;
+    }
+    // a translated name is never longer than the original, a Rock
+    // Ridge one may be
+    if (su_start(rec) >= rec[DR_LENGTH] && rec[DR_NAME_LEN] < len) {
+      continue;
+    }
+    gchar found[IM_NAME_MAX + 1];
+    gsize flen = im_dirrec_name(source,rec,found);
+    if (flen == len && memcmp(found,name,len) == 0) {
+      *pos = at;
+      return 0;
+    }
+  }
+  return -ENOENT;
+}
+
+int im_dir_find(im_source * source, const im_entry * dir,
+		const gchar * name, gsize len, im_entry * entry) {
+  gsize size = dir->size;
+  guint8 * data = scratch_get(size);
+  int result = im_source_read(source,data,size,dir->offset);
+  gsize pos;
+  if (result == 0) {
+    result = find_record(source,data,size,name,len,&pos);
+  }
+  if (result == 0) {
+    im_dirrec_decode(data + pos,entry);
+    guint64 end = entry->offset + entry->size;
+    for (pos = next_extent(data,size,pos); pos < size; pos = next_extent(data,size,pos)) {
+      add_extent(entry,data + pos,&end);
+    }
+  }
+  scratch_release(data,size);
+  return result;
+}
+
+int im_dir_extents(im_source * source, const im_entry * dir,
+		   const gchar * name, gsize len, GArray * runs) {
+  gsize size = dir->size;
+  guint8 * data = scratch_get(size);
+  int result = im_source_read(source,data,size,dir->offset);
+  gsize pos;
+  if (result == 0) {
+    result = find_record(source,data,size,name,len,&pos);
+  }
+  for (; result == 0 && pos < size; pos = next_extent(data,size,pos)) {
+    im_entry part;
+    im_dirrec_decode(data + pos,&part);
+    im_run run = { part.offset, part.size };
+    g_array_append_val(runs,run);
+  }
+  scratch_release(data,size);
+  return result;
+}
+
+void im_dirlist_free(im_dirlist * list) {
+  g_free(list);
+}
+
+const im_dirent * im_dirlist_find(const im_dirlist * list,
+				  const gchar * name, gsize len) {
+  guint32 bucket = im_name_hash(0,name,len) & list->mask;
+  for (;;) {
+    guint32 slot = list->buckets[bucket];
+    if (slot == 0) {
+      return NULL;
+    }
+    const im_dirent * dirent = &list->entries[slot - 1];
+    const gchar * candidate = IM_DIRENT_NAME(list,dirent);
+    if (strncmp(candidate,name,len) == 0 && candidate[len] == '\0') {
+      return dirent;
+    }
+    bucket = (bucket + 1) & list->mask;
+  }
+}
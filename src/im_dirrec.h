@@ -0,0 +1,142 @@
+/* im_dirrec.h - decoding of ISO9660 directory records
+ *
+ * Copyright (C) 2016 Leo Cacciari <leo.cacciari@gmail.com>
+ *
+ * This file belongs to the isomounter project.
+ * isomounter is free software and is distributed under the terms of the
+ * GNU GPL. See the file COPYING for details.
+ */
+#ifndef __IM_DIRREC_H__
+#define __IM_DIRREC_H__
+#include "common.h"
+#include "im_image.h"
+#include "im_source.h"
+
+#define IM_SECTOR_SIZE 2048
+
+/* directory record layout (ECMA-119 9.1) */
+#define DR_LENGTH 0
+#define DR_EXTENT 2     // both-endian 32 bits, little endian first
+#define DR_SIZE 10      // same
+#define DR_DATE 18      // 7 bytes
+#define DR_FLAGS 25
+#define DR_NAME_LEN 32
+#define DR_NAME 33
+#define DR_MIN_LENGTH 34
+
+#define DR_FLAG_DIR 0x02
+#define DR_FLAG_MULTI_EXTENT 0x80
+
+/* the longest name an entry can have, Rock Ridge ones included */
+#define IM_NAME_MAX 255
+/* directories bigger than this are taken for corrupt */
+#define IM_DIR_MAX_SIZE (32 * 1024 * 1024)
+
+/* an entry of a decoded directory */
+typedef struct im_dirent_s {
+  im_entry entry;
+  guint32 name; // offset of the (translated) name in the names arena
+} im_dirent;
+
+/**
+ * A decoded directory: fixed size entries, a hash index on their
+ * names and the names, in a single allocation. "." and ".." are
+ * left out.
+ */
+typedef struct im_dirlist_s {
+  gsize size;        // of the whole thing, in bytes
+  guint n_entries;
+  guint32 mask;      // number of buckets - 1
+  guint32 * buckets; // entry index + 1, 0 for empty
+  gchar * names;
+  im_dirent entries[];
+} im_dirlist;
+
+#define IM_DIRENT_NAME(list,dirent) ((list)->names + (dirent)->name)
+
+/**
+ * Turn a 7 bytes recording date (ECMA-119 9.1.5) into a time_t,
+ * taking its GMT offset into account. 0 if it makes no sense.
+ */
+time_t im_dtime_decode(const guint8 * date);
+
+/**
+ * Decode the directory record at rec. A file in several extents has
+ * a record for each; this decodes just the first.
+ */
+void im_dirrec_decode(const guint8 * rec, im_entry * entry);
+
+/**
+ * The name of the entry at rec, into dest (IM_NAME_MAX + 1 bytes):
+ * its Rock Ridge name (NM) if it has one, else its translated
+ * identifier. Continuation areas (CE) are read from source, unless
+ * it is NULL. Returns the length of the name.
+ */
+gsize im_dirrec_name(im_source * source, const guint8 * rec, gchar * dest);
+
+/**
+ * Whether the directory at dir uses the System Use Sharing Protocol,
+ * as Rock Ridge does: its "." record starts with an SP entry.
+ */
+gboolean im_dir_has_susp(im_source * source, const im_entry * dir);
+
+/**
+ * Decode size bytes of directory records, with names as
+ * im_dirrec_name() gives them. Returns NULL if they make no sense.
+ */
+im_dirlist * im_dirlist_decode(im_source * source, const guint8 * data, gsize size);
+
+/**
+ * Read the directory extent of dir from source and decode it.
+ * Returns 0 or a negated errno value.
+ */
+int im_dirlist_read(im_source * source, const im_entry * dir, im_dirlist ** list);
+
+void im_dirlist_free(im_dirlist * list);
+
+/**
+ * The entry of list called name (len bytes), NULL if there's none.
+ */
+const im_dirent * im_dirlist_find(const im_dirlist * list,
+				  const gchar * name, gsize len);
+
+/**
+ * Decode the "." record of the directory whose extent starts at
+ * offset, which describes the directory itself.
+ */
+int im_dir_self(im_source * source, guint64 offset, im_entry * entry);
+
+/**
+ * Look for the entry called name (len bytes, as im_dirrec_name()) in the
+ * directory dir. Returns 0, -ENOENT or another negated errno value.
+ */
+int im_dir_find(im_source * source, const im_entry * dir,
+		const gchar * name, gsize len, im_entry * entry);
+
+/**
+ * Append to runs the extents of the file called name (len bytes,
+ * as im_dirrec_name()) in the directory dir, in order. Returns 0, -ENOENT or
+ * another negated errno value.
+ */
+int im_dir_extents(im_source * source, const im_entry * dir,
+		   const gchar * name, gsize len, GArray * runs);
+
+/**
+ * Translate an ISO9660 file identifier the way libcdio does:
+ * lower case, without the version suffix. dest must have room for
+ * len + 1 bytes. Returns the length of the translated name.
+ */
+gsize im_name_translate(const gchar * name, gsize len, gchar * dest);
+
+/**
+ * Return the length of the first component of *path and move
+ * *path past it and the slashes following it.
+ */
+gsize im_path_next(const gchar ** path);
+
+/**
+ * FNV-1a hash of name (len bytes), mixed with seed.
+ */
+guint32 im_name_hash(guint32 seed, const gchar * name, gsize len);
+
+#endif /*__IM_DIRREC_H__*/
@@ -0,0 +1,400 @@
+/* im_extract.c - bulk extraction of an image to a local directory
+ *
+ * Copyright (C) 2016 Leo Cacciari <leo.cacciari@gmail.com>
+ *
+ * This file belongs to the isomounter project.
+ * isomounter is free software and is distributed under the terms of the
+ * GNU GPL. See the file COPYING for details.
+ */
+#include "common.h"
+#include "im_extract.h"
+#include "im_image.h"
+#include <glib/gstdio.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
+
+/* buffer used when the kernel can't copy for us */
+#define COPY_BUFFER_SIZE (1024 * 1024)
+
+/* a file or directory found walking the image */
+typedef struct im_extent_s {
+  gchar * path; // where it goes under dest
+  guint64 offset;
+  guint64 size;
+  time_t mtime;
+  gboolean fragmented; // offset is just where the first extent is
+} im_extent;
+
+/* a piece of image read in one go, shared by the files it contains */
+typedef struct im_chunk_s {
+  gchar * data;
+  gint pending; // write jobs still using data
+} im_chunk;
+
+typedef struct im_job_s {
+  const im_extent * extent;
+  im_chunk * chunk; // NULL means copy straight from the image
+  gsize offset;     // where the file data starts in chunk
+} im_job;
+
+typedef struct im_extractor_s {
+  im_image * image;
+  int image_fd; // -1 if the kernel can't copy from the image
+  GPtrArray * files;
+  GPtrArray * dirs;
+  GAsyncQueue * free_chunks;
+  GMutex lock;
+  GError * error; // first failure, protected by lock
+  gint failed;
+} im_extractor;
+
+static void extent_free(gpointer data) {
+  im_extent * extent = (im_extent *) data;
+  g_free(extent->path);
+  g_free(extent);
+}
+
+static gint compare_extents(gconstpointer a,gconstpointer b) {
+  const im_extent * ea = *(im_extent * const *) a;
+  const im_extent * eb = *(im_extent * const *) b;
+  return (ea->offset > eb->offset) - (ea->offset < eb->offset);
+}
+
+static void extract_fail(im_extractor * ex,const gchar * path,int err) {
+  g_mutex_lock(&ex->lock);
+  if (ex->error == NULL) {
+    g_set_error(&ex->error,IM_ERROR_DOMAIN,IM_ERROR_EXTRACT,
+		"%s: %s",path,g_strerror(err));
+  }
+  g_mutex_unlock(&ex->lock);
+  g_atomic_int_set(&ex->failed,1);
+}
+
+/* state of the walk of one directory */
+typedef struct im_walk_s {
+  im_extractor * ex;
+  const gchar * iso_path;
+  const gchar * dest_path;
+  GError ** error;
+  gboolean failed;
+} im_walk;
+
+static gboolean walk(im_extractor * ex,const gchar * iso_path,
+		     const gchar * dest_path,GError ** error);
+
+/*
+ * Names come from the image: one that could take the path out of the
+ * directory being extracted is refused.
+ */
+static gboolean safe_name(const gchar * name) {
+  return name[0] != 0 && strcmp(name,".") != 0 && strcmp(name,"..") != 0 &&
+    strchr(name,'/') == NULL;
+}
+
+static int walk_one(gpointer data,const gchar * name,const im_entry * entry) {
+  im_walk * w = (im_walk *) data;
+  if (!safe_name(name)) {
+    g_set_error(w->error,IM_ERROR_DOMAIN,IM_ERROR_EXTRACT,
+		"%s: invalid name \"%s\" in the image",w->iso_path,name);
+    w->failed = TRUE;
+    return w->failed;
+  }
+  im_extent * extent = g_new0(im_extent,1);
+  extent->path = g_build_filename(w->dest_path,name,NULL);
+  extent->offset = entry->offset;
+  extent->size = entry->size;
+  extent->mtime = entry->mtime;
+  extent->fragmented = entry->fragmented;
+  if (entry->is_dir) {
+    g_ptr_array_add(w->ex->dirs,extent);
+    if (g_mkdir(extent->path,0755) != 0 && errno != EEXIST) {
+      g_set_error(w->error,IM_ERROR_DOMAIN,IM_ERROR_EXTRACT,
+		  "%s: %s",extent->path,g_strerror(errno));
+      w->failed = TRUE;
+    } else {
+      gchar * child = g_build_filename(w->iso_path,name,NULL);
+      w->failed = !walk(w->ex,child,extent->path,w->error);
+      g_free(child);
+    }
+  } else {
+    g_ptr_array_add(w->ex->files,extent);
+  }
+  return w->failed;
+}
+
+/*
+ * Walk the directory iso_path, creating its subdirectories under
+ * dest_path and collecting all the files found.
+ */
+static gboolean walk(im_extractor * ex,const gchar * iso_path,
+		     const gchar * dest_path,GError ** error) {
+  im_walk w = { ex, iso_path, dest_path, error, FALSE };
+  int rc = im_image_readdir(ex->image,iso_path,walk_one,&w);
+  if (rc != 0) {
+    g_set_error(error,IM_ERROR_DOMAIN,IM_ERROR_IMAGE,
+		"unable to read directory %s: %s",iso_path,g_strerror(-rc));
+    return FALSE;
+  }
+  return !w.failed;
+}
+
+static int write_all(int fd,const gchar * data,gsize size) {
+  while (size > 0) {
+    ssize_t n = write(fd,data,size);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return errno;
+    }
+    data += n;
+    size -= n;
+  }
+  return 0;
+}
+
+static int read_all(im_extractor * ex,gchar * data,gsize size,off_t offset) {
+  return -im_image_pread(ex->image,data,size,offset);
+}
+
+/*
+ * Copy size bytes at offset from the image to fd, letting the kernel
+ * do the job when it can (copy_file_range may even reflink it), then
+ * falling back to sendfile and at last to plain read/write.
+ */
+static int copy_run(im_extractor * ex,int fd,off_t offset,guint64 size) {
+  guint64 remaining = size;
+#ifdef HAVE_COPY_FILE_RANGE
+  while (remaining > 0 && ex->image_fd >= 0) {
+    ssize_t n = copy_file_range(ex->image_fd,&offset,fd,NULL,remaining,0);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EXDEV || errno == EINVAL || errno == ENOSYS ||
+	  errno == EOPNOTSUPP) break;
+      return errno;
+    }
+    if (n == 0) return EIO;
+    remaining -= n;
+  }
+#endif
+#ifdef HAVE_SYS_SENDFILE_H
+  while (remaining > 0 && ex->image_fd >= 0) {
+    ssize_t n = sendfile(fd,ex->image_fd,&offset,remaining);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EINVAL || errno == ENOSYS) break;
+      return errno;
+    }
+    if (n == 0) return EIO;
+    remaining -= n;
+  }
+#endif
+  int err = 0;
+  if (remaining > 0) {
+    gchar * buffer = g_malloc(COPY_BUFFER_SIZE);
+    while (remaining > 0 && err == 0) {
+      gsize size = MIN(remaining,COPY_BUFFER_SIZE);
+      err = read_all(ex,buffer,size,offset);
+      if (err == 0) err = write_all(fd,buffer,size);
+      offset += size;
+      remaining -= size;
+    }
+    g_free(buffer);
+  }
+  return err;
+}
+
+/* a whole file, one run after the other */
+static int copy_extent(im_extractor * ex,int fd,const im_extent * extent) {
+  if (!extent->fragmented) {
+    return copy_run(ex,fd,extent->offset,extent->size);
+  }
+  im_entry entry = { extent->offset, extent->size, extent->mtime, FALSE, TRUE };
+  GArray * runs = g_array_new(FALSE,FALSE,sizeof(im_run));
+  int err = -im_image_map(ex->image,&entry,0,extent->size,runs);
+  for (guint idx = 0; err == 0 && idx < runs->len; idx++) {
+    const im_run * run = &g_array_index(runs,im_run,idx);
+    err = copy_run(ex,fd,run->offset,run->size);
+  }
+  g_array_free(runs,TRUE);
+  return err;
+}
+
+static void release_chunk(im_extractor * ex,im_chunk * chunk) {
+  if (g_atomic_int_dec_and_test(&chunk->pending)) {
+    g_async_queue_push(ex->free_chunks,chunk);
+  }
+}
+
+/*
+ * Thread pool worker: write one file.
+ */
+static void extract_job(gpointer data,gpointer user_data) {
+  im_job * job = (im_job *) data;
+  im_extractor * ex = (im_extractor *) user_data;
+  const im_extent * extent = job->extent;
+  if (!g_atomic_int_get(&ex->failed)) {
+    int err = 0;
+    int fd = open(extent->path,O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,0644);
+    if (fd < 0) {
+      err = errno;
+    } else {
+      if (job->chunk != NULL) {
+	err = write_all(fd,job->chunk->data + job->offset,extent->size);
+      } else {
+	err = copy_extent(ex,fd,extent);
+      }
+      if (err == 0) {
+	struct timespec times[2] = {{extent->mtime,0},{extent->mtime,0}};
+	futimens(fd,times);
+      }
+      if (close(fd) != 0 && err == 0) {
+	err = errno;
+      }
+    }
+    if (err != 0) {
+      extract_fail(ex,extent->path,err);
+    }
+  }
+  if (job->chunk != NULL) {
+    release_chunk(ex,job->chunk);
+  }
+  g_free(job);
+}
+
+static void push_job(GThreadPool * pool,const im_extent * extent,
+		     im_chunk * chunk,gsize offset) {
+  im_job * job = g_new(im_job,1);
+  job->extent = extent;
+  job->chunk = chunk;
+  job->offset = offset;
+  g_thread_pool_push(pool,job,NULL);
+}
+
+/*
+ * Read the image in LSN order and hand the files over to the
+ * writers. Consecutive small files are packed in chunks so that
+ * they cost a single read, files bigger than a chunk are copied on
+ * their own. At most 2 * n_threads chunks are in flight, which
+ * bounds the memory used whatever the image size.
+ */
+static gboolean extract_files(im_extractor * ex,gint n_threads,
+			      GError ** error) {
+  const guint n_chunks = 2 * n_threads;
+  im_chunk * chunks = g_new0(im_chunk,n_chunks);
+  ex->free_chunks = g_async_queue_new();
+  for (guint idx = 0; idx < n_chunks; idx++) {
+    chunks[idx].data = g_malloc(IM_EXTRACT_CHUNK_SIZE);
+    g_async_queue_push(ex->free_chunks,&chunks[idx]);
+  }
+  GThreadPool * pool = g_thread_pool_new(extract_job,ex,n_threads,TRUE,error);
+  if (pool != NULL) {
+    GPtrArray * files = ex->files;
+    guint idx = 0;
+    while (idx < files->len && !g_atomic_int_get(&ex->failed)) {
+      const im_extent * first = g_ptr_array_index(files,idx);
+      if (first->size == 0 || first->size >= IM_EXTRACT_CHUNK_SIZE || first->fragmented) {
+	push_job(pool,first,NULL,0);
+	idx++;
+	continue;
+      }
+      const off_t start = first->offset;
+      off_t end = start;
+      guint last = idx;
+      while (last < files->len) {
+	const im_extent * extent = g_ptr_array_index(files,last);
+	off_t extent_end = extent->offset + extent->size;
+	if (extent->size >= IM_EXTRACT_CHUNK_SIZE || extent->fragmented ||
+	    extent_end - start > IM_EXTRACT_CHUNK_SIZE) break;
+	end = MAX(end,extent_end);
+	last++;
+      }
+      im_chunk * chunk = g_async_queue_pop(ex->free_chunks);
+      int err = read_all(ex,chunk->data,end - start,start);
+      if (err != 0) {
+	extract_fail(ex,"image",err);
+	g_async_queue_push(ex->free_chunks,chunk);
+	break;
+      }
+      g_atomic_int_set(&chunk->pending,last - idx);
+      for (; idx < last; idx++) {
+	const im_extent * extent = g_ptr_array_index(files,idx);
+	push_job(pool,extent,chunk,extent->offset - start);
+      }
+    }
+    // wait for the writers to finish
+    g_thread_pool_free(pool,FALSE,TRUE);
+  }
+  for (guint idx = 0; idx < n_chunks; idx++) {
+    g_free(chunks[idx].data);
+  }
+  g_free(chunks);
+  g_async_queue_unref(ex->free_chunks);
+  if (pool == NULL) {
+    return FALSE;
+  }
+  if (ex->error != NULL) {
+    g_propagate_error(error,ex->error);
+    ex->error = NULL;
+    return FALSE;
+  }
+  return TRUE;
+}
+
+/*
+ * Writing the files changed the directories times: restore them,
+ * children first.
+ */
+static void restore_dir_times(im_extractor * ex) {
+  for (guint idx = ex->dirs->len; idx > 0; idx--) {
+    const im_extent * dir = g_ptr_array_index(ex->dirs,idx - 1);
+    struct timespec times[2] = {{dir->mtime,0},{dir->mtime,0}};
+    utimensat(AT_FDCWD,dir->path,times,0);
+  }
+}
+
+gboolean im_extract(const gchar * image_path,const im_open_options * options,
+		    const gchar * dest,gint n_threads,GError ** error) {
+  if (n_threads <= 0) {
+    n_threads = g_get_num_processors();
+  }
+  if (g_mkdir_with_parents(dest,0755) != 0) {
+    g_set_error(error,IM_ERROR_DOMAIN,IM_ERROR_EXTRACT,
+		"unable to create %s: %s",dest,g_strerror(errno));
+    return FALSE;
+  }
+  im_extractor ex = { 0 };
+  ex.image = im_image_open_full(image_path,options,error);
+  if (ex.image == NULL) {
+    return FALSE;
+  }
+  ex.image_fd = im_image_fd(ex.image);
+  if (ex.image_fd >= 0) {
+    posix_fadvise(ex.image_fd,0,0,POSIX_FADV_SEQUENTIAL);
+  }
+  g_mutex_init(&ex.lock);
+  ex.files = g_ptr_array_new_with_free_func(extent_free);
+  ex.dirs = g_ptr_array_new_with_free_func(extent_free);
+
+  gboolean result = walk(&ex,"/",dest,error);
+  if (result) {
+    g_debug("extracting %u files from %s",ex.files->len,image_path);
+    g_ptr_array_sort(ex.files,compare_extents);
+    result = extract_files(&ex,n_threads,error);
+  }
+  if (result) {
+    restore_dir_times(&ex);
+  }
+
+  g_ptr_array_free(ex.files,TRUE);
+  g_ptr_array_free(ex.dirs,TRUE);
+  g_mutex_clear(&ex.lock);
+  im_image_close(ex.image);
+  return result;
+}
@@ -0,0 +1,33 @@
+/* im_extract.h - bulk extraction of an image to a local directory
+ *
+ * Copyright (C) 2016 Leo Cacciari <leo.cacciari@gmail.com>
+ *
+ * This file belongs to the isomounter project.
+ * isomounter is free software and is distributed under the terms of the
+ * GNU GPL. See the file COPYING for details.
+ */
+#ifndef __IM_EXTRACT_H__
+#define __IM_EXTRACT_H__
+#include "common.h"
+#include "im_image.h"
+
+/* size of the chunks the image is read in */
+#define IM_EXTRACT_CHUNK_SIZE (4 * 1024 * 1024)
+
+/**
+ * Copy the whole tree of the image at image_path, opened with options
+ * as im_image_open_full() does, under dest, which is created if
+ * missing.
+ *
+ * The tree is walked once, then the files are copied in the order
+ * their extents appear on the image, so the image is read
+ * sequentially. Small files are read in chunks of
+ * IM_EXTRACT_CHUNK_SIZE bytes and written by a pool of n_threads
+ * writer threads, bigger ones are copied in-kernel where possible.
+ *
+ * Returns FALSE and sets error if anything goes wrong.
+ */
+gboolean im_extract(const gchar * image_path,const im_open_options * options,
+		    const gchar * dest,gint n_threads,GError ** error);
+
+#endif /*__IM_EXTRACT_H__*/
@@ -0,0 +1,197 @@
+/* im_http.c - images read over HTTP
+ *
+ * Copyright (C) 2016 Leo Cacciari <leo.cacciari@gmail.com>
+ *
+ * This file belongs to the isomounter project.
+ * isomounter is free software and is distributed under the terms of the
+ * GNU GPL. See the file COPYING for details.
+ */
+#include "common.h"
+#include "im_source.h"
+
+#ifdef HAVE_LIBCURL
+#include <curl/curl.h>
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+/* a connection that makes no progress for this long is given up */
+#define CONNECT_TIMEOUT 10
+#define STALL_TIMEOUT 30
+
+/*
+ * Every read is a GET with a Range header. Each thread has its own
+ * easy handle, so that connections are kept alive without locking.
+ */
+typedef struct http_source_s {
+  im_source base;
+  gchar * url;
+} http_source;
+
+/* where the body of a response goes */
+typedef struct sink_s {
+  guint8 * data;
+  gsize size;
+  gsize done;
+} sink;
+
+static void handle_free(gpointer handle) {
+  curl_easy_cleanup((CURL *) handle);
+}
+
+static GPrivate handles = G_PRIVATE_INIT(handle_free);
+
+static CURL * handle_get(const gchar * url) {
+  static gsize initialized = 0;
+  if (g_once_init_enter(&initialized)) {
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+    g_once_init_leave(&initialized,1);
+  }
+  CURL * handle = g_private_get(&handles);
+  if (handle == NULL) {
+    handle = curl_easy_init();
+    if (handle == NULL) {
+      return NULL;
+    }
+    g_private_set(&handles,handle);
+  } else {
+    curl_easy_reset(handle);
+  }
+  curl_easy_setopt(handle,CURLOPT_URL,url);
+  curl_easy_setopt(handle,CURLOPT_USERAGENT,PACKAGE_NAME "/" PACKAGE_VERSION);
+  curl_easy_setopt(handle,CURLOPT_FOLLOWLOCATION,1L);
+  curl_easy_setopt(handle,CURLOPT_FAILONERROR,1L);
+  // signals would hit the fuse threads
+  curl_easy_setopt(handle,CURLOPT_NOSIGNAL,1L);
+  curl_easy_setopt(handle,CURLOPT_CONNECTTIMEOUT,(long) CONNECT_TIMEOUT);
+  curl_easy_setopt(handle,CURLOPT_LOW_SPEED_LIMIT,1L);
+  curl_easy_setopt(handle,CURLOPT_LOW_SPEED_TIME,(long) STALL_TIMEOUT);
+  return handle;
+}
+
+static int curl_errno(CURLcode code) {
+  return code == CURLE_OPERATION_TIMEDOUT ? -ETIMEDOUT : -EIO;
+}
+
+static size_t sink_write(char * data, size_t size, size_t n, void * user_data) {
+  sink * s = (sink *) user_data;
+  gsize len = size * n;
+  if (len > s->size - s->done) {
+    // more than asked for: the server ignored the range
+    return 0;
+  }
+  memcpy(s->data + s->done,data,len);
+  s->done += len;
+  return len;
+}
+
+static gssize http_pread(im_source * source, gpointer buf, gsize size,
+			 guint64 offset) {
+  http_source * http = (http_source *) source;
+  if (offset >= source->size || size == 0) {
+    return 0;
+  }
+  size = MIN(size,source->size - offset);
+  CURL * handle = handle_get(http->url);
+  if (handle == NULL) {
+    return -ENOMEM;
+  }
+  gchar range[48];
+  g_snprintf(range,sizeof(range),"%" G_GUINT64_FORMAT "-%" G_GUINT64_FORMAT,
+	     offset,offset + size - 1);
+  sink s = { buf, size, 0 };
+  curl_easy_setopt(handle,CURLOPT_RANGE,range);
+  curl_easy_setopt(handle,CURLOPT_WRITEFUNCTION,sink_write);
+  curl_easy_setopt(handle,CURLOPT_WRITEDATA,&s);
+  CURLcode code = curl_easy_perform(handle);
+  if (code != CURLE_OK) {
+    g_debug("%s: range %s: %s",source->name,range,curl_easy_strerror(code));
+    return curl_errno(code);
+  }
+  long status = 0;
+  curl_easy_getinfo(handle,CURLINFO_RESPONSE_CODE,&status);
+  // a 200 is the whole file, good only if that's what was asked
+  if (status != 206 && !(status == 200 && offset == 0 && size == source->size)) {
+    g_debug("%s: range %s: status %ld",source->name,range,status);
+    return -EIO;
+  }
+  return s.done;
+}
+
+static void http_close(im_source * source) {
+  g_free(((http_source *) source)->url);
+}
+
+static const im_source_ops http_ops = {
+  .pread = http_pread,
+  .close = http_close,
+};
+
+static size_t discard(char * data, size_t size, size_t n, void * user_data) {
+  return size * n;
+}
+
+/* the ETag and Last-Modified of the last response, as the version */
+static size_t keep_version(char * data, size_t size, size_t n, void * user_data) {
+  GString * version = (GString *) user_data;
+  gsize len = size * n;
+  if (len >= 5 && strncmp(data,"HTTP/",5) == 0) {
+    // a new response, after a redirection
+    g_string_truncate(version,0);
+  } else if ((len > 5 && g_ascii_strncasecmp(data,"ETag:",5) == 0) ||
+	     (len > 14 && g_ascii_strncasecmp(data,"Last-Modified:",14) == 0)) {
+    g_string_append_len(version,data,len);
+  }
+  return len;
+}
+
+im_source * im_http_source_open(const gchar * url, GError ** error) {
+  CURL * handle = handle_get(url);
+  if (handle == NULL) {
+    g_set_error(error,IM_ERROR_DOMAIN,IM_ERROR_IMAGE,"failed to set up HTTP for %s",url);
+    return NULL;
+  }
+  curl_easy_setopt(handle,CURLOPT_NOBODY,1L);
+  curl_easy_setopt(handle,CURLOPT_WRITEFUNCTION,discard);
+  GString * version = g_string_new(NULL);
+  curl_easy_setopt(handle,CURLOPT_HEADERFUNCTION,keep_version);
+  curl_easy_setopt(handle,CURLOPT_HEADERDATA,version);
+  CURLcode code = curl_easy_perform(handle);
+  curl_off_t length = -1;
+  if (code == CURLE_OK) {
+    curl_easy_getinfo(handle,CURLINFO_CONTENT_LENGTH_DOWNLOAD_T,&length);
+  }
+  if (code != CURLE_OK) {
+    g_set_error(error,IM_ERROR_DOMAIN,IM_ERROR_IMAGE,
+		"failed to reach image at %s: %s",url,curl_easy_strerror(code));
+    g_string_free(version,TRUE);
+    return NULL;
+  }
+  if (length < 0) {
+    g_set_error(error,IM_ERROR_DOMAIN,IM_ERROR_IMAGE,
+		"the server doesn't tell the size of %s",url);
+    g_string_free(version,TRUE);
+    return NULL;
+  }
+  http_source * http = g_new0(http_source,1);
+  http->base.ops = &http_ops;
+  http->base.name = g_strdup(url);
+  http->base.size = length;
+  http->base.fd = -1;
+  // without either, a rebuilt image is only told apart by its contents
+  http->base.version = g_string_free(version,version->len == 0);
+  http->url = g_strdup(url);
+  g_debug("%s: %" G_GUINT64_FORMAT " bytes",url,http->base.size);
+  return &http->base;
+}
+
+#else /* HAVE_LIBCURL */
+
+im_source * im_http_source_open(const gchar * url, GError ** error) {
+  g_set_error(error,IM_ERROR_DOMAIN,IM_ERROR_IMAGE,
+	      "can't read %s: built without HTTP support",url);
+  return NULL;
+}
+
+#endif /* HAVE_LIBCURL */
@@ -0,0 +1,591 @@
+/* im_image.c - implementation of image access
+ *
+ * Copyright (C) 2016 Leo Cacciari <leo.cacciari@gmail.com>
+ *
+ * This file belongs to the isomounter project.
+ * isomounter is free software and is distributed under the terms of the
+ * GNU GPL. See the file COPYING for details.
+ */
+#include "common.h"
+#include "im_image.h"
+#include "im_dirrec.h"
+#include "im_pathtab.h"
+#include "im_index.h"
+#include "im_source.h"
+#include "im_dedup.h"
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+G_DEFINE_QUARK(isomounter-error-quark,im_error);
+
+/* volume descriptors (ECMA-119 8) */
+#define VD_FIRST_SECTOR 16
+#define VD_MAX 32 // give up looking for the primary after these
+#define VD_TYPE 0
+#define VD_ID 1
+#define VD_PRIMARY 1
+#define VD_TERMINATOR 255
+#define PVD_PATH_TABLE_SIZE 132
+#define PVD_L_PATH_TABLE 140
+#define PVD_M_PATH_TABLE 148
+#define PVD_ROOT 156
+
+struct im_image_s {
+  gchar * path;
+  // sources need no locking, and nothing below changes after
+  // im_image_open()
+  im_source * source;
+  im_entry root;
+  im_pathtab * pathtab; // NULL if the image has no usable one
+  im_index * index;     // set at most once, by im_image_prescan()
+  GMutex extmaps_lock;
+  GHashTable * extmaps; // first extent offset -> extmap, of fragmented files
+  im_dedup * dedup;     // NULL unless asked for
+};
+
+/* where the extents of a fragmented file are, and where they start in it */
+typedef struct extmap_s {
+  guint64 key;
+  guint n_runs;
+  im_run * runs;
+  guint64 starts[];
+} extmap;
+
+static guint32 read_le32(const guint8 * p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((guint32) p[3] << 24);
+}
+
+static guint32 read_be32(const guint8 * p) {
+  return ((guint32) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+/*
+ * Find the primary volume descriptor, and from it the root
+ * directory and the path table.
+ */
+static gboolean read_volume(im_image * image, GError ** error) {
+  guint8 sector[IM_SECTOR_SIZE];
+  for (guint idx = 0; idx < VD_MAX; idx++) {
+    guint64 offset = (guint64) (VD_FIRST_SECTOR + idx) * IM_SECTOR_SIZE;
+    if (im_source_read(image->source,sector,IM_SECTOR_SIZE,offset) != 0 ||
+	memcmp(sector + VD_ID,"CD001",5) != 0 ||
+	sector[VD_TYPE] == VD_TERMINATOR) {
+      break;
+    }
+    if (sector[VD_TYPE] != VD_PRIMARY) {
+      continue;
+    }
+    im_dirrec_decode(sector + PVD_ROOT,&image->root);
+    image->root.is_dir = TRUE;
+    gsize size = read_le32(sector + PVD_PATH_TABLE_SIZE);
+    guint32 l_table = read_le32(sector + PVD_L_PATH_TABLE);
+    guint32 m_table = read_be32(sector + PVD_M_PATH_TABLE);
+    // the path table has the ISO names only, not the Rock Ridge ones
+    if (im_dir_has_susp(image->source,&image->root)) {
+      g_debug("%s has System Use entries, not using its path table",image->path);
+      return TRUE;
+    }
+    if (l_table != 0) {
+      image->pathtab = im_pathtab_load(image->source,(guint64) l_table * IM_SECTOR_SIZE,
+				       size,FALSE);
+    }
+    if (image->pathtab == NULL && m_table != 0) {
+      image->pathtab = im_pathtab_load(image->source,(guint64) m_table * IM_SECTOR_SIZE,
+				       size,TRUE);
+    }
+    if (image->pathtab == NULL) {
+      g_debug("no usable path table in %s",image->path);
+    }
+    return TRUE;
+  }
+  g_set_error(error,IM_ERROR_DOMAIN,IM_ERROR_IMAGE,
+	      "%s is not an ISO9660 image",image->path);
+  return FALSE;
+}
+
+im_image * im_image_open(const gchar * path, GError ** error) {
+  return im_image_open_full(path,NULL,error);
+}
+
+im_image * im_image_open_full(const gchar * path, const im_open_options * options,
+			      GError ** error) {
+  im_open_options defaults = { 0 };
+  im_source * source = im_source_open(path,options != NULL ? options : &defaults,error);
+  if (source == NULL) {
+    return NULL;
+  }
+  im_image * image = g_new0(im_image,1);
+  image->path = g_strdup(path);
+  image->source = source;
+  g_mutex_init(&image->extmaps_lock);
+  image->extmaps = g_hash_table_new_full(g_int64_hash,g_int64_equal,NULL,g_free);
+  if (!read_volume(image,error)) {
+    im_image_close(image);
+    return NULL;
+  }
+  if (options != NULL && options->dedup_dir != NULL && options->crypt_key != NULL) {
+    // it would keep the contents in clear on disk
+    g_warning("no dedup store for the encrypted image %s",path);
+  } else if (options != NULL && options->dedup_dir != NULL) {
+    gchar * identity = im_source_identity(source,error);
+    if (identity != NULL) {
+      image->dedup = im_dedup_new(options->dedup_dir,identity,
+				  options->dedup_size > 0 ? options->dedup_size : IM_DEDUP_DEFAULT_SIZE,
+				  error);
+      g_free(identity);
+    }
+    if (image->dedup == NULL) {
+      im_image_close(image);
+      return NULL;
+    }
+  }
+  return image;
+}
+
+gboolean im_image_prescan(im_image * image, guint n_threads, GError ** error) {
+  g_return_val_if_fail(image->index == NULL,FALSE);
+  im_index * index = im_index_prescan(image->source,&image->root,n_threads,error);
+  if (index == NULL) {
+    return FALSE;
+  }
+  g_atomic_pointer_set(&image->index,index);
+  return TRUE;
+}
+
+gboolean im_image_save_index(im_image * image, GByteArray * out) {
+  im_index * index = g_atomic_pointer_get(&image->index);
+  return index != NULL && im_index_save(index,out);
+}
+
+gboolean im_image_load_index(im_image * image, const guint8 * data, gsize size,
+			     GError ** error) {
+  g_return_val_if_fail(image->index == NULL,FALSE);
+  im_index * index = im_index_load(image->source,&image->root,data,size);
+  if (index == NULL) {
+    g_set_error(error,IM_ERROR_DOMAIN,IM_ERROR_IMAGE,"not a saved index");
+    return FALSE;
+  }
+  g_atomic_pointer_set(&image->index,index);
+  return TRUE;
+}
+
+gchar * im_image_identity(im_image * image, GError ** error) {
+  return im_source_identity(image->source,error);
+}
+
+void im_image_close(im_image * image) {
+  if (image != NULL) {
+    // waits for the chunks on their way to the store
+    im_dedup_free(image->dedup);
+    im_index_free(image->index);
+    im_pathtab_free(image->pathtab);
+    im_source_close(image->source);
+    g_hash_table_destroy(image->extmaps);
+    g_mutex_clear(&image->extmaps_lock);
+    g_free(image->path);
+    g_free(image);
+  }
+}
+
+gboolean im_image_get_budget(im_image * image, im_budget * budget) {
+  const im_source_ops * ops = image->source->ops;
+  if (ops->get_budget == NULL || ops->set_budget == NULL) {
+    return FALSE;
+  }
+  ops->get_budget(image->source,budget);
+  return TRUE;
+}
+
+void im_image_set_budget(im_image * image, gsize bytes) {
+  if (image->source->ops->set_budget != NULL) {
+    image->source->ops->set_budget(image->source,bytes);
+  }
+}
+
+gsize im_image_index_memory(im_image * image, guint64 * n_entries) {
+  im_index * index = g_atomic_pointer_get(&image->index);
+  if (index == NULL) {
+    if (n_entries != NULL) *n_entries = 0;
+    return 0;
+  }
+  return im_index_memory(index,n_entries);
+}
+
+const gchar * im_image_path(const im_image * image) {
+  return image->path;
+}
+
+guint64 im_image_size(const im_image * image) {
+  return image->source->size;
+}
+
+int im_image_fd(const im_image * image) {
+  // reading by itself would go around the dedup store
+  return image->dedup != NULL ? -1 : image->source->fd;
+}
+
+int im_image_pread(im_image * image, gpointer buf, gsize size, guint64 offset) {
+  return im_source_read(image->source,buf,size,offset);
+}
+
+/* look for name in dir, in memory if the prescan decoded it */
+static int dir_find(im_image * image, const im_entry * dir,
+		    const gchar * name, gsize len, im_entry * entry) {
+  im_index * index = g_atomic_pointer_get(&image->index);
+  if (index != NULL) {
+    int result = im_index_find(index,dir,name,len,entry);
+    if (result != IM_INDEX_MISS) {
+      return result;
+    }
+  }
+  return im_dir_find(image->source,dir,name,len,entry);
+}
+
+/* entry of the directory idx of the path table */
+static int table_dir(im_image * image, guint idx, im_entry * entry) {
+  if (idx == 0) {
+    *entry = image->root;
+    return 0;
+  }
+  guint64 offset = (guint64) image->pathtab->extent[idx] * IM_SECTOR_SIZE;
+  return im_dir_self(image->source,offset,entry);
+}
+
+/*
+ * All the directories are in the path table, so the path resolves
+ * with a hash probe per component. Only when the last one is a file
+ * its directory has to be scanned.
+ */
+static int lookup_table(im_image * image, const gchar * path, im_entry * entry) {
+  guint idx = 0;
+  while (*path != '\0') {
+    const gchar * name = path;
+    gsize len = im_path_next(&path);
+    gint child = im_pathtab_child(image->pathtab,idx,name,len);
+    if (child < 0) {
+      im_entry dir;
+      int result = table_dir(image,idx,&dir);
+      if (result == 0) {
+	result = dir_find(image,&dir,name,len,entry);
+      }
+      if (result == 0 && *path != '\0') {
+	// not a directory, so it can't have children
+	return -ENOTDIR;
+      }
+      return result;
+    }
+    idx = child;
+  }
+  return table_dir(image,idx,entry);
+}
+
+/* without a path table, descend the directories one by one */
+static int lookup_walk(im_image * image, const gchar * path, im_entry * entry) {
+  im_entry current = image->root;
+  while (*path != '\0') {
+    if (!current.is_dir) {
+      return -ENOTDIR;
+    }
+    const gchar * name = path;
+    gsize len = im_path_next(&path);
+    im_entry child;
+    int result = dir_find(image,&current,name,len,&child);
+    if (result != 0) {
+      return result;
+    }
+    current = child;
+  }
+  *entry = current;
+  return 0;
+}
+
+/*
+ * Fragmented files
+ *
+ * Their extents are read from their directory the first time they
+ * are looked up or listed, and kept until the image is closed.
+ */
+
+static const extmap * extmap_get(im_image * image, const im_entry * entry) {
+  g_mutex_lock(&image->extmaps_lock);
+  const extmap * map = g_hash_table_lookup(image->extmaps,&entry->offset);
+  g_mutex_unlock(&image->extmaps_lock);
+  return map;
+}
+
+/* read the extents of entry, called name (len bytes) in dir */
+static void extmap_add(im_image * image, const im_entry * dir,
+		       const gchar * name, gsize len, const im_entry * entry) {
+  if (extmap_get(image,entry) != NULL) {
+    return;
+  }
+  GArray * runs = g_array_new(FALSE,FALSE,sizeof(im_run));
+  int result = im_dir_extents(image->source,dir,name,len,runs);
+  extmap * map = g_malloc(sizeof(extmap) + runs->len * sizeof(guint64) +
+			  runs->len * sizeof(im_run));
+  map->key = entry->offset;
+  map->n_runs = runs->len;
+  map->runs = (im_run *) &map->starts[runs->len];
+  guint64 start = 0;
+  for (guint idx = 0; idx < runs->len; idx++) {
+    map->runs[idx] = g_array_index(runs,im_run,idx);
+    map->starts[idx] = start;
+    start += map->runs[idx].size;
+  }
+  g_array_free(runs,TRUE);
+  // a file changed or not found reads as an error
+  if (result != 0 || map->n_runs == 0 || map->runs[0].offset != entry->offset ||
+      start != entry->size) {
+    g_free(map);
+    return;
+  }
+  g_mutex_lock(&image->extmaps_lock);
+  if (!g_hash_table_contains(image->extmaps,&map->key)) {
+    g_hash_table_insert(image->extmaps,&map->key,map);
+  } else {
+    g_free(map);
+  }
+  g_mutex_unlock(&image->extmaps_lock);
+}
+
+static int lookup(im_image * image, const gchar * path, im_entry * entry) {
+  im_index * index = g_atomic_pointer_get(&image->index);
+  if (index != NULL) {
+    int result = im_index_lookup(index,path,entry);
+    if (result != IM_INDEX_MISS) {
+      return result;
+    }
+  }
+  if (image->pathtab != NULL) {
+    return lookup_table(image,path,entry);
+  }
+  return lookup_walk(image,path,entry);
+}
+
+int im_image_lookup(im_image * image, const gchar * path, im_entry * entry) {
+  while (*path == '/') path++;
+  int result = lookup(image,path,entry);
+  if (result == 0 && entry->fragmented) {
+    const gchar * name = strrchr(path,'/');
+    name = name != NULL ? name + 1 : path;
+    gchar * parent = g_strndup(path,name - path);
+    im_entry dir;
+    if (lookup(image,parent,&dir) == 0) {
+      extmap_add(image,&dir,name,strlen(name),entry);
+    }
+    g_free(parent);
+  }
+  return result;
+}
+
+int im_image_totals(im_image * image, const gchar * path,
+		    guint64 * bytes, guint64 * files) {
+  im_index * index = g_atomic_pointer_get(&image->index);
+  while (*path == '/') path++;
+  im_tree_total total;
+  int result = index != NULL ? im_index_totals(index,path,&total) : IM_INDEX_MISS;
+  if (result == IM_INDEX_MISS) {
+    return -EAGAIN;
+  }
+  if (result == 0) {
+    *bytes = total.bytes;
+    *files = total.files;
+  }
+  return result;
+}
+
+/* passes entries on to the caller's filler, mapping fragmented files */
+typedef struct map_filler_s {
+  im_image * image;
+  const im_entry * dir;
+  im_dir_filler filler;
+  gpointer data;
+} map_filler;
+
+static int map_and_fill(gpointer data, const gchar * name, const im_entry * entry) {
+  map_filler * f = (map_filler *) data;
+  if (entry->fragmented) {
+    extmap_add(f->image,f->dir,name,strlen(name),entry);
+  }
+  return f->filler(f->data,name,entry);
+}
+
+int im_image_readdir(im_image * image, const gchar * path,
+		     im_dir_filler filler, gpointer data) {
+  im_entry dir;
+  int result = im_image_lookup(image,path,&dir);
+  if (result != 0) {
+    return result;
+  }
+  if (!dir.is_dir) {
+    return -ENOTDIR;
+  }
+  map_filler f = { image, &dir, filler, data };
+  filler = map_and_fill;
+  data = &f;
+  im_index * index = g_atomic_pointer_get(&image->index);
+  if (index != NULL) {
+    while (*path == '/') path++;
+    result = im_index_readdir(index,path,&dir,filler,data);
+    if (result != IM_INDEX_MISS) {
+      return result;
+    }
+  }
+  // the whole directory is decoded from one read of its extent
+  im_dirlist * list;
+  result = im_dirlist_read(image->source,&dir,&list);
+  if (result != 0) {
+    return result;
+  }
+  for (guint idx = 0; idx < list->n_entries; idx++) {
+    const im_dirent * dirent = &list->entries[idx];
+    if (filler(data,IM_DIRENT_NAME(list,dirent),&dirent->entry) != 0) {
+      break;
+    }
+  }
+  im_dirlist_free(list);
+  return 0;
+}
+
+int im_image_map(im_image * image, const im_entry * entry, guint64 offset,
+		 guint64 size, GArray * runs) {
+  if (offset >= entry->size) {
+    return 0;
+  }
+  size = MIN(size,entry->size - offset);
+  if (!entry->fragmented) {
+    im_run run = { entry->offset + offset, size };
+    g_array_append_val(runs,run);
+    return 0;
+  }
+  const extmap * map = extmap_get(image,entry);
+  if (map == NULL) {
+    return -EIO;
+  }
+  // the last extent starting at or before offset
+  guint lo = 0, hi = map->n_runs;
+  while (hi - lo > 1) {
+    guint mid = lo + (hi - lo) / 2;
+    if (map->starts[mid] <= offset) lo = mid; else hi = mid;
+  }
+  for (guint idx = lo; size > 0 && idx < map->n_runs; idx++) {
+    guint64 skip = offset - map->starts[idx];
+    guint64 len = MIN(size,map->runs[idx].size - skip);
+    if (len == 0) {
+      continue;
+    }
+    im_run run = { map->runs[idx].offset + skip, len };
+    g_array_append_val(runs,run);
+    offset += len;
+    size -= len;
+  }
+  return 0;
+}
+
+/* read a piece of a file known to be within it */
+static int read_file(im_image * image, const im_entry * entry,
+		     gchar * buf, gsize size, guint64 offset) {
+  if (!entry->fragmented) {
+    return im_source_read(image->source,buf,size,entry->offset + offset);
+  }
+  GArray * runs = g_array_new(FALSE,FALSE,sizeof(im_run));
+  int result = im_image_map(image,entry,offset,size,runs);
+  for (guint idx = 0; result == 0 && idx < runs->len; idx++) {
+    const im_run * run = &g_array_index(runs,im_run,idx);
+    result = im_source_read(image->source,buf,run->size,run->offset);
+    buf += run->size;
+  }
+  g_array_free(runs,TRUE);
+  return result;
+}
+
+/*
+ * Read through the dedup store, one chunk of the file at a time.
+ * Chunks are counted from the start of the file, not of the image,
+ * so that a file moved to another place in another image still has
+ * the same chunks; they are known by where they start in the image.
+ */
+static int read_dedup(im_image * image, const im_entry * entry,
+		      gchar * buf, gsize size, guint64 offset) {
+  while (size > 0) {
+    guint64 start = offset - offset % IM_DEDUP_CHUNK_SIZE;
+    gsize chunk_size = MIN(IM_DEDUP_CHUNK_SIZE,entry->size - start);
+    gsize skip = offset - start;
+    gsize len = MIN(size,chunk_size - skip);
+    guint64 key = entry->offset + start;
+    if (entry->fragmented) {
+      GArray * runs = g_array_new(FALSE,FALSE,sizeof(im_run));
+      int result = im_image_map(image,entry,start,1,runs);
+      if (result == 0 && runs->len == 0) {
+	result = -EIO;
+      }
+      if (result == 0) {
+	key = g_array_index(runs,im_run,0).offset;
+      }
+      g_array_free(runs,TRUE);
+      if (result != 0) {
+	return result;
+      }
+    }
+    if (im_dedup_read(image->dedup,key,chunk_size,buf,len,skip) < 0) {
+      guint8 * data = g_malloc(chunk_size);
+      int result = read_file(image,entry,(gchar *) data,chunk_size,start);
+      if (result != 0) {
+	g_free(data);
+	return result;
+      }
+      memcpy(buf,data + skip,len);
+      im_dedup_admit(image->dedup,key,data,chunk_size);
+    }
+    buf += len;
+    offset += len;
+    size -= len;
+  }
+  return 0;
+}
+
+gssize im_image_read(im_image * image, const im_entry * entry,
+		     gchar * buf, gsize size, goffset offset) {
+  if (offset < 0) {
+    return -EINVAL;
+  }
+  if ((guint64) offset >= entry->size) {
+    return 0;
+  }
+  if (size > entry->size - offset) {
+    size = entry->size - offset;
+  }
+  int result = image->dedup != NULL ?
+    read_dedup(image,entry,buf,size,offset) :
+    read_file(image,entry,buf,size,offset);
+  return result == 0 ? (gssize) size : result;
+}
+
+/* how much of a file gets read ahead at open */
+#define WILLNEED_SIZE (8 * 1024 * 1024)
+
+static void advise_runs(im_image * image, const im_entry * entry, guint64 size,
+			im_advice advice) {
+  GArray * runs = g_array_new(FALSE,FALSE,sizeof(im_run));
+  if (im_image_map(image,entry,0,size,runs) == 0) {
+    for (guint idx = 0; idx < runs->len; idx++) {
+      const im_run * run = &g_array_index(runs,im_run,idx);
+      im_source_advise(image->source,run->offset,run->size,advice);
+    }
+  }
+  g_array_free(runs,TRUE);
+}
+
+void im_image_advise(im_image * image, const im_entry * entry, gboolean reading) {
+  if (entry->size == 0) {
+    return;
+  }
+  if (reading) {
+    advise_runs(image,entry,entry->size,IM_ADVICE_SEQUENTIAL);
+    advise_runs(image,entry,WILLNEED_SIZE,IM_ADVICE_WILLNEED);
+  } else {
+    advise_runs(image,entry,entry->size,IM_ADVICE_NORMAL);
+  }
+}
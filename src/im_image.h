@@ -0,0 +1,206 @@
+/* im_image.h - access to ISO9660 images, the libisomounter API
+ *
+ * Copyright (C) 2016 Leo Cacciari <leo.cacciari@gmail.com>
+ *
+ * This file belongs to the isomounter project.
+ * isomounter is free software and is distributed under the terms of the
+ * GNU GPL. See the file COPYING for details.
+ */
+#ifndef __IM_IMAGE_H__
+#define __IM_IMAGE_H__
+
+#include <glib.h>
+#include <sys/types.h>
+#include <time.h>
+
+/* for using in errors */
+typedef enum {
+  IM_ERROR_UNKNOWN,
+  IM_ERROR_IMAGE,
+  IM_ERROR_EXTRACT,
+  IM_ERROR_CLIENT, // the first code left to the programs using the library
+} im_error;
+
+GQuark im_error_quark();
+
+#define IM_ERROR_DOMAIN (im_error_quark())
+
+/**
+ * An open image. All the functions taking one can be called from
+ * any number of threads at the same time.
+ */
+typedef struct im_image_s im_image;
+
+/**
+ * What the library knows about a file or a directory. It's a plain
+ * value: copy it around as needed.
+ */
+typedef struct im_entry_s {
+  guint64 offset; // where the data starts, in bytes from image start
+  guint64 size;
+  time_t mtime;
+  gboolean is_dir;
+  // in several extents, not one after the other: see im_image_map()
+  gboolean fragmented;
+} im_entry;
+
+/* a contiguous piece of a file in the image */
+typedef struct im_run_s {
+  guint64 offset; // in bytes from image start
+  guint64 size;
+} im_run;
+
+/**
+ * Called by im_image_readdir() for each entry of a directory, "."
+ * and ".." excluded. Returning non zero stops the listing.
+ * It may call back into the library.
+ */
+typedef int (*im_dir_filler)(gpointer data, const gchar * name,
+			     const im_entry * entry);
+
+/**
+ * How to get at images that are slow to read. Zeroes give the
+ * defaults.
+ */
+typedef struct im_open_options_s {
+  gsize cache_size; // bytes of memory for the chunks of remote images
+  guint prefetch;   // chunks read ahead, in parallel, after the one read
+  const gchar * l2cache_dir; // where to keep blocks across mounts, or NULL
+  guint64 l2cache_size;      // bytes under l2cache_dir for this image
+  guint64 shm_cache_size;    // bytes shared with other mounts, 0 for none
+  gboolean mmap;             // map a local image file in memory
+  const gchar * dedup_dir;   // where to keep file contents once for all images, or NULL
+  guint64 dedup_size;        // bytes of them linked by this image
+  const guint8 * crypt_key;  // to decrypt the image with, or NULL
+  gsize crypt_key_size;      // 32 or 64 bytes, for AES-XTS 128 or 256
+  guint crypt_unit;          // bytes encrypted together, 512 to 4096
+} im_open_options;
+
+/* the memory an image keeps, in bytes */
+typedef struct im_budget_s {
+  gsize max;    // as opened
+  gsize budget; // what it may keep now
+  gsize used;
+} im_budget;
+
+/**
+ * Open the image at path. Returns NULL and sets error on failure.
+ * An image split in parts (path.000, path.001, ...) opens as one,
+ * from either path or path.000. A http:// or https:// URL is read
+ * with range requests, when the library is built with libcurl.
+ * With a crypt_key in options, the image is decrypted as it is read,
+ * when the library is built with libcrypto.
+ */
+im_image * im_image_open(const gchar * path, GError ** error);
+im_image * im_image_open_full(const gchar * path, const im_open_options * options,
+			      GError ** error);
+void im_image_close(im_image * image);
+
+/**
+ * Start decoding all the directories of image in the background,
+ * with n_threads threads. Lookups and listings keep working, and
+ * stop doing I/O for the directories as they get done. For very big
+ * images, where walking the tree on demand means a lot of small
+ * reads. Call it once.
+ */
+gboolean im_image_prescan(im_image * image, guint n_threads, GError ** error);
+
+/**
+ * What the caches of image keep in memory, and how much they may.
+ * FALSE if it has no cache whose size can change.
+ */
+gboolean im_image_get_budget(im_image * image, im_budget * budget);
+
+/**
+ * Let the caches of image keep up to bytes, within the size they were
+ * opened with and what they need to work; they drop what is over now.
+ */
+void im_image_set_budget(im_image * image, gsize bytes);
+
+/**
+ * Bytes of memory taken by what the prescan keeps, and the number
+ * of entries in there. Once the prescan is over, it is all packed in
+ * 16 bytes per entry plus the names, front coded.
+ */
+gsize im_image_index_memory(im_image * image, guint64 * n_entries);
+
+/**
+ * Append the index built by the prescan to out, for another process
+ * to take it with im_image_load_index() instead of scanning again.
+ * FALSE if there is no complete index yet. Load before prescanning.
+ */
+gboolean im_image_save_index(im_image * image, GByteArray * out);
+gboolean im_image_load_index(im_image * image, const guint8 * data, gsize size,
+			     GError ** error);
+
+/**
+ * A string telling this image apart from others, whatever its path:
+ * the same image read from a copy has the same identity.
+ */
+gchar * im_image_identity(im_image * image, GError ** error);
+
+const gchar * im_image_path(const im_image * image);
+/* in bytes */
+guint64 im_image_size(const im_image * image);
+
+/**
+ * File descriptor of the image, for whoever wants to read (or
+ * splice, or mmap) the data by itself at im_entry.offset, or where
+ * im_image_map() says for fragmented files. It is -1
+ * when the image isn't a single plain file, or its files are read
+ * through a dedup store: use im_image_read().
+ */
+int im_image_fd(const im_image * image);
+
+/*
+ * The functions below return 0 (or the number of bytes read)
+ * on success and a negated errno value on failure.
+ */
+
+/**
+ * Fill entry with the information about path, which is absolute
+ * and uses '/' as separator.
+ */
+int im_image_lookup(im_image * image, const gchar * path, im_entry * entry);
+
+/**
+ * Bytes and files under the directory at path, at any depth; files
+ * with more than one name count once per name. They are summed by the
+ * prescan: -EAGAIN until it is over. -ENOTDIR for a file.
+ */
+int im_image_totals(im_image * image, const gchar * path,
+		    guint64 * bytes, guint64 * files);
+
+/**
+ * Call filler for each entry of the directory at path.
+ */
+int im_image_readdir(im_image * image, const gchar * path,
+		     im_dir_filler filler, gpointer data);
+
+/**
+ * Read size bytes of the image itself, at offset.
+ */
+int im_image_pread(im_image * image, gpointer buf, gsize size, guint64 offset);
+
+/**
+ * Read up to size bytes from offset of the file described by entry.
+ * Returns less than size only at the end of file.
+ */
+gssize im_image_read(im_image * image, const im_entry * entry,
+		     gchar * buf, gsize size, goffset offset);
+
+/**
+ * Append to runs where size bytes from offset of the file described
+ * by entry are in the image, in order; size is cut at the end of the
+ * file. A file not fragmented is a single run.
+ */
+int im_image_map(im_image * image, const im_entry * entry, guint64 offset,
+		 guint64 size, GArray * runs);
+
+/**
+ * Hint that the file described by entry is about to be read from
+ * start to end, or, with reading FALSE, that it no longer is.
+ */
+void im_image_advise(im_image * image, const im_entry * entry, gboolean reading);
+
+#endif /*__IM_IMAGE_H__*/
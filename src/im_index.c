@@ -0,0 +1,287 @@
+/* im_index.c - the resident directory tree
+ *
+ * Copyright (C) 2016 Leo Cacciari <leo.cacciari@gmail.com>
+ *
+ * This file belongs to the isomounter project.
+ * isomounter is free software and is distributed under the terms of the
+ * GNU GPL. See the file COPYING for details.
+ */
+#include "common.h"
+#include "im_index.h"
+#include "im_tree.h"
+#include "im_wspool.h"
+
+/* lookups and the prescan threads hit different shards most of the time */
+#define INDEX_SHARDS 64
+
+typedef struct shard_s {
+  GRWLock lock;
+  GHashTable * dirs; // extent sector -> im_dirlist
+} shard;
+
+struct im_index_s {
+  im_source * source;
+  im_entry root;
+  shard shards[INDEX_SHARDS];
+  im_wspool * pool;
+  gint outstanding;  // directories pushed and not yet done
+  gint failed;
+  gint n_dirs;
+  gint n_entries;
+  gint64 started;
+  im_tree * tree;    // set once, when the prescan is over
+  gint dir_users;    // threads that may be reading a decoded directory
+};
+
+static shard * shard_of(im_index * index, guint32 sector) {
+  return &index->shards[(sector * 2654435761u) >> 26];
+}
+
+static const im_dirlist * lookup(im_index * index, guint32 sector) {
+  shard * s = shard_of(index,sector);
+  g_rw_lock_reader_lock(&s->lock);
+  const im_dirlist * list = g_hash_table_lookup(s->dirs,GUINT_TO_POINTER(sector));
+  g_rw_lock_reader_unlock(&s->lock);
+  return list;
+}
+
+static const im_dirlist * tree_dir(gpointer data, guint64 offset) {
+  return lookup((im_index *) data,offset / IM_SECTOR_SIZE);
+}
+
+/*
+ * The decoded directories go away once the tree is there: whoever
+ * reads them does it between dirs_enter() and dirs_leave(), so that
+ * they are freed only when nobody is left.
+ */
+static gboolean dirs_enter(im_index * index) {
+  g_atomic_int_inc(&index->dir_users);
+  if (g_atomic_pointer_get(&index->tree) != NULL) {
+    g_atomic_int_add(&index->dir_users,-1);
+    return FALSE;
+  }
+  return TRUE;
+}
+
+static void dirs_leave(im_index * index) {
+  g_atomic_int_add(&index->dir_users,-1);
+}
+
+/* publish list unless someone did it first; FALSE if list wasn't taken */
+static gboolean publish(im_index * index, guint32 sector, im_dirlist * list) {
+  shard * s = shard_of(index,sector);
+  g_rw_lock_writer_lock(&s->lock);
+  gboolean taken = !g_hash_table_contains(s->dirs,GUINT_TO_POINTER(sector));
+  if (taken) {
+    g_hash_table_insert(s->dirs,GUINT_TO_POINTER(sector),list);
+  }
+  g_rw_lock_writer_unlock(&s->lock);
+  return taken;
+}
+
+/* pack the decoded directories in a tree, then drop them */
+static void build_tree(im_index * index) {
+  gsize before = im_index_memory(index,NULL);
+  im_tree * tree = im_tree_build(&index->root,tree_dir,index);
+  if (tree == NULL) {
+    g_warning("prescan: the directory tree is incomplete");
+    return;
+  }
+  g_atomic_pointer_set(&index->tree,tree);
+  while (g_atomic_int_get(&index->dir_users) > 0) {
+    g_usleep(1000);
+  }
+  for (guint idx = 0; idx < INDEX_SHARDS; idx++) {
+    g_rw_lock_writer_lock(&index->shards[idx].lock);
+    g_hash_table_remove_all(index->shards[idx].dirs);
+    g_rw_lock_writer_unlock(&index->shards[idx].lock);
+  }
+  g_message("index of %u entries takes %" G_GSIZE_FORMAT " KiB (%" G_GSIZE_FORMAT
+	    " KiB decoded)",tree->n_nodes - 1,im_tree_memory(tree) / 1024,before / 1024);
+}
+
+static void push_dir(im_index * index, const im_entry * dir) {
+  im_entry * task = g_new(im_entry,1);
+  *task = *dir;
+  g_atomic_int_inc(&index->outstanding);
+  im_wspool_push(index->pool,task);
+}
+
+/* a task: decode one directory extent, then queue its subdirectories */
+static void scan_dir(im_wspool * pool, gpointer task, gpointer data) {
+  im_index * index = (im_index *) data;
+  im_entry * dir = (im_entry *) task;
+  guint32 sector = dir->offset / IM_SECTOR_SIZE;
+  im_dirlist * list;
+  // a directory seen twice (a broken image, or a loop) is done once
+  if (lookup(index,sector) == NULL) {
+    int result = im_dirlist_read(index->source,dir,&list);
+    if (result != 0) {
+      g_debug("prescan: directory at %" G_GUINT64_FORMAT ": %s",
+	      dir->offset,g_strerror(-result));
+      g_atomic_int_set(&index->failed,TRUE);
+    } else if (!publish(index,sector,list)) {
+      im_dirlist_free(list);
+    } else {
+      g_atomic_int_inc(&index->n_dirs);
+      g_atomic_int_add(&index->n_entries,list->n_entries);
+      for (guint idx = 0; idx < list->n_entries; idx++) {
+	if (list->entries[idx].entry.is_dir) {
+	  push_dir(index,&list->entries[idx].entry);
+	}
+      }
+    }
+  }
+  g_free(dir);
+  if (g_atomic_int_dec_and_test(&index->outstanding)) {
+    g_debug("prescan: %d directories, %d entries in %" G_GINT64_FORMAT " ms",
+	    g_atomic_int_get(&index->n_dirs),g_atomic_int_get(&index->n_entries),
+	    (g_get_monotonic_time() - index->started) / 1000);
+    if (g_atomic_int_get(&index->failed)) {
+      g_warning("prescan of the image left some directories out");
+    } else {
+      build_tree(index);
+    }
+  }
+}
+
+static im_index * index_new(im_source * source, const im_entry * root) {
+  im_index * index = g_new0(im_index,1);
+  index->source = source;
+  index->root = *root;
+  for (guint idx = 0; idx < INDEX_SHARDS; idx++) {
+    g_rw_lock_init(&index->shards[idx].lock);
+    index->shards[idx].dirs =
+      g_hash_table_new_full(g_direct_hash,g_direct_equal,NULL,
+			    (GDestroyNotify) im_dirlist_free);
+  }
+  return index;
+}
+
+im_index * im_index_prescan(im_source * source, const im_entry * root,
+			    guint n_threads, GError ** error) {
+  im_index * index = index_new(source,root);
+  index->started = g_get_monotonic_time();
+  index->pool = im_wspool_new(n_threads,scan_dir,g_free,index);
+  push_dir(index,root);
+  if (!im_wspool_start(index->pool,error)) {
+    im_index_free(index);
+    return NULL;
+  }
+  return index;
+}
+
+im_index * im_index_load(im_source * source, const im_entry * root,
+			 const guint8 * data, gsize size) {
+  im_tree * tree = im_tree_load(data,size);
+  if (tree == NULL) {
+    return NULL;
+  }
+  im_index * index = index_new(source,root);
+  index->tree = tree;
+  return index;
+}
+
+gboolean im_index_save(im_index * index, GByteArray * out) {
+  const im_tree * tree = g_atomic_pointer_get(&index->tree);
+  if (tree == NULL) {
+    return FALSE;
+  }
+  im_tree_save(tree,out);
+  return TRUE;
+}
+
+void im_index_free(im_index * index) {
+  if (index == NULL) {
+    return;
+  }
+  if (index->pool != NULL) {
+    im_wspool_cancel(index->pool);
+    im_wspool_free(index->pool);
+  }
+  for (guint idx = 0; idx < INDEX_SHARDS; idx++) {
+    g_hash_table_destroy(index->shards[idx].dirs);
+    g_rw_lock_clear(&index->shards[idx].lock);
+  }
+  im_tree_free(index->tree);
+  g_free(index);
+}
+
+int im_index_lookup(im_index * index, const gchar * path, im_entry * entry) {
+  const im_tree * tree = g_atomic_pointer_get(&index->tree);
+  return tree != NULL ? im_tree_lookup(tree,path,entry) : IM_INDEX_MISS;
+}
+
+int im_index_totals(im_index * index, const gchar * path, im_tree_total * total) {
+  const im_tree * tree = g_atomic_pointer_get(&index->tree);
+  if (tree == NULL) {
+    return IM_INDEX_MISS;
+  }
+  return im_tree_totals(tree,path,total);
+}
+
+int im_index_find(im_index * index, const im_entry * dir,
+		  const gchar * name, gsize len, im_entry * entry) {
+  if (!dirs_enter(index)) {
+    return IM_INDEX_MISS;
+  }
+  int result = IM_INDEX_MISS;
+  const im_dirlist * list = lookup(index,dir->offset / IM_SECTOR_SIZE);
+  if (list != NULL) {
+    const im_dirent * dirent = im_dirlist_find(list,name,len);
+    if (dirent != NULL) {
+      *entry = dirent->entry;
+      result = 0;
+    } else {
+      result = -ENOENT;
+    }
+  }
+  dirs_leave(index);
+  return result;
+}
+
+int im_index_readdir(im_index * index, const gchar * path, const im_entry * dir,
+		     im_dir_filler filler, gpointer data) {
+  const im_tree * tree = g_atomic_pointer_get(&index->tree);
+  if (tree != NULL) {
+    return im_tree_readdir(tree,path,filler,data);
+  }
+  if (!dirs_enter(index)) {
+    return IM_INDEX_MISS;
+  }
+  int result = IM_INDEX_MISS;
+  const im_dirlist * list = lookup(index,dir->offset / IM_SECTOR_SIZE);
+  if (list != NULL) {
+    for (guint idx = 0; idx < list->n_entries; idx++) {
+      const im_dirent * dirent = &list->entries[idx];
+      if (filler(data,IM_DIRENT_NAME(list,dirent),&dirent->entry) != 0) {
+	break;
+      }
+    }
+    result = 0;
+  }
+  dirs_leave(index);
+  return result;
+}
+
+gsize im_index_memory(im_index * index, guint64 * n_entries) {
+  const im_tree * tree = g_atomic_pointer_get(&index->tree);
+  if (tree != NULL) {
+    if (n_entries != NULL) *n_entries = tree->n_nodes - 1;
+    return sizeof(im_index) + im_tree_memory(tree);
+  }
+  gsize total = sizeof(im_index);
+  for (guint idx = 0; idx < INDEX_SHARDS; idx++) {
+    shard * s = &index->shards[idx];
+    g_rw_lock_reader_lock(&s->lock);
+    GHashTableIter iter;
+    gpointer list;
+    g_hash_table_iter_init(&iter,s->dirs);
+    while (g_hash_table_iter_next(&iter,NULL,&list)) {
+      total += ((const im_dirlist *) list)->size;
+    }
+    g_rw_lock_reader_unlock(&s->lock);
+  }
+  if (n_entries != NULL) *n_entries = g_atomic_int_get(&index->n_entries);
+  return total;
+}
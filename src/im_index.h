@@ -0,0 +1,79 @@
+/* im_index.h - the resident directory tree
+ *
+ * Copyright (C) 2016 Leo Cacciari <leo.cacciari@gmail.com>
+ *
+ * This file belongs to the isomounter project.
+ * isomounter is free software and is distributed under the terms of the
+ * GNU GPL. See the file COPYING for details.
+ */
+#ifndef __IM_INDEX_H__
+#define __IM_INDEX_H__
+#include "common.h"
+#include "im_dirrec.h"
+#include "im_tree.h"
+
+/**
+ * The decoded directories of an image, keyed by extent. The prescan
+ * fills it from a pool of threads while lookups read it: a directory
+ * is published once, decoded, and never changes after that. When
+ * all of them are in, they are packed in an im_tree, which takes
+ * their place.
+ */
+typedef struct im_index_s im_index;
+
+/* returned when the index can't answer (yet) */
+#define IM_INDEX_MISS 1
+
+/**
+ * Start decoding every directory under root with n_threads threads.
+ * The index is usable (and partial) right away.
+ */
+im_index * im_index_prescan(im_source * source, const im_entry * root,
+			    guint n_threads, GError ** error);
+
+/**
+ * An index made of the tree another process built and saved with
+ * im_index_save(), which returns FALSE if the tree isn't built yet.
+ * im_index_load() returns NULL if data isn't a tree.
+ */
+im_index * im_index_load(im_source * source, const im_entry * root,
+			 const guint8 * data, gsize size);
+gboolean im_index_save(im_index * index, GByteArray * out);
+
+/**
+ * Stop the prescan if it is running and free index.
+ */
+void im_index_free(im_index * index);
+
+/*
+ * The functions below are those of im_image.h, or IM_INDEX_MISS.
+ */
+
+/**
+ * Works once the tree is built.
+ */
+int im_index_lookup(im_index * index, const gchar * path, im_entry * entry);
+
+/**
+ * What is under the directory at path, once the tree is built.
+ */
+int im_index_totals(im_index * index, const gchar * path, im_tree_total * total);
+
+/**
+ * Look for name in dir, if it's decoded already.
+ */
+int im_index_find(im_index * index, const im_entry * dir,
+		  const gchar * name, gsize len, im_entry * entry);
+
+/**
+ * List dir, at path, if it's decoded already.
+ */
+int im_index_readdir(im_index * index, const gchar * path, const im_entry * dir,
+		     im_dir_filler filler, gpointer data);
+
+/**
+ * Memory used by index, and the number of entries in it.
+ */
+gsize im_index_memory(im_index * index, guint64 * n_entries);
+
+#endif /*__IM_INDEX_H__*/
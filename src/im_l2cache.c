@@ -0,0 +1,356 @@
+/* im_l2cache.c - a cache of image blocks on a local disk
+ *
+ * Copyright (C) 2016 Leo Cacciari <leo.cacciari@gmail.com>
+ *
+ * This file belongs to the isomounter project.
+ * isomounter is free software and is distributed under the terms of the
+ * GNU GPL. See the file COPYING for details.
+ */
+#include "common.h"
+#include "im_source.h"
+#include "im_dirrec.h"
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <glib/gstdio.h>
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+/* in sectors: 256 KiB */
+#define L2_BLOCK_SECTORS 128
+#define L2_BLOCK_SIZE (L2_BLOCK_SECTORS * IM_SECTOR_SIZE)
+/* blocks waiting to be written; past this, misses aren't kept */
+#define L2_MAX_PENDING 64
+#define L2_TMP_PREFIX ".tmp-"
+/* in seconds: younger temporaries may be another mount's writes */
+#define L2_TMP_GRACE 3600
+
+/*
+ * Each block of the image is a file in a directory of its own, named
+ * after the image contents, so that it is found again at the next
+ * mount whatever the path. Files are named after the first sector
+ * (LSN) of the block they hold.
+ *
+ * A block is written to a temporary file, synced, then renamed in
+ * place and the directory synced: after a crash a block file is
+ * either whole or missing. Temporaries left behind are removed at a
+ * later open, once they are older than any write of a live mount
+ * could be. Writes are done by a thread of their own, off the read
+ * path.
+ *
+ * Only this mount's view of which blocks are there is kept in
+ * memory: a block evicted by another mount of the same image shows
+ * up as a failed open, and is read from the image again.
+ */
+typedef struct l2_block_s {
+  guint32 lsn;
+  gsize size;
+  GList link; // in the LRU list
+} l2_block;
+
+typedef struct l2_write_s {
+  guint32 lsn;
+  gsize size;
+  guint8 * data;
+} l2_write;
+
+typedef struct l2cache_source_s {
+  im_source base;
+  im_source * inner;
+  gchar * dir;
+  int dir_fd;          // to sync renames in it, or -1
+  guint64 capacity;
+  GMutex lock;         // for all the fields below
+  guint64 used;
+  GHashTable * blocks; // lsn -> l2_block
+  GHashTable * pending; // lsns being written
+  GQueue lru;          // most recent first
+  GThreadPool * writer;
+} l2cache_source;
+
+static gchar * block_path(l2cache_source * l2, guint32 lsn) {
+  gchar name[16];
+  g_snprintf(name,sizeof(name),"%08x",lsn);
+  return g_build_filename(l2->dir,name,NULL);
+}
+
+/* how long the block at lsn is; the last one is shorter */
+static gsize block_size(l2cache_source * l2, guint32 lsn) {
+  guint64 start = (guint64) lsn * IM_SECTOR_SIZE;
+  return MIN(L2_BLOCK_SIZE,l2->base.size - start);
+}
+
+static void block_free(gpointer data) {
+  g_free(data);
+}
+
+/* called with the lock held */
+static void block_add(l2cache_source * l2, guint32 lsn, gsize size) {
+  l2_block * block = g_new0(l2_block,1);
+  block->lsn = lsn;
+  block->size = size;
+  block->link.data = block;
+  g_hash_table_insert(l2->blocks,GUINT_TO_POINTER(lsn),block);
+  g_queue_push_head_link(&l2->lru,&block->link);
+  l2->used += size;
+}
+
+/* called with the lock held */
+static void block_forget(l2cache_source * l2, l2_block * block, gboolean unlink) {
+  if (unlink) {
+    gchar * path = block_path(l2,block->lsn);
+    g_unlink(path);
+    g_free(path);
+  }
+  g_queue_unlink(&l2->lru,&block->link);
+  l2->used -= block->size;
+  g_hash_table_remove(l2->blocks,GUINT_TO_POINTER(block->lsn));
+}
+
+/* make room for size more bytes; called with the lock held */
+static void evict(l2cache_source * l2, gsize size) {
+  while (l2->used + size > l2->capacity && l2->lru.tail != NULL) {
+    block_forget(l2,(l2_block *) l2->lru.tail->data,TRUE);
+  }
+}
+
+static gboolean write_all(int fd, const guint8 * data, gsize size) {
+  while (size > 0) {
+    ssize_t n = write(fd,data,size);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return FALSE;
+    data += n;
+    size -= n;
+  }
+  return TRUE;
+}
+
+/* the writer thread: store one block */
+static void write_block(gpointer data, gpointer user_data) {
+  l2cache_source * l2 = (l2cache_source *) user_data;
+  l2_write * w = (l2_write *) data;
+  gchar * tmp = g_build_filename(l2->dir,L2_TMP_PREFIX "XXXXXX",NULL);
+  gchar * path = block_path(l2,w->lsn);
+  gboolean ok = FALSE;
+  int fd = g_mkstemp(tmp);
+  if (fd >= 0) {
+    ok = write_all(fd,w->data,w->size) && fdatasync(fd) == 0;
+    ok = close(fd) == 0 && ok;
+  }
+  g_mutex_lock(&l2->lock);
+  if (ok) {
+    evict(l2,w->size);
+    ok = g_rename(tmp,path) == 0;
+  }
+  if (ok && g_hash_table_lookup(l2->blocks,GUINT_TO_POINTER(w->lsn)) == NULL) {
+    block_add(l2,w->lsn,w->size);
+  }
+  g_hash_table_remove(l2->pending,GUINT_TO_POINTER(w->lsn));
+  g_mutex_unlock(&l2->lock);
+  // the rename itself must be on disk for the block to be
+  if (ok && l2->dir_fd >= 0) {
+    fsync(l2->dir_fd);
+  }
+  if (!ok) {
+    g_debug("l2 cache: block %08x not kept: %s",w->lsn,g_strerror(errno));
+    if (fd >= 0) g_unlink(tmp);
+  }
+  g_free(tmp);
+  g_free(path);
+  g_free(w->data);
+  g_free(w);
+}
+
+/* queue a block read from the image to be kept, unless too many are;
+ * takes data */
+static void admit(l2cache_source * l2, guint32 lsn, guint8 * data, gsize size) {
+  g_mutex_lock(&l2->lock);
+  gboolean take = size <= l2->capacity &&
+    g_hash_table_size(l2->pending) < L2_MAX_PENDING &&
+    !g_hash_table_contains(l2->pending,GUINT_TO_POINTER(lsn));
+  if (take) {
+    g_hash_table_add(l2->pending,GUINT_TO_POINTER(lsn));
+  }
+  g_mutex_unlock(&l2->lock);
+  if (take) {
+    l2_write * w = g_new(l2_write,1);
+    w->lsn = lsn;
+    w->size = size;
+    w->data = data;
+    g_thread_pool_push(l2->writer,w,NULL);
+  } else {
+    g_free(data);
+  }
+}
+
+/* read from the block file at lsn; returns -ENOENT if it isn't there */
+static gssize read_hit(l2cache_source * l2, guint32 lsn, gpointer buf, gsize size,
+		       gsize skip) {
+  g_mutex_lock(&l2->lock);
+  l2_block * block = g_hash_table_lookup(l2->blocks,GUINT_TO_POINTER(lsn));
+  if (block != NULL) {
+    g_queue_unlink(&l2->lru,&block->link);
+    g_queue_push_head_link(&l2->lru,&block->link);
+  }
+  g_mutex_unlock(&l2->lock);
+  if (block == NULL) {
+    return -ENOENT;
+  }
+  gchar * path = block_path(l2,lsn);
+  int fd = open(path,O_RDONLY | O_CLOEXEC);
+  g_free(path);
+  ssize_t n = -1;
+  if (fd >= 0) {
+    do {
+      n = pread(fd,buf,size,skip);
+    } while (n < 0 && errno == EINTR);
+    close(fd);
+  }
+  if (n != (ssize_t) size) {
+    // gone, or cut short: forget it, the image has the data
+    g_mutex_lock(&l2->lock);
+    block = g_hash_table_lookup(l2->blocks,GUINT_TO_POINTER(lsn));
+    if (block != NULL) {
+      block_forget(l2,block,fd >= 0);
+    }
+    g_mutex_unlock(&l2->lock);
+    return -ENOENT;
+  }
+  return n;
+}
+
+static gssize l2_pread(im_source * source, gpointer buf, gsize size,
+		       guint64 offset) {
+  l2cache_source * l2 = (l2cache_source *) source;
+  guint8 * data = (guint8 *) buf;
+  gsize done = 0;
+  while (done < size && offset < source->size) {
+    guint32 lsn = (offset / L2_BLOCK_SIZE) * L2_BLOCK_SECTORS;
+    gsize skip = offset % L2_BLOCK_SIZE;
+    gsize len = MIN(size - done,block_size(l2,lsn) - skip);
+    if (read_hit(l2,lsn,data + done,len,skip) < 0) {
+      // a whole block from the image, so that it can be kept
+      gsize bsize = block_size(l2,lsn);
+      guint8 * block = g_malloc(bsize);
+      int result = im_source_read(l2->inner,block,bsize,(guint64) lsn * IM_SECTOR_SIZE);
+      if (result != 0) {
+	g_free(block);
+	return done > 0 ? (gssize) done : result;
+      }
+      memcpy(data + done,block + skip,len);
+      admit(l2,lsn,block,bsize);
+    }
+    done += len;
+    offset += len;
+  }
+  return done;
+}
+
+static void l2_close(im_source * source) {
+  l2cache_source * l2 = (l2cache_source *) source;
+  // let the blocks on their way get there
+  g_thread_pool_free(l2->writer,FALSE,TRUE);
+  g_hash_table_destroy(l2->blocks);
+  g_hash_table_destroy(l2->pending);
+  g_mutex_clear(&l2->lock);
+  if (l2->dir_fd >= 0) close(l2->dir_fd);
+  g_free(l2->dir);
+  im_source_close(l2->inner);
+}
+
+static const im_source_ops l2_ops = {
+  .pread = l2_pread,
+  .close = l2_close,
+};
+
+typedef struct l2_found_s {
+  guint32 lsn;
+  gsize size;
+  gint64 mtime;
+} l2_found;
+
+static gint by_mtime(gconstpointer a, gconstpointer b) {
+  gint64 ma = ((const l2_found *) a)->mtime, mb = ((const l2_found *) b)->mtime;
+  return ma < mb ? -1 : ma > mb;
+}
+
+/* pick up the blocks kept by earlier mounts, oldest first in the LRU */
+static void load_blocks(l2cache_source * l2) {
+  GDir * dir = g_dir_open(l2->dir,0,NULL);
+  if (dir == NULL) {
+    return;
+  }
+  GArray * found = g_array_new(FALSE,FALSE,sizeof(l2_found));
+  gint64 now = g_get_real_time() / G_USEC_PER_SEC;
+  const gchar * name;
+  while ((name = g_dir_read_name(dir)) != NULL) {
+    gchar * path = g_build_filename(l2->dir,name,NULL);
+    gchar * end = NULL;
+    guint64 lsn = g_ascii_strtoull(name,&end,16);
+    struct stat st;
+    if (g_str_has_prefix(name,L2_TMP_PREFIX)) {
+      // a write cut short, unless it is still going on
+      if (g_stat(path,&st) == 0 && now - st.st_mtime > L2_TMP_GRACE) {
+	g_unlink(path);
+      }
+      g_free(path);
+      continue;
+    }
+    gboolean keep = end != name && *end == '\0' && lsn % L2_BLOCK_SECTORS == 0 &&
+      lsn * IM_SECTOR_SIZE < l2->base.size &&
+      g_stat(path,&st) == 0 && S_ISREG(st.st_mode) &&
+      (gsize) st.st_size == block_size(l2,lsn);
+    if (keep) {
+      l2_found f = { lsn, st.st_size, st.st_mtime };
+      g_array_append_val(found,f);
+    } else {
+      // not ours
+      g_unlink(path);
+    }
+    g_free(path);
+  }
+  g_dir_close(dir);
+  g_array_sort(found,by_mtime);
+  for (guint idx = 0; idx < found->len; idx++) {
+    l2_found * f = &g_array_index(found,l2_found,idx);
+    block_add(l2,f->lsn,f->size);
+  }
+  evict(l2,0);
+  g_debug("l2 cache %s: %u blocks, %" G_GUINT64_FORMAT " KiB",
+	  l2->dir,g_hash_table_size(l2->blocks),l2->used / 1024);
+  g_array_free(found,TRUE);
+}
+
+im_source * im_l2cache_source_new(im_source * inner, const gchar * dir,
+				  guint64 size, GError ** error) {
+  gchar * identity = im_source_identity(inner,error);
+  if (identity == NULL) {
+    return NULL;
+  }
+  gchar * path = g_build_filename(dir,identity,NULL);
+  g_free(identity);
+  if (g_mkdir_with_parents(path,0700) != 0) {
+    g_set_error(error,IM_ERROR_DOMAIN,IM_ERROR_IMAGE,
+		"can't create cache directory %s: %s",path,g_strerror(errno));
+    g_free(path);
+    return NULL;
+  }
+  l2cache_source * l2 = g_new0(l2cache_source,1);
+  l2->base.ops = &l2_ops;
+  l2->base.name = g_strdup(inner->name);
+  l2->base.size = inner->size;
+  l2->base.version = g_strdup(inner->version);
+  l2->base.fd = -1;
+  l2->inner = inner;
+  l2->dir = path;
+  l2->dir_fd = open(path,O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  l2->capacity = size;
+  g_mutex_init(&l2->lock);
+  l2->blocks = g_hash_table_new_full(g_direct_hash,g_direct_equal,NULL,block_free);
+  l2->pending = g_hash_table_new(g_direct_hash,g_direct_equal);
+  g_queue_init(&l2->lru);
+  load_blocks(l2);
+  l2->writer = g_thread_pool_new(write_block,l2,1,FALSE,NULL);
+  return &l2->base;
+}
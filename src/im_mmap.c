@@ -0,0 +1,106 @@
+/* im_mmap.c - images mapped in memory
+ *
+ * Copyright (C) 2016 Leo Cacciari <leo.cacciari@gmail.com>
+ *
+ * This file belongs to the isomounter project.
+ * isomounter is free software and is distributed under the terms of the
+ * GNU GPL. See the file COPYING for details.
+ */
+#include "common.h"
+#include "im_source.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+/*
+ * The whole image is mapped read only, and a read is a copy from the
+ * mapping: no system call when the pages are in memory, as they are
+ * for images on tmpfs or recently read. A file shrinking under the
+ * mapping gets the process a SIGBUS, as with any mapped file.
+ */
+typedef struct mmap_source_s {
+  im_source base;
+  guint8 * map;
+  gsize page_size;
+} mmap_source;
+
+static gssize mmap_pread(im_source * source, gpointer buf, gsize size,
+			 guint64 offset) {
+  mmap_source * m = (mmap_source *) source;
+  if (offset >= source->size) {
+    return 0;
+  }
+  gsize n = MIN(size,source->size - offset);
+  memcpy(buf,m->map + offset,n);
+  return n;
+}
+
+static int mmap_advise(im_source * source, guint64 offset, guint64 size,
+		       im_advice advice) {
+  mmap_source * m = (mmap_source *) source;
+  if (offset >= source->size || size == 0) {
+    return 0;
+  }
+  size = MIN(size,source->size - offset);
+  // madvise wants the start aligned to a page
+  guint64 start = offset - offset % m->page_size;
+  int how = MADV_NORMAL;
+  switch (advice) {
+  case IM_ADVICE_SEQUENTIAL: how = MADV_SEQUENTIAL; break;
+  case IM_ADVICE_WILLNEED: how = MADV_WILLNEED; break;
+  default: break;
+  }
+  return madvise(m->map + start,offset + size - start,how) == 0 ? 0 : -errno;
+}
+
+static void mmap_close(im_source * source) {
+  mmap_source * m = (mmap_source *) source;
+  munmap(m->map,source->size);
+}
+
+static const im_source_ops mmap_ops = {
+  .pread = mmap_pread,
+  .advise = mmap_advise,
+  .close = mmap_close,
+};
+
+im_source * im_mmap_source_open(const gchar * path, GError ** error) {
+  int fd = open(path,O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd < 0 || fstat(fd,&st) != 0) {
+    g_set_error(error,IM_ERROR_DOMAIN,IM_ERROR_IMAGE,
+		"failed to open image at %s: %s",path,g_strerror(errno));
+    if (fd >= 0) close(fd);
+    return NULL;
+  }
+  if (st.st_size == 0 || (guint64) st.st_size > G_MAXSIZE) {
+    g_set_error(error,IM_ERROR_DOMAIN,IM_ERROR_IMAGE,
+		"can't map image at %s of %" G_GUINT64_FORMAT " bytes",
+		path,(guint64) st.st_size);
+    close(fd);
+    return NULL;
+  }
+  gpointer map = mmap(NULL,st.st_size,PROT_READ,MAP_SHARED,fd,0);
+  int saved = errno;
+  // the mapping holds on to the file
+  close(fd);
+  if (map == MAP_FAILED) {
+    g_set_error(error,IM_ERROR_DOMAIN,IM_ERROR_IMAGE,
+		"failed to map image at %s: %s",path,g_strerror(saved));
+    return NULL;
+  }
+  mmap_source * m = g_new0(mmap_source,1);
+  m->base.ops = &mmap_ops;
+  m->base.name = g_strdup(path);
+  m->base.size = st.st_size;
+  m->base.version = im_stat_version(&st);
+  // reads are copies from the mapping: nothing to splice from
+  m->base.fd = -1;
+  m->map = map;
+  m->page_size = sysconf(_SC_PAGESIZE);
+  return &m->base;
+}
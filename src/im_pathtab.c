@@ -0,0 +1,130 @@
+/* im_pathtab.c - the ISO9660 path table
+ *
+ * Copyright (C) 2016 Leo Cacciari <leo.cacciari@gmail.com>
+ *
+ * This file belongs to the isomounter project.
+ * isomounter is free software and is distributed under the terms of the
+ * GNU GPL. See the file COPYING for details.
+ */
+#include "common.h"
+#include "im_pathtab.h"
+#include "im_dirrec.h"
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+static guint32 read32(const guint8 * p, gboolean big_endian) {
+  return big_endian ?
+    ((guint32) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3] :
+    p[0] | (p[1] << 8) | (p[2] << 16) | ((guint32) p[3] << 24);
+}
+
+static guint16 read16(const guint8 * p, gboolean big_endian) {
+  return big_endian ? (p[0] << 8) | p[1] : p[0] | (p[1] << 8);
+}
+
+static gsize record_size(const guint8 * rec) {
+  return PT_NAME + rec[PT_NAME_LEN] + (rec[PT_NAME_LEN] & 1);
+}
+
+im_pathtab * im_pathtab_load(im_source * source, guint64 offset, gsize size,
+			     gboolean big_endian) {
+  if (size < PT_NAME + 1) {
+    return NULL;
+  }
+  guint8 * data = g_malloc(size);
+  if (im_source_read(source,data,size,offset) != 0) {
+    g_free(data);
+    return NULL;
+  }
+  // first pass: count the records and the room for their names
+  guint n_dirs = 0;
+  gsize names_size = 0;
+  gsize pos = 0;
+  while (pos + PT_NAME < size && data[pos + PT_NAME_LEN] != 0 &&
+	 pos + record_size(data + pos) <= size) {
+    n_dirs++;
+    names_size += data[pos + PT_NAME_LEN] + 1;
+    pos += record_size(data + pos);
+  }
+  if (n_dirs == 0 || n_dirs > PT_MAX_DIRS) {
+    g_free(data);
+    return NULL;
+  }
+  im_pathtab * table = g_new0(im_pathtab,1);
+  table->n_dirs = n_dirs;
+  table->extent = g_new(guint32,n_dirs);
+  table->parent = g_new(guint32,n_dirs);
+  table->name = g_new(guint32,n_dirs);
+  table->names = g_malloc(names_size);
+  guint32 n_buckets = 1;
+  while (n_buckets < 2 * n_dirs) n_buckets <<= 1;
+  table->mask = n_buckets - 1;
+  table->buckets = g_new0(guint32,n_buckets);
+  // second pass: fill the table and the index
+  gboolean ok = TRUE;
+  gsize name = 0;
+  pos = 0;
+  for (guint idx = 0; idx < n_dirs && ok; idx++) {
+    const guint8 * rec = data + pos;
+    table->extent[idx] = read32(rec + PT_EXTENT,big_endian);
+    // records are sorted so that parents come first
+    guint32 parent = read16(rec + PT_PARENT,big_endian);
+    if (parent == 0 || (idx > 0 && parent > idx)) {
+      ok = FALSE;
+      break;
+    }
+    table->parent[idx] = parent - 1;
+    table->name[idx] = name;
+    gsize len = 0;
+    if (idx > 0) {
+      len = im_name_translate((const gchar *) rec + PT_NAME,rec[PT_NAME_LEN],
+			      table->names + name);
+      guint32 bucket = im_name_hash(parent - 1,table->names + name,len) & table->mask;
+      while (table->buckets[bucket] != 0) {
+	bucket = (bucket + 1) & table->mask;
+      }
+      table->buckets[bucket] = idx + 1;
+    } else {
+      table->names[name] = '\0';
+    }
+    name += len + 1;
+    pos += record_size(rec);
+  }
+  g_free(data);
+  if (!ok) {
+    im_pathtab_free(table);
+    return NULL;
+  }
+  return table;
+}
+
+void im_pathtab_free(im_pathtab * table) {
+  if (table != NULL) {
+    g_free(table->extent);
+    g_free(table->parent);
+    g_free(table->name);
+    g_free(table->names);
+    g_free(table->buckets);
+    g_free(table);
+  }
+}
+
+gint im_pathtab_child(const im_pathtab * table, guint parent,
+		      const gchar * name, gsize len) {
+  guint32 bucket = im_name_hash(parent,name,len) & table->mask;
+  for (;;) {
+    guint32 slot = table->buckets[bucket];
+    if (slot == 0) {
+      return -1;
+    }
+    guint idx = slot - 1;
+    const gchar * candidate = table->names + table->name[idx];
+    if (table->parent[idx] == parent &&
+	strncmp(candidate,name,len) == 0 && candidate[len] == '\0') {
+      return idx;
+    }
+    bucket = (bucket + 1) & table->mask;
+  }
+}
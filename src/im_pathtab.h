@@ -0,0 +1,55 @@
+/* im_pathtab.h - the ISO9660 path table
+ *
+ * Copyright (C) 2016 Leo Cacciari <leo.cacciari@gmail.com>
+ *
+ * This file belongs to the isomounter project.
+ * isomounter is free software and is distributed under the terms of the
+ * GNU GPL. See the file COPYING for details.
+ */
+#ifndef __IM_PATHTAB_H__
+#define __IM_PATHTAB_H__
+#include "common.h"
+#include "im_source.h"
+
+/* path table record layout (ECMA-119 9.4) */
+#define PT_NAME_LEN 0
+#define PT_EXTENT 2
+#define PT_PARENT 6
+#define PT_NAME 8
+
+/* parent numbers are 16 bits: bigger tables can't be trusted */
+#define PT_MAX_DIRS 65535
+
+/**
+ * Every directory of the image with its extent, indexed by
+ * (parent, name) so that a directory path resolves with one hash
+ * probe per component and no I/O. Directory 0 is the root.
+ */
+typedef struct im_pathtab_s {
+  guint n_dirs;
+  guint32 * extent; // in sectors
+  guint32 * parent;
+  guint32 * name;   // offset of the translated name in names
+  gchar * names;
+  guint32 * buckets; // directory index + 1, 0 for empty
+  guint32 mask;     // number of buckets - 1
+} im_pathtab;
+
+/**
+ * Load the table of size bytes at offset in source, in one read.
+ * big_endian tells whether it is a type M table. Returns NULL if it
+ * can't be read or makes no sense, so that the caller can do
+ * without it.
+ */
+im_pathtab * im_pathtab_load(im_source * source, guint64 offset, gsize size,
+			     gboolean big_endian);
+void im_pathtab_free(im_pathtab * table);
+
+/**
+ * Index of the directory called name (len bytes) in directory
+ * parent, -1 if there's none.
+ */
+gint im_pathtab_child(const im_pathtab * table, guint parent,
+		      const gchar * name, gsize len);
+
+#endif /*__IM_PATHTAB_H__*/
@@ -0,0 +1,416 @@
+/* im_shmcache.c - a cache of image blocks shared between processes
+ *
+ * Copyright (C) 2016 Leo Cacciari <leo.cacciari@gmail.com>
+ *
+ * This file belongs to the isomounter project.
+ * isomounter is free software and is distributed under the terms of the
+ * GNU GPL. See the file COPYING for details.
+ */
+#include "common.h"
+#include "im_source.h"
+#include "im_dirrec.h"
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+/* in sectors: 64 KiB */
+#define SHM_BLOCK_SECTORS 32
+#define SHM_BLOCK_SIZE (SHM_BLOCK_SECTORS * IM_SECTOR_SIZE)
+#define SHM_MAGIC 0x49534d43 // "ISMC"
+#define SHM_VERSION 2
+#define SHM_PAGE 4096
+/* how long to wait for another process to set up the segment */
+#define SHM_SETUP_WAIT (G_USEC_PER_SEC)
+/* group members may share the segment */
+#define SHM_MODE 0660
+/* where shm_open() puts segments, to look for abandoned ones */
+#define SHM_DIR "/dev/shm"
+/* times to start over when the segment goes away while opening it */
+#define SHM_OPEN_TRIES 4
+
+/*
+ * One segment per image, named after its identity, holds a header,
+ * an array of slots and the blocks they describe. Processes mounting
+ * the same image map the same segment.
+ *
+ * Slots go in sets of two: a block may only be in one of the two
+ * slots its hash picks. Each slot is guarded by a sequence number,
+ * odd while the slot is being written. A reader copies the block
+ * out, then checks that the number didn't change in the meantime;
+ * no locks are taken. A writer claims a slot by bumping an even
+ * number to odd, and gives up if another one got there first.
+ *
+ * A writer dying halfway leaves its slot odd: the slot is taken back
+ * once its pid is gone. Whoever can write the segment decides what
+ * the others read, so it is only shared with the owner's group.
+ *
+ * Each process using the segment holds a shared flock() on it. The
+ * one that gets it exclusive on its way out is the last one: it marks
+ * the segment removed and unlinks it, and a process that opened the
+ * segment meanwhile sees the mark and starts over. A process that
+ * crashes drops its lock with its descriptors, so the others still
+ * remove the segment. If it was the last one, the segment stays in
+ * SHM_DIR until the next process setting up a shared cache sweeps
+ * away the ones nobody holds; "rm /dev/shm/isomounter-*" with nothing
+ * mounted does the same by hand.
+ */
+typedef struct shm_header_s {
+  gint magic;       // set last, by whoever creates the segment
+  guint32 version;
+  guint32 block_size;
+  guint32 n_slots;
+  gint removed;     // set by the last one out, before unlinking it
+  gchar identity[68];
+} shm_header;
+
+typedef struct shm_slot_s {
+  gint seq;
+  gint used;        // read since the last replacement in its set
+  gint pid;         // of the last writer
+  guint32 pad;
+  guint64 key;      // the block + 1, 0 if empty
+} shm_slot;
+
+typedef struct shmcache_source_s {
+  im_source base;
+  im_source * inner;
+  gchar * shm_name;
+  int fd;           // holding the shared lock
+  gpointer map;
+  gsize map_size;
+  shm_header * header;
+  shm_slot * slots;
+  guint8 * blocks;
+  guint32 n_slots;
+} shmcache_source;
+
+static gsize page_round(gsize size) {
+  return (size + SHM_PAGE - 1) & ~(gsize) (SHM_PAGE - 1);
+}
+
+static gsize slots_offset(void) {
+  return page_round(sizeof(shm_header));
+}
+
+static gsize blocks_offset(guint32 n_slots) {
+  return slots_offset() + page_round((gsize) n_slots * sizeof(shm_slot));
+}
+
+/* the first slot of the set block goes in */
+static guint32 set_of(shmcache_source * shm, guint64 block) {
+  guint32 hash = (guint32) ((block * G_GUINT64_CONSTANT(0x9e3779b97f4a7c15)) >> 32);
+  return (hash % (shm->n_slots / 2)) * 2;
+}
+
+static guint8 * slot_data(shmcache_source * shm, guint32 slot) {
+  return shm->blocks + (gsize) slot * SHM_BLOCK_SIZE;
+}
+
+/* how long the block is; the last one is shorter */
+static gsize block_size(shmcache_source * shm, guint64 block) {
+  return MIN(SHM_BLOCK_SIZE,shm->base.size - block * SHM_BLOCK_SIZE);
+}
+
+/* copy size bytes at skip in block to buf; FALSE if it isn't there */
+static gboolean lookup(shmcache_source * shm, guint64 block, guint8 * buf,
+		       gsize size, gsize skip) {
+  guint32 first = set_of(shm,block);
+  for (guint32 slot = first; slot < first + 2; slot++) {
+    shm_slot * s = &shm->slots[slot];
+    gint seq = g_atomic_int_get(&s->seq);
+    if ((seq & 1) != 0 || __atomic_load_n(&s->key,__ATOMIC_RELAXED) != block + 1) {
+      continue;
+    }
+    memcpy(buf,slot_data(shm,slot) + skip,size);
+    // the copy is done before seq is read again, on any cpu
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (g_atomic_int_get(&s->seq) != seq) {
+      // overwritten while copying
+      return FALSE;
+    }
+    // written only when needed, not to bounce the line between cpus
+    if (g_atomic_int_get(&s->used) == 0) {
+      g_atomic_int_set(&s->used,1);
+    }
+    return TRUE;
+  }
+  return FALSE;
+}
+
+static gboolean writer_gone(shm_slot * s) {
+  gint pid = g_atomic_int_get(&s->pid);
+  return pid > 0 && pid != getpid() && kill(pid,0) != 0 && errno == ESRCH;
+}
+
+/* take slot for writing, leaving its number odd; FALSE if busy */
+static gboolean claim(shm_slot * s) {
+  gint seq = g_atomic_int_get(&s->seq);
+  if ((seq & 1) == 0) {
+    return g_atomic_int_compare_and_exchange(&s->seq,seq,seq + 1);
+  }
+  // taken over from a dead writer, still odd
+  return writer_gone(s) && g_atomic_int_compare_and_exchange(&s->seq,seq,seq + 2);
+}
+
+/* keep a block read from the image, unless its set is busy */
+static void insert(shmcache_source * shm, guint64 block, const guint8 * data,
+		   gsize size) {
+  guint32 first = set_of(shm,block);
+  shm_slot * pair[2] = { &shm->slots[first], &shm->slots[first + 1] };
+  // an empty slot, else one not read lately, else the first one
+  guint32 pick = 0;
+  if (__atomic_load_n(&pair[0]->key,__ATOMIC_RELAXED) == 0) {
+    pick = 0;
+  } else if (__atomic_load_n(&pair[1]->key,__ATOMIC_RELAXED) == 0) {
+    pick = 1;
+  } else if (g_atomic_int_get(&pair[0]->used) == 0) {
+    pick = 0;
+  } else if (g_atomic_int_get(&pair[1]->used) == 0) {
+    pick = 1;
+  } else {
+    g_atomic_int_set(&pair[1]->used,0);
+  }
+  shm_slot * s = pair[pick];
+  if (!claim(s)) {
+    return;
+  }
+  g_atomic_int_set(&s->pid,getpid());
+  __atomic_store_n(&s->key,block + 1,__ATOMIC_RELAXED);
+  g_atomic_int_set(&s->used,0);
+  memcpy(slot_data(shm,first + pick),data,size);
+  g_atomic_int_inc(&s->seq);
+}
+
+static gssize shm_pread(im_source * source, gpointer buf, gsize size,
+			guint64 offset) {
+  shmcache_source * shm = (shmcache_source *) source;
+  guint8 * data = (guint8 *) buf;
+  gsize done = 0;
+  while (done < size && offset < source->size) {
+    guint64 block = offset / SHM_BLOCK_SIZE;
+    gsize skip = offset % SHM_BLOCK_SIZE;
+    gsize bsize = block_size(shm,block);
+    gsize len = MIN(size - done,bsize - skip);
+    if (!lookup(shm,block,data + done,len,skip)) {
+      guint8 * whole = g_malloc(bsize);
+      int result = im_source_read(shm->inner,whole,bsize,block * SHM_BLOCK_SIZE);
+      if (result != 0) {
+	g_free(whole);
+	return done > 0 ? (gssize) done : result;
+      }
+      memcpy(data + done,whole + skip,len);
+      insert(shm,block,whole,bsize);
+      g_free(whole);
+    }
+    done += len;
+    offset += len;
+  }
+  return done;
+}
+
+static void shm_close(im_source * source) {
+  shmcache_source * shm = (shmcache_source *) source;
+  // nobody else holds it: we are the last one
+  if (flock(shm->fd,LOCK_EX | LOCK_NB) == 0) {
+    g_atomic_int_set(&shm->header->removed,1);
+    shm_unlink(shm->shm_name);
+  }
+  munmap(shm->map,shm->map_size);
+  close(shm->fd);
+  g_free(shm->shm_name);
+  im_source_close(shm->inner);
+}
+
+static const im_source_ops shm_ops = {
+  .pread = shm_pread,
+  .close = shm_close,
+};
+
+/* map the segment someone else created, once it is ready */
+static gpointer attach(int fd, const gchar * name, gsize * map_size, GError ** error) {
+  gint64 deadline = g_get_monotonic_time() + SHM_SETUP_WAIT;
+  struct stat st;
+  while (fstat(fd,&st) == 0 && (gsize) st.st_size < sizeof(shm_header)) {
+    if (g_get_monotonic_time() > deadline) {
+      g_set_error(error,IM_ERROR_DOMAIN,IM_ERROR_IMAGE,
+		  "shared cache %s is never set up",name);
+      return NULL;
+    }
+    g_usleep(1000);
+  }
+  gpointer map = mmap(NULL,st.st_size,PROT_READ | PROT_WRITE,MAP_SHARED,fd,0);
+  if (map == MAP_FAILED) {
+    g_set_error(error,IM_ERROR_DOMAIN,IM_ERROR_IMAGE,
+		"can't map shared cache %s: %s",name,g_strerror(errno));
+    return NULL;
+  }
+  shm_header * header = (shm_header *) map;
+  while (g_atomic_int_get(&header->magic) != SHM_MAGIC) {
+    if (g_get_monotonic_time() > deadline) {
+      g_set_error(error,IM_ERROR_DOMAIN,IM_ERROR_IMAGE,
+		  "shared cache %s is never set up",name);
+      munmap(map,st.st_size);
+      return NULL;
+    }
+    g_usleep(1000);
+  }
+  // set_of() needs a set of two at least
+  if (header->version != SHM_VERSION || header->block_size != SHM_BLOCK_SIZE ||
+      header->n_slots < 2 || blocks_offset(header->n_slots) + (gsize) header->n_slots * SHM_BLOCK_SIZE
+      > (gsize) st.st_size) {
+    g_set_error(error,IM_ERROR_DOMAIN,IM_ERROR_IMAGE,
+		"shared cache %s has another layout",name);
+    munmap(map,st.st_size);
+    return NULL;
+  }
+  *map_size = st.st_size;
+  return map;
+}
+
+/* set up a new segment of about size bytes */
+static gpointer create(int fd, const gchar * name, const gchar * identity,
+		       guint64 size, gsize * map_size, GError ** error) {
+  guint32 n_slots = MIN(size / (SHM_BLOCK_SIZE + sizeof(shm_slot)),G_MAXUINT32) & ~1u;
+  n_slots = MAX(n_slots,2);
+  gsize total = blocks_offset(n_slots) + (gsize) n_slots * SHM_BLOCK_SIZE;
+  gpointer map = MAP_FAILED;
+  // pages tmpfs can't find later would be a SIGBUS at the first write
+  int result = posix_fallocate(fd,0,total);
+  if (result == 0) {
+    map = mmap(NULL,total,PROT_READ | PROT_WRITE,MAP_SHARED,fd,0);
+    result = errno;
+  }
+  if (map == MAP_FAILED) {
+    g_set_error(error,IM_ERROR_DOMAIN,IM_ERROR_IMAGE,
+		"can't set up shared cache %s: %s",name,g_strerror(result));
+    shm_unlink(name);
+    return NULL;
+  }
+  // fresh pages are zero: all slots are empty
+  shm_header * header = (shm_header *) map;
+  header->version = SHM_VERSION;
+  header->block_size = SHM_BLOCK_SIZE;
+  header->n_slots = n_slots;
+  g_strlcpy(header->identity,identity,sizeof(header->identity));
+  g_atomic_int_set(&header->magic,SHM_MAGIC);
+  *map_size = total;
+  return map;
+}
+
+/*
+ * Remove the segment called name if nobody holds it, and it is big
+ * enough to have been set up. With only_broken, just if it never was:
+ * a good one left behind is as good for whoever opens it next.
+ */
+static void reap(const gchar * name, gboolean only_broken) {
+  int fd = shm_open(name,O_RDWR | O_CLOEXEC,0);
+  if (fd < 0) {
+    return;
+  }
+  struct stat st;
+  if (flock(fd,LOCK_EX | LOCK_NB) == 0 && fstat(fd,&st) == 0 &&
+      (gsize) st.st_size >= sizeof(shm_header)) {
+    shm_header * header = mmap(NULL,sizeof(shm_header),PROT_READ | PROT_WRITE,
+			       MAP_SHARED,fd,0);
+    if (header != MAP_FAILED) {
+      if (!only_broken || g_atomic_int_get(&header->magic) != SHM_MAGIC) {
+	g_debug("removing abandoned shared cache %s",name);
+	g_atomic_int_set(&header->removed,1);
+	shm_unlink(name);
+      }
+      munmap(header,sizeof(shm_header));
+    }
+  }
+  close(fd);
+}
+
+/* the segments left by processes that crashed, but keep's if it is good */
+static void sweep(const gchar * keep) {
+  GDir * dir = g_dir_open(SHM_DIR,0,NULL);
+  if (dir == NULL) {
+    return;
+  }
+  const gchar * entry;
+  while ((entry = g_dir_read_name(dir)) != NULL) {
+    if (g_str_has_prefix(entry,PACKAGE_NAME "-")) {
+      gchar * name = g_strconcat("/",entry,NULL);
+      reap(name,strcmp(name,keep) == 0);
+      g_free(name);
+    }
+  }
+  g_dir_close(dir);
+}
+
+im_source * im_shmcache_source_new(im_source * inner, guint64 size, GError ** error) {
+  gchar * identity = im_source_identity(inner,error);
+  if (identity == NULL) {
+    return NULL;
+  }
+  gchar * name = g_strdup_printf("/%s-%s",PACKAGE_NAME,identity);
+  sweep(name);
+  gpointer map = NULL;
+  gsize map_size = 0;
+  int fd = -1;
+  for (guint tries = 0; map == NULL && tries < SHM_OPEN_TRIES; tries++) {
+    fd = shm_open(name,O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC,SHM_MODE);
+    if (fd >= 0) {
+      flock(fd,LOCK_SH);
+      map = create(fd,name,identity,size,&map_size,error);
+      break;
+    }
+    if (errno == EEXIST) {
+      fd = shm_open(name,O_RDWR | O_CLOEXEC,0);
+    }
+    if (fd < 0) {
+      if (errno == ENOENT) continue; // removed in the meantime
+      g_set_error(error,IM_ERROR_DOMAIN,IM_ERROR_IMAGE,
+		  "can't open shared cache %s: %s",name,g_strerror(errno));
+      break;
+    }
+    // waits while the last one out removes it
+    flock(fd,LOCK_SH);
+    map = attach(fd,name,&map_size,error);
+    if (map == NULL) {
+      break;
+    }
+    if (g_atomic_int_get(&((shm_header *) map)->removed)) {
+      munmap(map,map_size);
+      map = NULL;
+      close(fd);
+      fd = -1;
+    }
+  }
+  g_free(identity);
+  if (map == NULL) {
+    if (fd >= 0) close(fd);
+    if (error != NULL && *error == NULL) {
+      g_set_error(error,IM_ERROR_DOMAIN,IM_ERROR_IMAGE,
+		  "shared cache %s keeps going away",name);
+    }
+    g_free(name);
+    return NULL;
+  }
+  shmcache_source * shm = g_new0(shmcache_source,1);
+  shm->base.ops = &shm_ops;
+  shm->base.name = g_strdup(inner->name);
+  shm->base.size = inner->size;
+  shm->base.version = g_strdup(inner->version);
+  shm->base.fd = -1;
+  shm->inner = inner;
+  shm->shm_name = name;
+  shm->fd = fd;
+  shm->map = map;
+  shm->map_size = map_size;
+  shm->header = (shm_header *) map;
+  shm->n_slots = shm->header->n_slots;
+  shm->slots = (shm_slot *) ((guint8 *) map + slots_offset());
+  shm->blocks = (guint8 *) map + blocks_offset(shm->n_slots);
+  g_debug("shared cache %s: %u blocks",name,shm->n_slots);
+  return &shm->base;
+}
@@ -0,0 +1,258 @@
+/* im_source.c - where the bytes of an image come from
+ *
+ * Copyright (C) 2016 Leo Cacciari <leo.cacciari@gmail.com>
+ *
+ * This file belongs to the isomounter project.
+ * isomounter is free software and is distributed under the terms of the
+ * GNU GPL. See the file COPYING for details.
+ */
+#include "common.h"
+#include "im_source.h"
+#include "im_dirrec.h"
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+gboolean im_source_is_url(const gchar * path) {
+  return g_str_has_prefix(path,"http://") || g_str_has_prefix(path,"https://");
+}
+
+/* a local copy of blocks read, if asked for; never fatal */
+static im_source * with_l2cache(im_source * source, const im_open_options * options) {
+  if (options->l2cache_dir == NULL) {
+    return source;
+  }
+  GError * error = NULL;
+  im_source * l2 = im_l2cache_source_new(source,options->l2cache_dir,
+					 options->l2cache_size > 0 ? options->l2cache_size : IM_L2CACHE_DEFAULT_SIZE,
+					 &error);
+  if (l2 == NULL) {
+    g_warning("no disk cache for %s: %s",source->name,error->message);
+    g_error_free(error);
+    return source;
+  }
+  return l2;
+}
+
+/*
+ * Decrypted above the caches, so that what they keep on disk or share
+ * stays encrypted. Fatal: the data would make no sense.
+ */
+static im_source * with_crypt(im_source * source, const im_open_options * options,
+			      GError ** error) {
+  if (source == NULL || options->crypt_key == NULL) {
+    return source;
+  }
+  im_source * c = im_crypt_source_new(source,options->crypt_key,options->crypt_key_size,
+				      options->crypt_unit > 0 ? options->crypt_unit : IM_CRYPT_DEFAULT_UNIT,
+				      error);
+  if (c == NULL) {
+    im_source_close(source);
+  }
+  return c;
+}
+
+/* blocks shared with other mounts of the same image, if asked for */
+static im_source * with_shmcache(im_source * source, const im_open_options * options) {
+  if (options->shm_cache_size == 0) {
+    return source;
+  }
+  GError * error = NULL;
+  im_source * shm = im_shmcache_source_new(source,options->shm_cache_size,&error);
+  if (shm == NULL) {
+    g_warning("no shared cache for %s: %s",source->name,error->message);
+    g_error_free(error);
+    return source;
+  }
+  return shm;
+}
+
+im_source * im_source_open(const gchar * path, const im_open_options * options,
+			   GError ** error) {
+  if (im_source_is_url(path)) {
+    im_source * http = im_http_source_open(path,error);
+    if (http == NULL) {
+      return NULL;
+    }
+    // every read is a round trip: read big chunks, and keep them
+    im_source * source = with_crypt(with_shmcache(with_l2cache(http,options),options),
+				    options,error);
+    return source == NULL ? NULL :
+      im_cache_source_new(source,
+			  options->cache_size > 0 ? options->cache_size : IM_CACHE_DEFAULT_SIZE,
+			  options->prefetch > 0 ? options->prefetch : IM_CACHE_DEFAULT_PREFETCH);
+  }
+  im_source * source;
+  gchar ** parts = im_split_parts(path);
+  if (parts != NULL) {
+    source = im_split_source_open(parts,error);
+    g_strfreev(parts);
+  } else if (options->mmap) {
+    GError * mmap_error = NULL;
+    source = im_mmap_source_open(path,&mmap_error);
+    if (source == NULL) {
+      g_warning("reading %s without mapping it: %s",path,mmap_error->message);
+      g_error_free(mmap_error);
+      source = im_file_source_open(path,error);
+    }
+  } else {
+    source = im_file_source_open(path,error);
+  }
+  return source != NULL ?
+    with_crypt(with_shmcache(with_l2cache(source,options),options),options,error) : NULL;
+}
+
+void im_source_close(im_source * source) {
+  if (source != NULL) {
+    source->ops->close(source);
+    g_free(source->name);
+    g_free(source->version);
+    g_free(source);
+  }
+}
+
+int im_source_read(im_source * source, gpointer buf, gsize size, guint64 offset) {
+  guint8 * data = (guint8 *) buf;
+  gsize done = 0;
+  while (done < size) {
+    gssize n = source->ops->pread(source,data + done,size - done,offset + done);
+    if (n == -EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      return n;
+    }
+    if (n == 0) {
+      return -EIO;
+    }
+    done += n;
+  }
+  return 0;
+}
+
+int im_source_advise(im_source * source, guint64 offset, guint64 size,
+		     im_advice advice) {
+  return source->ops->advise != NULL ? source->ops->advise(source,offset,size,advice) : 0;
+}
+
+/* where the primary volume descriptor is, and what identifies it */
+#define PVD_SECTOR 16
+#define PVD_PATH_TABLE_SIZE 132
+#define PVD_L_PATH_TABLE 140
+#define PVD_ROOT 156
+/* of the path table and root directory, taken into the identity */
+#define IDENTITY_MAX_EXTENT (64 * 1024)
+
+static guint32 read_le32(const guint8 * p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((guint32) p[3] << 24);
+}
+
+/* add the first bytes of an extent, if it is inside the image */
+static int add_extent(GChecksum * checksum, im_source * source, guint32 extent,
+		      guint32 size) {
+  guint64 offset = (guint64) extent * IM_SECTOR_SIZE;
+  gsize len = MIN(size,IDENTITY_MAX_EXTENT);
+  if (extent == 0 || offset >= source->size || len > source->size - offset) {
+    return 0;
+  }
+  guint8 * data = g_malloc(MAX(len,1));
+  int result = im_source_read(source,data,len,offset);
+  if (result == 0) {
+    g_checksum_update(checksum,data,len);
+  }
+  g_free(data);
+  return result;
+}
+
+gchar * im_stat_version(const struct stat * st) {
+  return g_strdup_printf("%lu:%lu:%ld.%09ld",(unsigned long) st->st_dev,
+			 (unsigned long) st->st_ino,(long) st->st_mtim.tv_sec,
+			 (long) st->st_mtim.tv_nsec);
+}
+
+gchar * im_source_identity(im_source * source, GError ** error) {
+  guint8 sector[IM_SECTOR_SIZE];
+  int result = im_source_read(source,sector,IM_SECTOR_SIZE,
+			      PVD_SECTOR * IM_SECTOR_SIZE);
+  if (result != 0) {
+    g_set_error(error,IM_ERROR_DOMAIN,IM_ERROR_IMAGE,
+		"can't read the volume descriptor of %s: %s",source->name,g_strerror(-result));
+    return NULL;
+  }
+  GChecksum * checksum = g_checksum_new(G_CHECKSUM_SHA256);
+  guint64 size = GUINT64_TO_LE(source->size);
+  g_checksum_update(checksum,(const guchar *) &size,sizeof(size));
+  g_checksum_update(checksum,sector,sizeof(sector));
+  // a rebuild may keep the volume descriptor, not the tables
+  result = add_extent(checksum,source,read_le32(sector + PVD_L_PATH_TABLE),
+		      read_le32(sector + PVD_PATH_TABLE_SIZE));
+  if (result == 0) {
+    result = add_extent(checksum,source,read_le32(sector + PVD_ROOT + DR_EXTENT),
+			read_le32(sector + PVD_ROOT + DR_SIZE));
+  }
+  if (result != 0) {
+    g_set_error(error,IM_ERROR_DOMAIN,IM_ERROR_IMAGE,
+		"can't read the root directory of %s: %s",source->name,g_strerror(-result));
+    g_checksum_free(checksum);
+    return NULL;
+  }
+  if (source->version != NULL) {
+    g_checksum_update(checksum,(const guchar *) source->version,strlen(source->version));
+  }
+  gchar * identity = g_strdup(g_checksum_get_string(checksum));
+  g_checksum_free(checksum);
+  return identity;
+}
+
+/*
+ * The plain file backend.
+ */
+
+static gssize file_pread(im_source * source, gpointer buf, gsize size,
+			 guint64 offset) {
+  ssize_t n = pread(source->fd,buf,size,offset);
+  return n < 0 ? -errno : n;
+}
+
+static int file_advise(im_source * source, guint64 offset, guint64 size,
+		       im_advice advice) {
+  int how = POSIX_FADV_NORMAL;
+  switch (advice) {
+  case IM_ADVICE_SEQUENTIAL: how = POSIX_FADV_SEQUENTIAL; break;
+  case IM_ADVICE_WILLNEED: how = POSIX_FADV_WILLNEED; break;
+  default: break;
+  }
+  // returns the error rather than setting errno
+  return -posix_fadvise(source->fd,offset,size,how);
+}
+
+static void file_close(im_source * source) {
+  close(source->fd);
+}
+
+static const im_source_ops file_ops = {
+  .pread = file_pread,
+  .advise = file_advise,
+  .close = file_close,
+};
+
+im_source * im_file_source_open(const gchar * path, GError ** error) {
+  int fd = open(path,O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd < 0 || fstat(fd,&st) != 0) {
+    g_set_error(error,IM_ERROR_DOMAIN,IM_ERROR_IMAGE,
+		"failed to open image at %s: %s",path,g_strerror(errno));
+    if (fd >= 0) close(fd);
+    return NULL;
+  }
+  im_source * source = g_new0(im_source,1);
+  source->ops = &file_ops;
+  source->name = g_strdup(path);
+  source->size = st.st_size;
+  source->fd = fd;
+  source->version = im_stat_version(&st);
+  return source;
+}
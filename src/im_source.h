@@ -0,0 +1,150 @@
+/* im_source.h - where the bytes of an image come from
+ *
+ * Copyright (C) 2016 Leo Cacciari <leo.cacciari@gmail.com>
+ *
+ * This file belongs to the isomounter project.
+ * isomounter is free software and is distributed under the terms of the
+ * GNU GPL. See the file COPYING for details.
+ */
+#ifndef __IM_SOURCE_H__
+#define __IM_SOURCE_H__
+#include "common.h"
+#include <sys/stat.h>
+
+typedef struct im_source_s im_source;
+
+/* how a range of the image is going to be read */
+typedef enum {
+  IM_ADVICE_NORMAL,     // no longer any special way
+  IM_ADVICE_SEQUENTIAL,
+  IM_ADVICE_WILLNEED,   // soon
+} im_advice;
+
+typedef struct im_source_ops_s {
+  /* like pread(2), but returns a negated errno value on failure */
+  gssize (*pread)(im_source * source, gpointer buf, gsize size, guint64 offset);
+  /* pass a hint on to the kernel; may be NULL */
+  int (*advise)(im_source * source, guint64 offset, guint64 size, im_advice advice);
+  /* for backends keeping data in memory, how much; may be NULL */
+  void (*get_budget)(im_source * source, im_budget * budget);
+  void (*set_budget)(im_source * source, gsize bytes);
+  /* free what the backend holds, not source itself */
+  void (*close)(im_source * source);
+} im_source_ops;
+
+/**
+ * A backend embeds this at the start of its own structure.
+ */
+struct im_source_s {
+  const im_source_ops * ops;
+  gchar * name;  // for messages
+  guint64 size;
+  int fd;        // the whole image as a plain file, or -1
+  gchar * version; // what changes when the image is rewritten, or NULL
+};
+
+/**
+ * Open the image at path with the backend it needs: a plain file,
+ * a split image when path is its first part (ending in .000) or
+ * doesn't exist but path.000 does, or a URL.
+ */
+im_source * im_source_open(const gchar * path, const im_open_options * options,
+			   GError ** error);
+void im_source_close(im_source * source);
+
+/**
+ * Read size bytes, all of them. Returns 0 or a negated errno value,
+ * -EIO if the image is too short.
+ */
+int im_source_read(im_source * source, gpointer buf, gsize size, guint64 offset);
+
+/**
+ * Tell source how a range is going to be read. Only a hint: returns
+ * 0 or a negated errno value, and 0 when the backend takes no hints.
+ */
+int im_source_advise(im_source * source, guint64 offset, guint64 size,
+		     im_advice advice);
+
+im_source * im_file_source_open(const gchar * path, GError ** error);
+
+/**
+ * Map the image file at path in memory, and read by copying from
+ * the mapping.
+ */
+im_source * im_mmap_source_open(const gchar * path, GError ** error);
+
+/**
+ * A name for the image made from its size, primary volume
+ * descriptor, path table and root directory, and from its version,
+ * so that a rebuild of the same volume gets another one: 64 hex
+ * digits.
+ */
+gchar * im_source_identity(im_source * source, GError ** error);
+
+/**
+ * The version of a local file: its device, inode and modification
+ * time.
+ */
+gchar * im_stat_version(const struct stat * st);
+
+/**
+ * Whether path is a URL rather than a file name.
+ */
+gboolean im_source_is_url(const gchar * path);
+
+/**
+ * Read url with HTTP range requests. Fails if the library is built
+ * without libcurl, or if the server doesn't do ranges.
+ */
+im_source * im_http_source_open(const gchar * url, GError ** error);
+
+/* default im_open_options for the chunk cache */
+#define IM_CACHE_CHUNK_SIZE (1024 * 1024)
+#define IM_CACHE_DEFAULT_SIZE (64 * IM_CACHE_CHUNK_SIZE)
+#define IM_CACHE_DEFAULT_PREFETCH 4
+
+/**
+ * Keep the last chunks read from inner in memory, up to size bytes,
+ * and read ahead prefetch chunks. The cache owns inner.
+ */
+im_source * im_cache_source_new(im_source * inner, gsize size, guint prefetch);
+
+#define IM_L2CACHE_DEFAULT_SIZE (G_GUINT64_CONSTANT(1024) * 1024 * 1024)
+
+/**
+ * Keep the blocks read from inner in files under dir, up to size
+ * bytes, for this mount and the next ones. The cache owns inner,
+ * unless it fails.
+ */
+im_source * im_l2cache_source_new(im_source * inner, const gchar * dir,
+				  guint64 size, GError ** error);
+
+#define IM_SHMCACHE_DEFAULT_SIZE (256 * 1024 * 1024)
+
+/**
+ * Keep the blocks read from inner in a shared memory segment of
+ * about size bytes, shared with the other processes reading the same
+ * image; the first one sets the size. The cache owns inner, unless it
+ * fails.
+ */
+im_source * im_shmcache_source_new(im_source * inner, guint64 size, GError ** error);
+
+#define IM_CRYPT_DEFAULT_UNIT 512
+
+/**
+ * Decrypt what is read from inner with AES-XTS, key_size 32 or 64
+ * bytes, each unit bytes encrypted on its own with the number of its
+ * first 512 bytes sector as IV (dm-crypt's aes-xts-plain64). The
+ * source owns inner, unless it fails.
+ */
+im_source * im_crypt_source_new(im_source * inner, const guint8 * key, gsize key_size,
+				guint unit, GError ** error);
+
+/**
+ * The parts of the split image at path, in order, NULL if it isn't
+ * one.
+ */
+gchar ** im_split_parts(const gchar * path);
+im_source * im_split_source_open(gchar ** parts, GError ** error);
+
+#endif /*__IM_SOURCE_H__*/
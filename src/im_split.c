@@ -0,0 +1,142 @@
+/* im_split.c - images split in numbered parts
+ *
+ * Copyright (C) 2016 Leo Cacciari <leo.cacciari@gmail.com>
+ *
+ * This file belongs to the isomounter project.
+ * isomounter is free software and is distributed under the terms of the
+ * GNU GPL. See the file COPYING for details.
+ */
+#include "common.h"
+#include "im_source.h"
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#define FIRST_SUFFIX ".000"
+
+/*
+ * image.iso.000, image.iso.001, ... read as if they were
+ * concatenated. Parts may have any size: the one holding an offset
+ * is found by binary search on where they start.
+ */
+typedef struct split_source_s {
+  im_source base;
+  guint n_parts;
+  int * fds;
+  guint64 * starts; // n_parts + 1 of them, the last is the size
+} split_source;
+
+gchar ** im_split_parts(const gchar * path) {
+  gchar * base = NULL;
+  if (g_str_has_suffix(path,FIRST_SUFFIX)) {
+    base = g_strndup(path,strlen(path) - strlen(FIRST_SUFFIX));
+  } else if (!g_file_test(path,G_FILE_TEST_EXISTS)) {
+    base = g_strdup(path);
+  } else {
+    return NULL;
+  }
+  GPtrArray * parts = g_ptr_array_new();
+  for (guint idx = 0; ; idx++) {
+    gchar * part = g_strdup_printf("%s.%03u",base,idx);
+    if (!g_file_test(part,G_FILE_TEST_IS_REGULAR)) {
+      g_free(part);
+      break;
+    }
+    g_ptr_array_add(parts,part);
+  }
+  g_free(base);
+  if (parts->len == 0) {
+    g_ptr_array_free(parts,TRUE);
+    return NULL;
+  }
+  g_ptr_array_add(parts,NULL);
+  return (gchar **) g_ptr_array_free(parts,FALSE);
+}
+
+/* the part holding offset */
+static guint part_of(const split_source * split, guint64 offset) {
+  guint lo = 0, hi = split->n_parts;
+  while (hi - lo > 1) {
+    guint mid = lo + (hi - lo) / 2;
+    if (split->starts[mid] <= offset) lo = mid; else hi = mid;
+  }
+  return lo;
+}
+
+/* an extent across parts is read a piece from each */
+static gssize split_pread(im_source * source, gpointer buf, gsize size,
+			  guint64 offset) {
+  split_source * split = (split_source *) source;
+  guint8 * data = (guint8 *) buf;
+  gsize done = 0;
+  guint part = part_of(split,offset);
+  while (done < size && offset < source->size) {
+    while (offset >= split->starts[part + 1]) part++;
+    gsize len = MIN(size - done,split->starts[part + 1] - offset);
+    ssize_t n = pread(split->fds[part],data + done,len,offset - split->starts[part]);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return done > 0 ? (gssize) done : -errno;
+    }
+    if (n == 0) {
+      // the part shrank since it was opened
+      break;
+    }
+    done += n;
+    offset += n;
+  }
+  return done;
+}
+
+static void split_close(im_source * source) {
+  split_source * split = (split_source *) source;
+  for (guint idx = 0; idx < split->n_parts; idx++) {
+    if (split->fds[idx] >= 0) close(split->fds[idx]);
+  }
+  g_free(split->fds);
+  g_free(split->starts);
+}
+
+static const im_source_ops split_ops = {
+  .pread = split_pread,
+  .close = split_close,
+};
+
+im_source * im_split_source_open(gchar ** parts, GError ** error) {
+  split_source * split = g_new0(split_source,1);
+  split->base.ops = &split_ops;
+  split->base.name = g_strdup(parts[0]);
+  split->base.fd = -1;
+  split->n_parts = g_strv_length(parts);
+  split->fds = g_new(int,split->n_parts);
+  split->starts = g_new(guint64,split->n_parts + 1);
+  for (guint idx = 0; idx < split->n_parts; idx++) {
+    split->fds[idx] = -1;
+  }
+  guint64 start = 0;
+  GString * version = g_string_new(NULL);
+  for (guint idx = 0; idx < split->n_parts; idx++) {
+    struct stat st;
+    split->fds[idx] = open(parts[idx],O_RDONLY | O_CLOEXEC);
+    if (split->fds[idx] < 0 || fstat(split->fds[idx],&st) != 0) {
+      g_set_error(error,IM_ERROR_DOMAIN,IM_ERROR_IMAGE,
+		  "failed to open image part %s: %s",parts[idx],g_strerror(errno));
+      g_string_free(version,TRUE);
+      im_source_close(&split->base);
+      return NULL;
+    }
+    split->starts[idx] = start;
+    start += st.st_size;
+    gchar * part = im_stat_version(&st);
+    g_string_append_printf(version,"%s%s",idx > 0 ? ";" : "",part);
+    g_free(part);
+  }
+  split->base.version = g_string_free(version,FALSE);
+  split->starts[split->n_parts] = start;
+  split->base.size = start;
+  g_debug("%s: %u parts, %" G_GUINT64_FORMAT " bytes",parts[0],split->n_parts,start);
+  return &split->base;
+}
@@ -0,0 +1,490 @@
+/* im_tree.c - the compact resident directory tree
+ *
+ * Copyright (C) 2016 Leo Cacciari <leo.cacciari@gmail.com>
+ *
+ * This file belongs to the isomounter project.
+ * isomounter is free software and is distributed under the terms of the
+ * GNU GPL. See the file COPYING for details.
+ */
+#include "common.h"
+#include "im_tree.h"
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#define NAME_MAX_LEN 255
+
+typedef struct builder_s {
+  im_tree * tree;
+  guint32 allocated;    // nodes
+  gsize names_allocated;
+  gint64 * mtime;       // full times, until the base is known
+  gchar prev[NAME_MAX_LEN + 1];
+  gsize prev_len;
+  GHashTable * expanded; // directory extents already done
+  GArray * large;
+} builder;
+
+static guint32 parent_of(const im_tree * tree, guint32 node) {
+  return tree->parent[node] & ~IM_TREE_FLAGS;
+}
+
+static gboolean is_dir(const im_tree * tree, guint32 node) {
+  return (tree->parent[node] & IM_TREE_DIR) != 0;
+}
+
+static void node_entry(const im_tree * tree, guint32 node, im_entry * entry) {
+  entry->offset = (guint64) tree->extent[node] * IM_SECTOR_SIZE;
+  entry->size = (tree->parent[node] & IM_TREE_LARGE) ?
+    tree->large[tree->size[node]] : tree->size[node];
+  entry->mtime = tree->time_base + tree->mtime[node];
+  entry->is_dir = is_dir(tree,node);
+  entry->fragmented = (tree->parent[node] & IM_TREE_FRAGMENTED) != 0;
+}
+
+static void add_node(builder * b, const im_entry * entry, guint32 parent,
+		     const gchar * name, gsize len) {
+  im_tree * tree = b->tree;
+  guint32 node = tree->n_nodes;
+  if (node == b->allocated) {
+    b->allocated *= 2;
+    tree->extent = g_renew(guint32,tree->extent,b->allocated);
+    tree->size = g_renew(guint32,tree->size,b->allocated);
+    tree->parent = g_renew(guint32,tree->parent,b->allocated);
+    tree->blocks = g_renew(guint32,tree->blocks,b->allocated / IM_TREE_BLOCK);
+    b->mtime = g_renew(gint64,b->mtime,b->allocated);
+  }
+  if (tree->names_size + 2 + len > b->names_allocated) {
+    b->names_allocated = MAX(b->names_allocated * 2,tree->names_size + 2 + len);
+    tree->names = g_realloc(tree->names,b->names_allocated);
+  }
+  tree->extent[node] = entry->offset / IM_SECTOR_SIZE;
+  tree->parent[node] = parent | (entry->is_dir ? IM_TREE_DIR : 0) |
+    (entry->fragmented ? IM_TREE_FRAGMENTED : 0);
+  if (entry->size > G_MAXUINT32) {
+    tree->parent[node] |= IM_TREE_LARGE;
+    tree->size[node] = b->large->len;
+    g_array_append_val(b->large,entry->size);
+  } else {
+    tree->size[node] = entry->size;
+  }
+  b->mtime[node] = entry->mtime;
+  // front code the name against the previous sibling
+  gsize prefix = 0;
+  if (node % IM_TREE_BLOCK == 0) {
+    tree->blocks[node / IM_TREE_BLOCK] = tree->names_size;
+  } else if (node > 0 && parent_of(tree,node - 1) == parent) {
+    while (prefix < len && prefix < b->prev_len && b->prev[prefix] == name[prefix]) {
+      prefix++;
+    }
+  }
+  guint8 * p = tree->names + tree->names_size;
+  p[0] = prefix;
+  p[1] = len - prefix;
+  memcpy(p + 2,name + prefix,len - prefix);
+  tree->names_size += 2 + len - prefix;
+  memcpy(b->prev,name,len);
+  b->prev_len = len;
+  tree->n_nodes++;
+}
+
+static gint compare_names(gconstpointer a, gconstpointer b, gpointer data) {
+  const im_dirlist * list = (const im_dirlist *) data;
+  guint32 first = *(const guint32 *) a;
+  guint32 second = *(const guint32 *) b;
+  gint result = strcmp(IM_DIRENT_NAME(list,&list->entries[first]),
+		       IM_DIRENT_NAME(list,&list->entries[second]));
+  // keep duplicates in image order, so that the first one wins
+  return result != 0 ? result : (first < second ? -1 : first > second);
+}
+
+/* append the children of node, sorted by name */
+static void expand(builder * b, guint32 node, const im_dirlist * list) {
+  guint32 * order = g_new(guint32,list->n_entries);
+  for (guint idx = 0; idx < list->n_entries; idx++) {
+    order[idx] = idx;
+  }
+  g_qsort_with_data(order,list->n_entries,sizeof(guint32),compare_names,
+		    (gpointer) list);
+  for (guint idx = 0; idx < list->n_entries; idx++) {
+    const im_dirent * dirent = &list->entries[order[idx]];
+    const gchar * name = IM_DIRENT_NAME(list,dirent);
+    add_node(b,&dirent->entry,node,name,MIN(strlen(name),NAME_MAX_LEN));
+  }
+  g_free(order);
+}
+
+/* slot of node in dirs, which has it */
+static guint32 dir_slot(const im_tree * tree, guint32 node) {
+  guint32 lo = 0, hi = tree->n_dirs;
+  while (hi - lo > 1) {
+    guint32 mid = lo + (hi - lo) / 2;
+    if (tree->dirs[mid] <= node) lo = mid; else hi = mid;
+  }
+  return lo;
+}
+
+/*
+ * Children come after their parent, so going backwards each directory
+ * is complete by the time it is added to its own parent.
+ */
+static void sum_dirs(im_tree * tree) {
+  tree->n_dirs = 0;
+  for (guint32 node = 0; node < tree->n_nodes; node++) {
+    if (is_dir(tree,node)) tree->n_dirs++;
+  }
+  tree->dirs = g_new(guint32,tree->n_dirs);
+  tree->totals = g_new0(im_tree_total,tree->n_dirs);
+  guint32 slot = 0;
+  for (guint32 node = 0; node < tree->n_nodes; node++) {
+    if (is_dir(tree,node)) tree->dirs[slot++] = node;
+  }
+  for (guint32 node = tree->n_nodes - 1; node > 0; node--) {
+    im_tree_total * up = &tree->totals[dir_slot(tree,parent_of(tree,node))];
+    if (is_dir(tree,node)) {
+      const im_tree_total * own = &tree->totals[dir_slot(tree,node)];
+      up->bytes += own->bytes;
+      up->files += own->files;
+    } else {
+      im_entry entry;
+      node_entry(tree,node,&entry);
+      up->bytes += entry.size;
+      up->files++;
+    }
+  }
+}
+
+im_tree * im_tree_build(const im_entry * root, im_tree_dir_func dir_func,
+			gpointer data) {
+  builder b = { 0 };
+  b.tree = g_new0(im_tree,1);
+  b.allocated = 1024;
+  b.tree->extent = g_new(guint32,b.allocated);
+  b.tree->size = g_new(guint32,b.allocated);
+  b.tree->parent = g_new(guint32,b.allocated);
+  b.tree->blocks = g_new(guint32,b.allocated / IM_TREE_BLOCK);
+  b.mtime = g_new(gint64,b.allocated);
+  b.expanded = g_hash_table_new(g_direct_hash,g_direct_equal);
+  b.large = g_array_new(FALSE,FALSE,sizeof(guint64));
+  add_node(&b,root,0,"",0);
+  // the nodes appended are the queue of the breadth first visit
+  gboolean ok = TRUE;
+  for (guint32 node = 0; node < b.tree->n_nodes && ok; node++) {
+    if (!is_dir(b.tree,node)) {
+      continue;
+    }
+    guint32 sector = b.tree->extent[node];
+    if (!g_hash_table_add(b.expanded,GUINT_TO_POINTER(sector))) {
+      // a loop in a broken image
+      continue;
+    }
+    const im_dirlist * list = dir_func(data,(guint64) sector * IM_SECTOR_SIZE);
+    if (list == NULL) {
+      ok = FALSE;
+    } else {
+      expand(&b,node,list);
+    }
+  }
+  g_hash_table_destroy(b.expanded);
+  im_tree * tree = b.tree;
+  tree->n_large = b.large->len;
+  tree->large = (guint64 *) g_array_free(b.large,FALSE);
+  if (!ok) {
+    g_free(b.mtime);
+    im_tree_free(tree);
+    return NULL;
+  }
+  // times fit 32 bits from the oldest one
+  gint64 base = G_MAXINT64;
+  for (guint32 node = 0; node < tree->n_nodes; node++) {
+    base = MIN(base,b.mtime[node]);
+  }
+  tree->time_base = base;
+  tree->mtime = g_new(guint32,tree->n_nodes);
+  for (guint32 node = 0; node < tree->n_nodes; node++) {
+    tree->mtime[node] = MIN(b.mtime[node] - base,(gint64) G_MAXUINT32);
+  }
+  g_free(b.mtime);
+  // give back the slack
+  tree->extent = g_renew(guint32,tree->extent,tree->n_nodes);
+  tree->size = g_renew(guint32,tree->size,tree->n_nodes);
+  tree->parent = g_renew(guint32,tree->parent,tree->n_nodes);
+  tree->blocks = g_renew(guint32,tree->blocks,
+			 (tree->n_nodes + IM_TREE_BLOCK - 1) / IM_TREE_BLOCK);
+  tree->names = g_realloc(tree->names,tree->names_size);
+  sum_dirs(tree);
+  return tree;
+}
+
+void im_tree_free(im_tree * tree) {
+  if (tree != NULL) {
+    g_free(tree->extent);
+    g_free(tree->size);
+    g_free(tree->mtime);
+    g_free(tree->parent);
+    g_free(tree->blocks);
+    g_free(tree->names);
+    g_free(tree->large);
+    g_free(tree->dirs);
+    g_free(tree->totals);
+    g_free(tree);
+  }
+}
+
+/* what im_tree_save() writes first */
+typedef struct saved_tree_s {
+  guint32 magic;
+  guint32 n_nodes;
+  guint64 names_size;
+  gint64 time_base;
+  guint32 n_large;
+  guint32 padding;
+} saved_tree;
+
+#define SAVED_TREE_MAGIC 0x49545233 // "ITR3"
+
+static guint32 n_blocks(guint32 n_nodes) {
+  return (n_nodes + IM_TREE_BLOCK - 1) / IM_TREE_BLOCK;
+}
+
+void im_tree_save(const im_tree * tree, GByteArray * out) {
+  saved_tree header = { SAVED_TREE_MAGIC, tree->n_nodes, tree->names_size, tree->time_base,
+			 tree->n_large, 0 };
+  gsize column = (gsize) tree->n_nodes * sizeof(guint32);
+  g_byte_array_append(out,(const guint8 *) &header,sizeof(header));
+  g_byte_array_append(out,(const guint8 *) tree->extent,column);
+  g_byte_array_append(out,(const guint8 *) tree->size,column);
+  g_byte_array_append(out,(const guint8 *) tree->mtime,column);
+  g_byte_array_append(out,(const guint8 *) tree->parent,column);
+  g_byte_array_append(out,(const guint8 *) tree->blocks,n_blocks(tree->n_nodes) * sizeof(guint32));
+  g_byte_array_append(out,tree->names,tree->names_size);
+  g_byte_array_append(out,(const guint8 *) tree->large,tree->n_large * sizeof(guint64));
+}
+
+/* a copy of the next size bytes at *p, if there are that many before end */
+static gpointer take(const guint8 ** p, const guint8 * end, gsize size) {
+  if ((gsize) (end - *p) < size) {
+    return NULL;
+  }
+  gpointer copy = g_malloc(MAX(size,1));
+  memcpy(copy,*p,size);
+  *p += size;
+  return copy;
+}
+
+/*
+ * The names go one after the other, each block starts where the
+ * block index says with a name of its own, and none is longer than
+ * NAME_MAX_LEN or shares more than the previous one has:
+ * decode_name() then stays inside tree->names and its buffer.
+ */
+static gboolean names_ok(const im_tree * tree) {
+  gsize pos = 0;
+  gsize prev_len = 0;
+  for (guint32 node = 0; node < tree->n_nodes; node++) {
+    if (node % IM_TREE_BLOCK == 0) {
+      if (tree->blocks[node / IM_TREE_BLOCK] != pos) {
+	return FALSE;
+      }
+      prev_len = 0;
+    }
+    if (pos + 2 > tree->names_size) {
+      return FALSE;
+    }
+    const guint8 * p = tree->names + pos;
+    if (p[0] > prev_len || p[0] + p[1] > NAME_MAX_LEN ||
+	pos + 2 + p[1] > tree->names_size) {
+      return FALSE;
+    }
+    prev_len = p[0] + p[1];
+    pos += 2 + p[1];
+  }
+  return pos == tree->names_size;
+}
+
+im_tree * im_tree_load(const guint8 * data, gsize size) {
+  saved_tree header;
+  if (size < sizeof(header)) {
+    return NULL;
+  }
+  memcpy(&header,data,sizeof(header));
+  if (header.magic != SAVED_TREE_MAGIC || header.n_nodes == 0) {
+    return NULL;
+  }
+  const guint8 * p = data + sizeof(header);
+  const guint8 * end = data + size;
+  gsize column = (gsize) header.n_nodes * sizeof(guint32);
+  im_tree * tree = g_new0(im_tree,1);
+  tree->n_nodes = header.n_nodes;
+  tree->names_size = header.names_size;
+  tree->time_base = header.time_base;
+  tree->extent = take(&p,end,column);
+  tree->size = take(&p,end,column);
+  tree->mtime = take(&p,end,column);
+  tree->parent = take(&p,end,column);
+  tree->blocks = take(&p,end,n_blocks(header.n_nodes) * sizeof(guint32));
+  tree->names = take(&p,end,header.names_size);
+  tree->n_large = header.n_large;
+  tree->large = take(&p,end,(gsize) header.n_large * sizeof(guint64));
+  gboolean ok = tree->extent != NULL && tree->size != NULL && tree->mtime != NULL &&
+    tree->parent != NULL && tree->blocks != NULL && tree->names != NULL &&
+    tree->large != NULL && p == end;
+  // what lookups follow must stay inside the tree, and parents come
+  // before their children, as the totals are summed
+  for (guint32 node = 0; ok && node < tree->n_nodes; node++) {
+    ok = parent_of(tree,node) < tree->n_nodes && is_dir(tree,parent_of(tree,node)) &&
+      (node == 0 || parent_of(tree,node) < node) &&
+      (node == 0 || parent_of(tree,node - 1) <= parent_of(tree,node)) &&
+      (!(tree->parent[node] & IM_TREE_LARGE) || tree->size[node] < tree->n_large);
+  }
+  if (!ok || !names_ok(tree)) {
+    im_tree_free(tree);
+    return NULL;
+  }
+  sum_dirs(tree);
+  return tree;
+}
+
+gsize im_tree_memory(const im_tree * tree) {
+  return sizeof(im_tree) + (gsize) tree->n_nodes * 4 * sizeof(guint32) +
+    (tree->n_nodes + IM_TREE_BLOCK - 1) / IM_TREE_BLOCK * sizeof(guint32) +
+    tree->names_size + tree->n_large * sizeof(guint64) +
+    tree->n_dirs * (sizeof(guint32) + sizeof(im_tree_total));
+}
+
+/* decode the name at p into buf, which holds the previous one */
+static const guint8 * decode_name(const guint8 * p, gchar * buf, gsize * len) {
+  memcpy(buf + p[0],p + 2,p[1]);
+  *len = p[0] + p[1];
+  buf[*len] = '\0';
+  return p + 2 + p[1];
+}
+
+/* position of the name of node, with buf holding the previous one */
+static const guint8 * seek_name(const im_tree * tree, guint32 node, gchar * buf) {
+  guint32 current = node - node % IM_TREE_BLOCK;
+  const guint8 * p = tree->names + tree->blocks[current / IM_TREE_BLOCK];
+  gsize len;
+  for (; current < node; current++) {
+    p = decode_name(p,buf,&len);
+  }
+  return p;
+}
+
+/* the children of node are [*first,*end) */
+static void children(const im_tree * tree, guint32 node,
+		     guint32 * first, guint32 * end) {
+  // the root is its own parent: start past it
+  guint32 lo = 1, hi = tree->n_nodes;
+  while (lo < hi) {
+    guint32 mid = lo + (hi - lo) / 2;
+    if (parent_of(tree,mid) < node) lo = mid + 1; else hi = mid;
+  }
+  *first = lo;
+  hi = tree->n_nodes;
+  while (lo < hi) {
+    guint32 mid = lo + (hi - lo) / 2;
+    if (parent_of(tree,mid) <= node) lo = mid + 1; else hi = mid;
+  }
+  *end = lo;
+}
+
+static gint compare_name(const gchar * node_name, gsize node_len,
+			 const gchar * name, gsize len) {
+  gint result = memcmp(node_name,name,MIN(node_len,len));
+  return result != 0 ? result : (node_len < len ? -1 : node_len > len);
+}
+
+/* binary search of name among the children of node, -1 if it isn't there */
+static gint64 find_child(const im_tree * tree, guint32 node,
+			 const gchar * name, gsize len) {
+  guint32 lo, hi;
+  children(tree,node,&lo,&hi);
+  gchar buf[NAME_MAX_LEN + 1];
+  gint64 found = -1;
+  while (lo < hi) {
+    guint32 mid = lo + (hi - lo) / 2;
+    gsize mid_len;
+    decode_name(seek_name(tree,mid,buf),buf,&mid_len);
+    gint result = compare_name(buf,mid_len,name,len);
+    if (result < 0) {
+      lo = mid + 1;
+    } else {
+      // the first of equal names is the one wanted
+      if (result == 0) found = mid;
+      hi = mid;
+    }
+  }
+  return found;
+}
+
+static int resolve(const im_tree * tree, const gchar * path, guint32 * node) {
+  guint32 current = 0;
+  while (*path != '\0') {
+    if (!is_dir(tree,current)) {
+      return -ENOTDIR;
+    }
+    const gchar * name = path;
+    gsize len = im_path_next(&path);
+    gint64 child = find_child(tree,current,name,len);
+    if (child < 0) {
+      return -ENOENT;
+    }
+    current = child;
+  }
+  *node = current;
+  return 0;
+}
+
+int im_tree_lookup(const im_tree * tree, const gchar * path, im_entry * entry) {
+  guint32 node;
+  int result = resolve(tree,path,&node);
+  if (result == 0) {
+    node_entry(tree,node,entry);
+  }
+  return result;
+}
+
+int im_tree_totals(const im_tree * tree, const gchar * path, im_tree_total * total) {
+  guint32 node;
+  int result = resolve(tree,path,&node);
+  if (result != 0) {
+    return result;
+  }
+  if (!is_dir(tree,node)) {
+    return -ENOTDIR;
+  }
+  *total = tree->totals[dir_slot(tree,node)];
+  return 0;
+}
+
+int im_tree_readdir(const im_tree * tree, const gchar * path,
+		    im_dir_filler filler, gpointer data) {
+  guint32 node;
+  int result = resolve(tree,path,&node);
+  if (result != 0) {
+    return result;
+  }
+  if (!is_dir(tree,node)) {
+    return -ENOTDIR;
+  }
+  guint32 first, end;
+  children(tree,node,&first,&end);
+  if (first == end) {
+    return 0;
+  }
+  // the names decode one after the other from the first one
+  gchar buf[NAME_MAX_LEN + 1];
+  const guint8 * p = seek_name(tree,first,buf);
+  for (guint32 child = first; child < end; child++) {
+    gsize len;
+    im_entry entry;
+    p = decode_name(p,buf,&len);
+    node_entry(tree,child,&entry);
+    if (filler(data,buf,&entry) != 0) {
+      break;
+    }
+  }
+  return 0;
+}
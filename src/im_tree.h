@@ -0,0 +1,102 @@
+/* im_tree.h - the compact resident directory tree
+ *
+ * Copyright (C) 2016 Leo Cacciari <leo.cacciari@gmail.com>
+ *
+ * This file belongs to the isomounter project.
+ * isomounter is free software and is distributed under the terms of the
+ * GNU GPL. See the file COPYING for details.
+ */
+#ifndef __IM_TREE_H__
+#define __IM_TREE_H__
+#include "common.h"
+#include "im_dirrec.h"
+
+/* names are front coded in blocks of this many nodes */
+#define IM_TREE_BLOCK 16
+#define IM_TREE_DIR 0x80000000u // flags in parent
+#define IM_TREE_LARGE 0x40000000u // size is an index in large
+#define IM_TREE_FRAGMENTED 0x20000000u
+#define IM_TREE_FLAGS (IM_TREE_DIR | IM_TREE_LARGE | IM_TREE_FRAGMENTED)
+
+/* what is under a directory */
+typedef struct im_tree_total_s {
+  guint64 bytes;
+  guint64 files;
+} im_tree_total;
+
+/**
+ * Every entry of the image in 16 bytes plus its name, for images
+ * with millions of them. Nodes are in breadth first order, with the
+ * children of a directory contiguous and sorted by name, so that the
+ * parent column is sorted too and gives the children of a node by
+ * binary search. Node 0 is the root.
+ *
+ * A name is stored as the length of the prefix it shares with the
+ * previous one in the same directory, the length of the rest and the
+ * rest. Coding restarts at each block, whose offsets are in blocks.
+ *
+ * Files of 4 GiB or more, in several extents, have their size in
+ * large instead; they are few.
+ *
+ * Directories also have the bytes and files under them, at any depth,
+ * in totals; dirs has their nodes, in order. These aren't saved: they
+ * are summed again at load.
+ */
+typedef struct im_tree_s {
+  guint32 n_nodes;
+  guint32 * extent; // in sectors
+  guint32 * size;
+  guint32 * mtime;  // seconds since time_base
+  guint32 * parent; // | IM_TREE_DIR for directories, and so on
+  guint32 * blocks;
+  guint8 * names;
+  gsize names_size;
+  gint64 time_base;
+  guint32 n_large;
+  guint64 * large;
+  guint32 n_dirs;
+  guint32 * dirs;
+  im_tree_total * totals;
+} im_tree;
+
+/* gives the decoded directory at offset */
+typedef const im_dirlist * (*im_tree_dir_func)(gpointer data, guint64 offset);
+
+/**
+ * Build the tree under root, getting the directories from dir_func.
+ * Returns NULL if one is missing.
+ */
+im_tree * im_tree_build(const im_entry * root, im_tree_dir_func dir_func,
+			gpointer data);
+void im_tree_free(im_tree * tree);
+
+/**
+ * Append tree to out as it is in memory, for another process to
+ * load. im_tree_load() returns NULL if data isn't a whole tree.
+ */
+void im_tree_save(const im_tree * tree, GByteArray * out);
+im_tree * im_tree_load(const guint8 * data, gsize size);
+
+/**
+ * Bytes used by tree.
+ */
+gsize im_tree_memory(const im_tree * tree);
+
+/**
+ * Fill entry with path, relative to the root.
+ */
+int im_tree_lookup(const im_tree * tree, const gchar * path, im_entry * entry);
+
+/**
+ * Fill total with what is under the directory at path; -ENOTDIR if it
+ * is a file.
+ */
+int im_tree_totals(const im_tree * tree, const gchar * path, im_tree_total * total);
+
+/**
+ * Call filler for each entry of the directory at path.
+ */
+int im_tree_readdir(const im_tree * tree, const gchar * path,
+		    im_dir_filler filler, gpointer data);
+
+#endif /*__IM_TREE_H__*/
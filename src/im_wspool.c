@@ -0,0 +1,188 @@
+/* im_wspool.c - a small work-stealing thread pool
+ *
+ * Copyright (C) 2016 Leo Cacciari <leo.cacciari@gmail.com>
+ *
+ * This file belongs to the isomounter project.
+ * isomounter is free software and is distributed under the terms of the
+ * GNU GPL. See the file COPYING for details.
+ */
+#include "common.h"
+#include "im_wspool.h"
+
+typedef struct worker_s {
+  im_wspool * pool;
+  guint idx;
+  GMutex lock;   // the deque is short-lived under it: no need for lock-free
+  GQueue deque;
+  GThread * thread;
+} worker;
+
+struct im_wspool_s {
+  im_wspool_func func;
+  GDestroyNotify free_task;
+  gpointer data;
+  guint n_workers;
+  worker * workers;
+  gint pending;   // tasks pushed and not yet done
+  gint queued;    // tasks sitting in a deque
+  gint cancelled;
+  GMutex idle_lock;
+  GCond idle_cond;
+};
+
+/* the worker running in this thread, if any */
+static GPrivate current_worker;
+
+static gpointer pop_own(worker * self) {
+  g_mutex_lock(&self->lock);
+  gpointer task = g_queue_pop_head(&self->deque);
+  g_mutex_unlock(&self->lock);
+  return task;
+}
+
+/* take the oldest task of someone else: it's likely the biggest */
+static gpointer steal(worker * self) {
+  im_wspool * pool = self->pool;
+  for (guint step = 1; step < pool->n_workers; step++) {
+    worker * victim = &pool->workers[(self->idx + step) % pool->n_workers];
+    g_mutex_lock(&victim->lock);
+    gpointer task = g_queue_pop_tail(&victim->deque);
+    g_mutex_unlock(&victim->lock);
+    if (task != NULL) {
+      return task;
+    }
+  }
+  return NULL;
+}
+
+static gpointer worker_main(gpointer data) {
+  worker * self = (worker *) data;
+  im_wspool * pool = self->pool;
+  g_private_set(&current_worker,self);
+  for (;;) {
+    if (g_atomic_int_get(&pool->cancelled)) {
+      break;
+    }
+    gpointer task = pop_own(self);
+    if (task == NULL) {
+      task = steal(self);
+    }
+    if (task != NULL) {
+      g_atomic_int_add(&pool->queued,-1);
+      pool->func(pool,task,pool->data);
+      if (g_atomic_int_dec_and_test(&pool->pending)) {
+	// the job is over: wake up the idle ones so that they leave
+	g_mutex_lock(&pool->idle_lock);
+	g_cond_broadcast(&pool->idle_cond);
+	g_mutex_unlock(&pool->idle_lock);
+      }
+      continue;
+    }
+    // nothing to steal, but the running tasks may push more
+    g_mutex_lock(&pool->idle_lock);
+    while (g_atomic_int_get(&pool->queued) == 0 &&
+	   g_atomic_int_get(&pool->pending) > 0 &&
+	   !g_atomic_int_get(&pool->cancelled)) {
+      g_cond_wait(&pool->idle_cond,&pool->idle_lock);
+    }
+    gboolean over = g_atomic_int_get(&pool->pending) == 0;
+    g_mutex_unlock(&pool->idle_lock);
+    if (over) {
+      break;
+    }
+  }
+  g_private_set(&current_worker,NULL);
+  return NULL;
+}
+
+im_wspool * im_wspool_new(guint n_threads, im_wspool_func func,
+			  GDestroyNotify free_task, gpointer data) {
+  im_wspool * pool = g_new0(im_wspool,1);
+  pool->func = func;
+  pool->free_task = free_task;
+  pool->data = data;
+  pool->n_workers = MAX(n_threads,1);
+  pool->workers = g_new0(worker,pool->n_workers);
+  for (guint idx = 0; idx < pool->n_workers; idx++) {
+    worker * w = &pool->workers[idx];
+    w->pool = pool;
+    w->idx = idx;
+    g_mutex_init(&w->lock);
+    g_queue_init(&w->deque);
+  }
+  g_mutex_init(&pool->idle_lock);
+  g_cond_init(&pool->idle_cond);
+  return pool;
+}
+
+gboolean im_wspool_start(im_wspool * pool, GError ** error) {
+  for (guint idx = 0; idx < pool->n_workers; idx++) {
+    worker * w = &pool->workers[idx];
+    gchar * name = g_strdup_printf("im-worker-%u",idx);
+    GError * local = NULL;
+    w->thread = g_thread_try_new(name,worker_main,w,&local);
+    g_free(name);
+    if (w->thread == NULL) {
+      if (idx > 0) {
+	// the ones already running will do the job
+	g_debug("running %u workers only: %s",idx,local->message);
+	g_error_free(local);
+	return TRUE;
+      }
+      g_propagate_error(error,local);
+      return FALSE;
+    }
+  }
+  return TRUE;
+}
+
+void im_wspool_push(im_wspool * pool, gpointer task) {
+  worker * self = g_private_get(&current_worker);
+  if (self == NULL || self->pool != pool) {
+    // from outside: spread the seeds
+    guint pushed = g_atomic_int_get(&pool->pending);
+    self = &pool->workers[pushed % pool->n_workers];
+  }
+  g_atomic_int_inc(&pool->pending);
+  g_mutex_lock(&self->lock);
+  g_queue_push_head(&self->deque,task);
+  g_mutex_unlock(&self->lock);
+  g_atomic_int_inc(&pool->queued);
+  g_mutex_lock(&pool->idle_lock);
+  g_cond_signal(&pool->idle_cond);
+  g_mutex_unlock(&pool->idle_lock);
+}
+
+void im_wspool_cancel(im_wspool * pool) {
+  g_atomic_int_set(&pool->cancelled,TRUE);
+  g_mutex_lock(&pool->idle_lock);
+  g_cond_broadcast(&pool->idle_cond);
+  g_mutex_unlock(&pool->idle_lock);
+}
+
+void im_wspool_free(im_wspool * pool) {
+  if (pool == NULL) {
+    return;
+  }
+  for (guint idx = 0; idx < pool->n_workers; idx++) {
+    worker * w = &pool->workers[idx];
+    if (w->thread != NULL) {
+      g_thread_join(w->thread);
+    }
+  }
+  for (guint idx = 0; idx < pool->n_workers; idx++) {
+    worker * w = &pool->workers[idx];
+    // tasks left by a cancel
+    gpointer task;
+    while ((task = g_queue_pop_head(&w->deque)) != NULL) {
+      if (pool->free_task != NULL) {
+	pool->free_task(task);
+      }
+    }
+    g_mutex_clear(&w->lock);
+  }
+  g_mutex_clear(&pool->idle_lock);
+  g_cond_clear(&pool->idle_cond);
+  g_free(pool->workers);
+  g_free(pool);
+}
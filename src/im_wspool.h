@@ -0,0 +1,43 @@
+/* im_wspool.h - a small work-stealing thread pool
+ *
+ * Copyright (C) 2016 Leo Cacciari <leo.cacciari@gmail.com>
+ *
+ * This file belongs to the isomounter project.
+ * isomounter is free software and is distributed under the terms of the
+ * GNU GPL. See the file COPYING for details.
+ */
+#ifndef __IM_WSPOOL_H__
+#define __IM_WSPOOL_H__
+#include "common.h"
+
+typedef struct im_wspool_s im_wspool;
+
+/* runs a task; it may push more tasks to pool */
+typedef void (*im_wspool_func)(im_wspool * pool, gpointer task, gpointer data);
+
+/**
+ * Each worker has its own deque: it pushes and pops the tasks it
+ * spawns at the head (depth first, cache friendly) and, when it runs
+ * dry, steals from the tail of the others'. The workers exit as soon
+ * as no task is left, so a pool runs one job, seeded with
+ * im_wspool_push() before im_wspool_start().
+ * free_task, if not NULL, frees the tasks dropped by a cancel.
+ */
+im_wspool * im_wspool_new(guint n_threads, im_wspool_func func,
+			  GDestroyNotify free_task, gpointer data);
+gboolean im_wspool_start(im_wspool * pool, GError ** error);
+void im_wspool_push(im_wspool * pool, gpointer task);
+
+/**
+ * Make the workers stop after their current task. Tasks left are
+ * dropped without running.
+ */
+void im_wspool_cancel(im_wspool * pool);
+
+/**
+ * Wait for the job to end (or the cancel to take effect) and free
+ * pool.
+ */
+void im_wspool_free(im_wspool * pool);
+
+#endif /*__IM_WSPOOL_H__*/
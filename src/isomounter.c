@@ -10,10 +10,10 @@
 #include "common.h"
 #include "im_config.h"
 #include "if_utils.h"
+#include "if_session.h"
+#include "im_extract.h"
 #include <glib/gstdio.h>
 
-G_DEFINE_QUARK(isomounter-error-quark,im_error);
-
 int main(int argc,char **argv) {
   GError *error = NULL;
 #ifndef NDEBUG
@@ -46,6 +46,25 @@ int main(int argc,char **argv) {
     g_error("image file: %s",error->message);
     exit(1);
   }
+  const im_config_t * config = im_get_config();
+  if (config->extract_dest != NULL) {
+    // extraction mode: nothing gets mounted
+    if (! config->dry_run) {
+      // the image opens as it would to be mounted
+      if_status * status = if_status_new();
+      ok = im_extract(config->image_path,&status->open_options,config->extract_dest,
+		      config->extract_threads,&error);
+      if_status_destroy(status);
+      im_config_wipe_key();
+      if (!ok) {
+	g_error("extract: %s",error->message);
+	exit(1);
+      }
+    } else {
+      g_print("will extract %s to %s\n",config->image_path,config->extract_dest);
+    }
+    exit(0);
+  }
 #ifndef NDEBUG
   g_print("checking mountpoint\n");
 #endif
@@ -74,19 +93,20 @@ int main(int argc,char **argv) {
   
   if (! im_get_config()->dry_run) {
 #ifndef NDEBUG
-    g_print("calling fuse_main.\n");
+    g_print("starting the fuse session.\n");
     g_print("mountpoint %s will%s be removed on exit\n",
 	    im_get_config()->mountpoint,
 	    status->mountpoint_managed ? "" : " not");
 #endif
-    result = fuse_main(g_strv_length(f_argv),f_argv,&isofuse_ops,status);
+    result = if_session_main(f_argv,status,im_get_config()->takeover);
   } else {
     gchar * cline = g_strjoinv(" ",f_argv);
-    g_print("invoking fuse_main with arguments:\n");
+    g_print("starting the fuse session with arguments:\n");
     g_print("\t%s\n",cline);
     g_free(cline);
   }
-  if (status->mountpoint_managed) {
+  // after a takeover the mountpoint is still in use
+  if (status->mountpoint_managed && status->phase != HANDED_OVER) {
     if (! im_get_config()->dry_run) {
       result = g_rmdir(im_get_config()->mountpoint);
       if (result != 0) {
@@ -96,6 +116,7 @@ int main(int argc,char **argv) {
       g_print("will remove managed mountpoint %s\n",im_get_config()->mountpoint);
     }
   }
+  im_config_wipe_key();
   exit(result);
 }
 
@@ -0,0 +1,467 @@
+/* test_rockridge.c - tests on a small handmade image
+ *
+ * Copyright (C) 2016 Leo Cacciari <leo.cacciari@gmail.com>
+ *
+ * This file belongs to the isomounter project.
+ * isomounter is free software and is distributed under the terms of the
+ * GNU GPL. See the file COPYING for details.
+ */
+#include "common.h"
+#include "im_image.h"
+#include "im_dirrec.h"
+#include "im_pathtab.h"
+#include "im_extract.h"
+#include <glib/gstdio.h>
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+/* where things are in the image */
+#define PVD_SECTOR 16
+#define PVD_PATH_TABLE_SIZE 132
+#define PVD_L_PATH_TABLE 140
+#define PVD_ROOT 156
+#define ROOT_SECTOR 18
+#define CE_SECTOR 19
+#define TABLE_SECTOR 19 // the path table, in the image without Rock Ridge
+#define DATA_SECTOR 20
+#define SUBDIR_SECTOR 21
+#define MULTI_SECTOR_A 22 // the extents of a file, out of order
+#define MULTI_SECTOR_C 23
+#define MULTI_SECTOR_B 24
+#define N_SECTORS 25
+
+#define DATA "hello\n"
+#define LONG_NAME "A rather long name, longer than any ISO9660 identifier.txt"
+#define LONG_SPLIT 14 // bytes of LONG_NAME in the record, the rest in the CE area
+#define MULTI_TAIL 100 // bytes in the last extent
+#define MULTI_SIZE (2 * IM_SECTOR_SIZE + MULTI_TAIL)
+
+static void put_both32(guint8 * p, guint32 value) {
+  for (guint idx = 0; idx < 4; idx++) {
+    p[idx] = value >> (8 * idx);
+    p[7 - idx] = value >> (8 * idx);
+  }
+}
+
+static gsize put_su(guint8 * p, const gchar * sig, const guint8 * data, gsize size) {
+  p[0] = sig[0];
+  p[1] = sig[1];
+  p[2] = 4 + size;
+  p[3] = 1;
+  memcpy(p + 4,data,size);
+  return 4 + size;
+}
+
+static gsize put_nm(guint8 * p, guint8 flags, const gchar * name, gsize len) {
+  guint8 data[256];
+  data[0] = flags;
+  memcpy(data + 1,name,len);
+  return put_su(p,"NM",data,len + 1);
+}
+
+static gsize put_ce(guint8 * p, guint32 extent, guint32 offset, guint32 size) {
+  guint8 data[24];
+  put_both32(data,extent);
+  put_both32(data + 8,offset);
+  put_both32(data + 16,size);
+  return put_su(p,"CE",data,sizeof(data));
+}
+
+/* a directory record at p, with su_size bytes of System Use area */
+static gsize put_record(guint8 * p, guint32 extent, guint32 size, guint8 flags,
+			const gchar * id, gsize id_len, const guint8 * su, gsize su_size) {
+  gsize start = DR_NAME + id_len + !(id_len & 1);
+  gsize length = (start + su_size + 1) & ~1;
+  memset(p,0,length);
+  p[DR_LENGTH] = length;
+  put_both32(p + DR_EXTENT,extent);
+  put_both32(p + DR_SIZE,size);
+  p[DR_FLAGS] = flags;
+  p[DR_NAME_LEN] = id_len;
+  memcpy(p + DR_NAME,id,id_len);
+  memcpy(p + start,su,su_size);
+  return length;
+}
+
+static gsize put_file(guint8 * p, const gchar * id, const gchar * name) {
+  guint8 su[256];
+  gsize su_size = name != NULL ? put_nm(su,0,name,strlen(name)) : 0;
+  return put_record(p,DATA_SECTOR,strlen(DATA),0,id,strlen(id),su,su_size);
+}
+
+static gsize put_self_parent(guint8 * p, guint32 self, guint32 parent, gboolean sp) {
+  static const guint8 sp_data[] = { 0xbe, 0xef, 0 };
+  guint8 su[16];
+  gsize su_size = sp ? put_su(su,"SP",sp_data,sizeof(sp_data)) : 0;
+  gsize pos = put_record(p,self,IM_SECTOR_SIZE,DR_FLAG_DIR,"\0",1,su,su_size);
+  return pos + put_record(p + pos,parent,IM_SECTOR_SIZE,DR_FLAG_DIR,"\1",1,NULL,0);
+}
+
+/* a path table record at p, directories are numbered from 1 */
+static gsize put_table_record(guint8 * p, guint32 extent, guint16 parent,
+			      const gchar * id, gsize id_len) {
+  p[PT_NAME_LEN] = id_len;
+  p[PT_EXTENT] = extent;
+  p[PT_PARENT] = parent;
+  memcpy(p + PT_NAME,id,id_len);
+  return PT_NAME + id_len + (id_len & 1);
+}
+
+/* the volume descriptors, the rest is up to the caller */
+static guint8 * new_image(void) {
+  guint8 * image = g_malloc0(N_SECTORS * IM_SECTOR_SIZE);
+  guint8 * pvd = image + PVD_SECTOR * IM_SECTOR_SIZE;
+  pvd[0] = 1;
+  memcpy(pvd + 1,"CD001",5);
+  pvd[6] = 1;
+  put_record(pvd + PVD_ROOT,ROOT_SECTOR,IM_SECTOR_SIZE,DR_FLAG_DIR,"\0",1,NULL,0);
+  guint8 * terminator = pvd + IM_SECTOR_SIZE;
+  terminator[0] = 255;
+  memcpy(terminator + 1,"CD001",5);
+  return image;
+}
+
+/* image into a temporary file, whose path is returned */
+static gchar * write_image(guint8 * image) {
+  gchar * path = NULL;
+  GError * error = NULL;
+  int fd = g_file_open_tmp("isomounter-XXXXXX.iso",&path,&error);
+  g_assert_no_error(error);
+  g_assert_cmpint(write(fd,image,N_SECTORS * IM_SECTOR_SIZE),==,N_SECTORS * IM_SECTOR_SIZE);
+  close(fd);
+  g_free(image);
+  return path;
+}
+
+/*
+ * An image with no path table: in the root a file with a Rock Ridge
+ * name, one whose name goes on in a continuation area, one without and
+ * a directory with another file in it and one in three extents; and
+ * one called extra, if not NULL.
+ */
+static gchar * make_image(const gchar * extra) {
+  guint8 * image = new_image();
+  guint8 * root = image + ROOT_SECTOR * IM_SECTOR_SIZE;
+  gsize pos = put_self_parent(root,ROOT_SECTOR,ROOT_SECTOR,TRUE);
+  pos += put_file(root + pos,"README.TXT;1","ReadMe.txt");
+  pos += put_file(root + pos,"PLAIN.;1",NULL);
+  if (extra != NULL) {
+    pos += put_file(root + pos,"EXTRA.;1",extra);
+  }
+
+  guint8 * ce = image + CE_SECTOR * IM_SECTOR_SIZE;
+  gsize ce_size = put_nm(ce + 100,0,LONG_NAME + LONG_SPLIT,strlen(LONG_NAME) - LONG_SPLIT);
+  ce_size += put_su(ce + 100 + ce_size,"ST",NULL,0);
+  guint8 su[256];
+  gsize su_size = put_nm(su,1,LONG_NAME,LONG_SPLIT);
+  su_size += put_ce(su + su_size,CE_SECTOR,100,ce_size);
+  pos += put_record(root + pos,DATA_SECTOR,strlen(DATA),0,"LONGNAME.;1",11,su,su_size);
+
+  su_size = put_nm(su,0,"SubDir",6);
+  put_record(root + pos,SUBDIR_SECTOR,IM_SECTOR_SIZE,DR_FLAG_DIR,"SUBDIR",6,su,su_size);
+  guint8 * subdir = image + SUBDIR_SECTOR * IM_SECTOR_SIZE;
+  pos = put_self_parent(subdir,SUBDIR_SECTOR,ROOT_SECTOR,FALSE);
+  pos += put_file(subdir + pos,"DEEP.;1","Deep File");
+  su_size = put_nm(su,0,"Multi",5);
+  pos += put_record(subdir + pos,MULTI_SECTOR_A,IM_SECTOR_SIZE,DR_FLAG_MULTI_EXTENT,
+		    "MULTI.;1",8,su,su_size);
+  pos += put_record(subdir + pos,MULTI_SECTOR_B,IM_SECTOR_SIZE,DR_FLAG_MULTI_EXTENT,
+		    "MULTI.;1",8,NULL,0);
+  put_record(subdir + pos,MULTI_SECTOR_C,MULTI_TAIL,0,"MULTI.;1",8,NULL,0);
+  memset(image + MULTI_SECTOR_A * IM_SECTOR_SIZE,'a',IM_SECTOR_SIZE);
+  memset(image + MULTI_SECTOR_B * IM_SECTOR_SIZE,'b',IM_SECTOR_SIZE);
+  memset(image + MULTI_SECTOR_C * IM_SECTOR_SIZE,'c',MULTI_TAIL);
+
+  memcpy(image + DATA_SECTOR * IM_SECTOR_SIZE,DATA,strlen(DATA));
+  return write_image(image);
+}
+
+/*
+ * A plain ISO9660 image with a path table: in the root a file and a
+ * directory with another file in it.
+ */
+static gchar * make_plain_image(void) {
+  guint8 * image = new_image();
+  guint8 * pvd = image + PVD_SECTOR * IM_SECTOR_SIZE;
+  guint8 * table = image + TABLE_SECTOR * IM_SECTOR_SIZE;
+  gsize table_size = put_table_record(table,ROOT_SECTOR,1,"\0",1);
+  table_size += put_table_record(table + table_size,SUBDIR_SECTOR,1,"SUBDIR",6);
+  put_both32(pvd + PVD_PATH_TABLE_SIZE,table_size);
+  pvd[PVD_L_PATH_TABLE] = TABLE_SECTOR;
+
+  guint8 * root = image + ROOT_SECTOR * IM_SECTOR_SIZE;
+  gsize pos = put_self_parent(root,ROOT_SECTOR,ROOT_SECTOR,FALSE);
+  pos += put_file(root + pos,"PLAIN.;1",NULL);
+  put_record(root + pos,SUBDIR_SECTOR,IM_SECTOR_SIZE,DR_FLAG_DIR,"SUBDIR",6,NULL,0);
+  guint8 * subdir = image + SUBDIR_SECTOR * IM_SECTOR_SIZE;
+  pos = put_self_parent(subdir,SUBDIR_SECTOR,ROOT_SECTOR,FALSE);
+  put_file(subdir + pos,"DEEP.;1",NULL);
+
+  memcpy(image + DATA_SECTOR * IM_SECTOR_SIZE,DATA,strlen(DATA));
+  return write_image(image);
+}
+
+static int collect(gpointer data, const gchar * name, const im_entry * entry) {
+  g_ptr_array_add(data,g_strdup(name));
+  return 0;
+}
+
+static gint compare(gconstpointer a, gconstpointer b) {
+  return strcmp(*(const gchar **) a,*(const gchar **) b);
+}
+
+static void check_image(im_image * image) {
+  im_entry entry;
+  g_assert_cmpint(im_image_lookup(image,"/ReadMe.txt",&entry),==,0);
+  g_assert_cmpuint(entry.offset,==,DATA_SECTOR * IM_SECTOR_SIZE);
+  g_assert_cmpuint(entry.size,==,strlen(DATA));
+  g_assert_cmpint(im_image_lookup(image,"/" LONG_NAME,&entry),==,0);
+  g_assert_cmpint(im_image_lookup(image,"/plain",&entry),==,0);
+  g_assert_cmpint(im_image_lookup(image,"/SubDir/Deep File",&entry),==,0);
+  g_assert_false(entry.is_dir);
+  // the ISO9660 names are hidden by the Rock Ridge ones
+  g_assert_cmpint(im_image_lookup(image,"/readme.txt",&entry),==,-ENOENT);
+  g_assert_cmpint(im_image_lookup(image,"/subdir",&entry),==,-ENOENT);
+  g_assert_cmpint(im_image_lookup(image,"/plain/below",&entry),==,-ENOTDIR);
+  g_assert_cmpint(im_image_lookup(image,"/SubDir/Deep File/x",&entry),==,-ENOTDIR);
+  g_assert_cmpint(im_image_lookup(image,"/none/below",&entry),==,-ENOENT);
+
+  GPtrArray * names = g_ptr_array_new_with_free_func(g_free);
+  g_assert_cmpint(im_image_readdir(image,"/",collect,names),==,0);
+  g_ptr_array_sort(names,compare);
+  g_assert_cmpuint(names->len,==,4);
+  g_assert_cmpstr(g_ptr_array_index(names,0),==,LONG_NAME);
+  g_assert_cmpstr(g_ptr_array_index(names,1),==,"ReadMe.txt");
+  g_assert_cmpstr(g_ptr_array_index(names,2),==,"SubDir");
+  g_assert_cmpstr(g_ptr_array_index(names,3),==,"plain");
+  g_ptr_array_free(names,TRUE);
+}
+
+/* what Multi holds from offset, size bytes */
+static gchar * multi_data(gsize offset, gsize size) {
+  gchar * data = g_malloc(size + 1);
+  for (gsize idx = 0; idx < size; idx++) {
+    gsize at = offset + idx;
+    data[idx] = at < IM_SECTOR_SIZE ? 'a' : at < 2 * IM_SECTOR_SIZE ? 'b' : 'c';
+  }
+  data[size] = '\0';
+  return data;
+}
+
+static void check_multi_read(im_image * image, const im_entry * entry,
+			     gsize offset, gsize size) {
+  gchar * buf = g_malloc0(size + 1);
+  g_assert_cmpint(im_image_read(image,entry,buf,size,offset),==,
+		  MIN(size,MULTI_SIZE - offset));
+  gchar * expected = multi_data(offset,MIN(size,MULTI_SIZE - offset));
+  g_assert_cmpstr(buf,==,expected);
+  g_free(expected);
+  g_free(buf);
+}
+
+static void check_multi(im_image * image) {
+  im_entry entry;
+  g_assert_cmpint(im_image_lookup(image,"/SubDir/Multi",&entry),==,0);
+  g_assert_true(entry.fragmented);
+  g_assert_cmpuint(entry.offset,==,MULTI_SECTOR_A * IM_SECTOR_SIZE);
+  g_assert_cmpuint(entry.size,==,MULTI_SIZE);
+  check_multi_read(image,&entry,0,MULTI_SIZE);
+  // across the first extent and the second, then the second and the last
+  check_multi_read(image,&entry,IM_SECTOR_SIZE - 8,16);
+  check_multi_read(image,&entry,2 * IM_SECTOR_SIZE - 6,10);
+  check_multi_read(image,&entry,IM_SECTOR_SIZE - 1,IM_SECTOR_SIZE + 2);
+  check_multi_read(image,&entry,MULTI_SIZE - 4,100);
+
+  GArray * runs = g_array_new(FALSE,FALSE,sizeof(im_run));
+  g_assert_cmpint(im_image_map(image,&entry,IM_SECTOR_SIZE - 8,IM_SECTOR_SIZE + 16,runs),==,0);
+  g_assert_cmpuint(runs->len,==,3);
+  const im_run * run = &g_array_index(runs,im_run,0);
+  g_assert_cmpuint(run[0].offset,==,(MULTI_SECTOR_A + 1) * IM_SECTOR_SIZE - 8);
+  g_assert_cmpuint(run[0].size,==,8);
+  g_assert_cmpuint(run[1].offset,==,MULTI_SECTOR_B * IM_SECTOR_SIZE);
+  g_assert_cmpuint(run[1].size,==,IM_SECTOR_SIZE);
+  g_assert_cmpuint(run[2].offset,==,MULTI_SECTOR_C * IM_SECTOR_SIZE);
+  g_assert_cmpuint(run[2].size,==,8);
+  g_array_free(runs,TRUE);
+}
+
+static void test_lookup(void) {
+  gchar * path = make_image(NULL);
+  GError * error = NULL;
+  im_image * image = im_image_open(path,&error);
+  g_assert_no_error(error);
+  check_image(image);
+  im_image_close(image);
+  unlink(path);
+  g_free(path);
+}
+
+static void test_path_table(void) {
+  gchar * path = make_plain_image();
+  GError * error = NULL;
+  im_image * image = im_image_open(path,&error);
+  g_assert_no_error(error);
+  im_entry entry;
+  g_assert_cmpint(im_image_lookup(image,"/plain",&entry),==,0);
+  g_assert_cmpuint(entry.offset,==,DATA_SECTOR * IM_SECTOR_SIZE);
+  g_assert_cmpint(im_image_lookup(image,"/subdir",&entry),==,0);
+  g_assert_true(entry.is_dir);
+  g_assert_cmpint(im_image_lookup(image,"/subdir/deep",&entry),==,0);
+  g_assert_false(entry.is_dir);
+  g_assert_cmpint(im_image_lookup(image,"/none",&entry),==,-ENOENT);
+  g_assert_cmpint(im_image_lookup(image,"/none/below",&entry),==,-ENOENT);
+  g_assert_cmpint(im_image_lookup(image,"/plain/below",&entry),==,-ENOTDIR);
+  g_assert_cmpint(im_image_lookup(image,"/subdir/deep/below",&entry),==,-ENOTDIR);
+  im_image_close(image);
+  unlink(path);
+  g_free(path);
+}
+
+static void test_prescan(void) {
+  gchar * path = make_image(NULL);
+  GError * error = NULL;
+  im_image * image = im_image_open(path,&error);
+  g_assert_no_error(error);
+  g_assert_true(im_image_prescan(image,2,&error));
+  g_assert_no_error(error);
+  check_image(image);
+  check_multi(image);
+  im_image_close(image);
+  unlink(path);
+  g_free(path);
+}
+
+static void test_multi_extent(void) {
+  gchar * path = make_image(NULL);
+  GError * error = NULL;
+  im_image * image = im_image_open(path,&error);
+  g_assert_no_error(error);
+  check_multi(image);
+  im_image_close(image);
+  unlink(path);
+  g_free(path);
+}
+
+/* the image cut in parts at odd places, as path.000 and on */
+static void test_split(void) {
+  gchar * path = make_image(NULL);
+  gchar * data = NULL;
+  gsize size = 0;
+  g_assert_true(g_file_get_contents(path,&data,&size,NULL));
+  // two of them in the extents of Multi
+  const gsize cuts[] = { 0, 3001, MULTI_SECTOR_A * IM_SECTOR_SIZE + 5,
+			 MULTI_SECTOR_C * IM_SECTOR_SIZE + 7, size };
+  for (guint idx = 0; idx + 1 < G_N_ELEMENTS(cuts); idx++) {
+    gchar * part = g_strdup_printf("%s.%03u",path,idx);
+    g_assert_true(g_file_set_contents(part,data + cuts[idx],cuts[idx + 1] - cuts[idx],NULL));
+    g_free(part);
+  }
+  gchar * first = g_strconcat(path,".000",NULL);
+  GError * error = NULL;
+  im_image * image = im_image_open(first,&error);
+  g_assert_no_error(error);
+  g_assert_cmpuint(im_image_size(image),==,size);
+  // every cut, and all of it
+  gchar * buf = g_malloc(size);
+  for (guint idx = 1; idx + 1 < G_N_ELEMENTS(cuts); idx++) {
+    g_assert_cmpint(im_image_pread(image,buf,64,cuts[idx] - 32),==,0);
+    g_assert_true(memcmp(buf,data + cuts[idx] - 32,64) == 0);
+  }
+  g_assert_cmpint(im_image_pread(image,buf,size,0),==,0);
+  g_assert_true(memcmp(buf,data,size) == 0);
+  g_free(buf);
+  check_image(image);
+  check_multi(image);
+  im_image_close(image);
+  for (guint idx = 0; idx + 1 < G_N_ELEMENTS(cuts); idx++) {
+    gchar * part = g_strdup_printf("%s.%03u",path,idx);
+    unlink(part);
+    g_free(part);
+  }
+  g_free(first);
+  g_free(data);
+  unlink(path);
+  g_free(path);
+}
+
+static void test_extract(void) {
+  gchar * path = make_image(NULL);
+  GError * error = NULL;
+  gchar * dest = g_dir_make_tmp("isomounter-XXXXXX",&error);
+  g_assert_no_error(error);
+  g_assert_true(im_extract(path,NULL,dest,2,&error));
+  g_assert_no_error(error);
+  gchar * deep = g_build_filename(dest,"SubDir","Deep File",NULL);
+  gchar * data = NULL;
+  g_assert_true(g_file_get_contents(deep,&data,NULL,NULL));
+  g_assert_cmpstr(data,==,DATA);
+  g_free(data);
+  g_unlink(deep);
+  g_free(deep);
+  gchar * multi = g_build_filename(dest,"SubDir","Multi",NULL);
+  g_assert_true(g_file_get_contents(multi,&data,NULL,NULL));
+  gchar * expected = multi_data(0,MULTI_SIZE);
+  g_assert_cmpstr(data,==,expected);
+  g_free(expected);
+  g_free(data);
+  g_unlink(multi);
+  g_free(multi);
+  gchar * dir = g_build_filename(dest,"SubDir",NULL);
+  g_rmdir(dir);
+  g_free(dir);
+  const gchar * names[] = { "ReadMe.txt", LONG_NAME, "plain" };
+  for (guint idx = 0; idx < G_N_ELEMENTS(names); idx++) {
+    gchar * file = g_build_filename(dest,names[idx],NULL);
+    g_unlink(file);
+    g_free(file);
+  }
+  g_assert_cmpint(g_rmdir(dest),==,0);
+  g_free(dest);
+  unlink(path);
+  g_free(path);
+}
+
+/* names that would take the file out of the destination */
+static void test_extract_unsafe(void) {
+  const gchar * names[] = { "..", ".", "../escaped", "a/b" };
+  for (guint idx = 0; idx < G_N_ELEMENTS(names); idx++) {
+    gchar * path = make_image(names[idx]);
+    GError * error = NULL;
+    gchar * parent = g_dir_make_tmp("isomounter-XXXXXX",&error);
+    g_assert_no_error(error);
+    gchar * dest = g_build_filename(parent,"dest",NULL);
+    g_assert_false(im_extract(path,NULL,dest,2,&error));
+    g_assert_error(error,IM_ERROR_DOMAIN,IM_ERROR_EXTRACT);
+    g_clear_error(&error);
+    // nothing was written, inside or out
+    gchar * escaped = g_build_filename(parent,"escaped",NULL);
+    g_assert_false(g_file_test(escaped,G_FILE_TEST_EXISTS));
+    g_free(escaped);
+    gchar * dir = g_build_filename(dest,"SubDir",NULL);
+    g_rmdir(dir);
+    g_free(dir);
+    g_assert_cmpint(g_rmdir(dest),==,0);
+    g_assert_cmpint(g_rmdir(parent),==,0);
+    g_free(dest);
+    g_free(parent);
+    unlink(path);
+    g_free(path);
+  }
+}
+
+int main(int argc, char ** argv) {
+  g_test_init(&argc,&argv,NULL);
+  g_test_add_func("/rockridge/lookup",test_lookup);
+  g_test_add_func("/rockridge/path_table",test_path_table);
+  g_test_add_func("/rockridge/prescan",test_prescan);
+  g_test_add_func("/rockridge/multi_extent",test_multi_extent);
+  g_test_add_func("/rockridge/split",test_split);
+  g_test_add_func("/rockridge/extract",test_extract);
+  g_test_add_func("/rockridge/extract_unsafe",test_extract_unsafe);
+  return g_test_run();
+}